@@ -0,0 +1,123 @@
+#ifndef __FITOS_QLOCK_H__
+#define __FITOS_QLOCK_H__
+
+// Fair queued spinlocks. pthread_spin_lock() is test-and-set: every waiter
+// hammers the same line and whoever wins the race gets it, so with dozens
+// of threads the line bounces on every release and unlucky threads starve.
+// The ticket lock hands the lock out in arrival order; the MCS lock does too
+// and lets every waiter spin on its own node, so a release touches only the
+// line of the next waiter.
+// Waiters yield the CPU now and then: with more threads than CPUs the next
+// in line may be preempted, and a fair lock cannot be passed over it.
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <errno.h>
+
+#include "../qcache.h"
+
+#define QLOCK_YIELD_SPINS 1024	// pauses between sched_yield() calls
+#define QLOCK_BACKOFF 64	// pause rounds per ticket ahead of us
+
+static inline void qlock_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+// pauses, or gives the CPU away once QLOCK_YIELD_SPINS pauses have piled up
+static inline void qlock_relax(unsigned *spins, unsigned pauses) {
+	*spins += pauses;
+	if (*spins >= QLOCK_YIELD_SPINS) {
+		*spins = 0;
+		sched_yield();
+		return;
+	}
+	while (pauses-- > 0)
+		qlock_pause();
+}
+
+typedef struct _QlockTicket {
+	unsigned next;		// taken by arriving threads
+	unsigned owner;		// ticket being served
+} qlock_ticket_t;
+
+static inline void qlock_ticket_init(qlock_ticket_t *l) {
+	l->next = l->owner = 0;
+}
+
+static inline void qlock_ticket_lock(qlock_ticket_t *l) {
+	unsigned ticket = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+	unsigned owner, spins = 0;
+	// back off in proportion to the queue ahead so the owner line is read less often
+	while ((owner = __atomic_load_n(&l->owner, __ATOMIC_ACQUIRE)) != ticket)
+		qlock_relax(&spins, (ticket - owner) * QLOCK_BACKOFF);
+}
+
+static inline int qlock_ticket_trylock(qlock_ticket_t *l) {
+	unsigned owner = __atomic_load_n(&l->owner, __ATOMIC_RELAXED);
+	unsigned next = owner;
+	if (!__atomic_compare_exchange_n(&l->next, &next, owner + 1, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return EBUSY;
+	return SUCCESS;
+}
+
+static inline void qlock_ticket_unlock(qlock_ticket_t *l) {
+	// only the holder writes owner
+	__atomic_store_n(&l->owner, l->owner + 1, __ATOMIC_RELEASE);
+}
+
+typedef struct _QlockMcsNode {
+	struct _QlockMcsNode *next;
+	int locked;		// the owner of this node spins here
+} QCACHE_ALIGNED qlock_mcs_node_t;
+
+typedef struct _QlockMcs {
+	qlock_mcs_node_t *tail;		// last waiter, NULL - free
+} qlock_mcs_t;
+
+static inline void qlock_mcs_init(qlock_mcs_t *l) {
+	l->tail = NULL;
+}
+
+static inline void qlock_mcs_lock(qlock_mcs_t *l, qlock_mcs_node_t *me) {
+	me->next = NULL;
+	me->locked = 1;
+	qlock_mcs_node_t *prev = __atomic_exchange_n(&l->tail, me, __ATOMIC_ACQ_REL);
+	if (prev == NULL)
+		return;
+
+	__atomic_store_n(&prev->next, me, __ATOMIC_RELEASE);
+	unsigned spins = 0;
+	while (__atomic_load_n(&me->locked, __ATOMIC_ACQUIRE))
+		qlock_relax(&spins, 1);
+}
+
+static inline int qlock_mcs_trylock(qlock_mcs_t *l, qlock_mcs_node_t *me) {
+	qlock_mcs_node_t *expected = NULL;
+	me->next = NULL;
+	if (!__atomic_compare_exchange_n(&l->tail, &expected, me, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return EBUSY;
+	return SUCCESS;
+}
+
+static inline void qlock_mcs_unlock(qlock_mcs_t *l, qlock_mcs_node_t *me) {
+	qlock_mcs_node_t *next = __atomic_load_n(&me->next, __ATOMIC_ACQUIRE);
+	if (next == NULL) {
+		qlock_mcs_node_t *expected = me;
+		if (__atomic_compare_exchange_n(&l->tail, &expected, NULL, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+		// a waiter swapped the tail but has not linked itself yet
+		unsigned spins = 0;
+		while ((next = __atomic_load_n(&me->next, __ATOMIC_ACQUIRE)) == NULL)
+			qlock_relax(&spins, 1);
+	}
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif		// __FITOS_QLOCK_H__
@@ -4,6 +4,11 @@
 
 #include "queue.h"
 
+static const char *lock_names[] = { "spin", "ticket", "mcs" };
+
+// a thread holds at most one queue lock at a time, so one MCS node each is enough
+static __thread qlock_mcs_node_t mcs_node;
+
 void *qmonitor(void *arg) {
 	queue_t *q = (queue_t *)arg;
 	printf("qmonitor: [%d %d %d]\n", getpid(), getppid(), gettid());
@@ -16,9 +21,13 @@ void *qmonitor(void *arg) {
 }
 
 queue_t* queue_init(int max_count) {
+	return queue_init_opts(max_count, NULL);
+}
+
+queue_t* queue_init_opts(int max_count, const queue_opts_t *opts) {
 	int err;
 
-	queue_t *q = malloc(sizeof(queue_t));
+	queue_t *q = qcache_alloc(sizeof(queue_t));
 	if (q == NULL) {
 		printf("Cannot allocate memory for a queue\n");
 		return NULL;
@@ -31,19 +40,40 @@ queue_t* queue_init(int max_count) {
 
 	q->add_attempts = q->get_attempts = 0;
 	q->add_count = q->get_count = 0;
+	memset(&q->prof, 0, sizeof(q->prof));
+
+	err = qpool_init(&q->pool, sizeof(qnode_t), max_count,
+		opts ? opts->storage : 0, opts ? opts->numa_node : QPOOL_NO_NODE);
+	if (err != SUCCESS) {
+		printf("queue_init: qpool_init() failed\n");
+		free(q);
+		return NULL;
+	}
 
+	q->lock = opts ? opts->lock : QUEUE_LOCK_SPIN;
+	if (q->lock < QUEUE_LOCK_SPIN || q->lock > QUEUE_LOCK_MCS) {
+		printf("queue_init: unknown lock type %d\n", q->lock);
+		qpool_destroy(&q->pool);
+		free(q);
+		return NULL;
+	}
+	qlock_ticket_init(&q->ticket);
+	qlock_mcs_init(&q->mcs);
 	err = pthread_spin_init(&q->spinlock, PTHREAD_PROCESS_PRIVATE);
 	if (err != SUCCESS) {
 		printf("queue_init: pthread_spin_init() failed: %s\n", strerror(err));
+		qpool_destroy(&q->pool);
 		free(q);
 		return NULL;
 	}
 
-	err = pthread_create(&q->qmonitor_tid, NULL, qmonitor, q);
+	q->monitored = opts == NULL || !opts->no_monitor;
+	err = q->monitored ? pthread_create(&q->qmonitor_tid, NULL, qmonitor, q) : SUCCESS;
 	if (err != SUCCESS) {
 		printf("queue_init: pthread_create() failed: %s\n", strerror(err));
 		err = pthread_spin_destroy(&q->spinlock); 
 		if (err != SUCCESS) printf("queue_init: pthread_spin_destroy() failed: %s\n", strerror(err));
+        qpool_destroy(&q->pool);
         free(q);
 		return NULL;
 	}
@@ -54,13 +84,15 @@ void queue_destroy(queue_t *q) {
 	if (q == NULL) return;
 
 	int err;
-	err = pthread_cancel(q->qmonitor_tid);
-    if (err != SUCCESS) {
-        printf("queue_destroy: pthread_cancel() failed: %s\n", strerror(err));
-    }	
-	err = pthread_join(q->qmonitor_tid, NULL);
-	if (err != SUCCESS) {
-		printf("queue_destroy: pthread_join() failed: %s\n", strerror(err));
+	if (q->monitored) {
+		err = pthread_cancel(q->qmonitor_tid);
+		if (err != SUCCESS) {
+			printf("queue_destroy: pthread_cancel() failed: %s\n", strerror(err));
+		}
+		err = pthread_join(q->qmonitor_tid, NULL);
+		if (err != SUCCESS) {
+			printf("queue_destroy: pthread_join() failed: %s\n", strerror(err));
+		}
 	}
 	err = pthread_spin_destroy(&q->spinlock);
 	if (err != SUCCESS) {
@@ -71,32 +103,92 @@ void queue_destroy(queue_t *q) {
 	while(current != NULL) {
 		qnode_t *tmp = current;
         current = current->next;
-        free(tmp);
+        qpool_free(&q->pool, tmp);
 	}
+	qpool_destroy(&q->pool);
 	free(q);
 }
 
+static int lock_acquire(queue_t *q) {
+	switch (q->lock) {
+	case QUEUE_LOCK_TICKET:
+		qlock_ticket_lock(&q->ticket);
+		return SUCCESS;
+	case QUEUE_LOCK_MCS:
+		qlock_mcs_lock(&q->mcs, &mcs_node);
+		return SUCCESS;
+	default:
+		return pthread_spin_lock(&q->spinlock);
+	}
+}
+
+static int lock_try(queue_t *q) {
+	switch (q->lock) {
+	case QUEUE_LOCK_TICKET:
+		return qlock_ticket_trylock(&q->ticket);
+	case QUEUE_LOCK_MCS:
+		return qlock_mcs_trylock(&q->mcs, &mcs_node);
+	default:
+		return pthread_spin_trylock(&q->spinlock);
+	}
+}
+
+// the profiled path pays for the clock only when profiling is switched on
+static int queue_lock(queue_t *q) {
+	if (!qprof_on(&q->prof))
+		return lock_acquire(q);
+
+	long start = 0;
+	if (lock_try(q) != SUCCESS) {
+		start = qprof_now();
+		int err = lock_acquire(q);
+		if (err != SUCCESS)
+			return err;
+	}
+	qprof_acquired(&q->prof, start);
+	return SUCCESS;
+}
+
+static int queue_unlock(queue_t *q) {
+	qprof_release(&q->prof);
+	switch (q->lock) {
+	case QUEUE_LOCK_TICKET:
+		qlock_ticket_unlock(&q->ticket);
+		return SUCCESS;
+	case QUEUE_LOCK_MCS:
+		qlock_mcs_unlock(&q->mcs, &mcs_node);
+		return SUCCESS;
+	default:
+		return pthread_spin_unlock(&q->spinlock);
+	}
+}
+
 int queue_add(queue_t *q, int val) {
 	if (q == NULL) return QUEUE_ERROR;
 
 	int err;	
-	err = pthread_spin_lock(&q->spinlock);
+	long start = qtrace_on() ? qprof_now() : 0;
+	err = queue_lock(q);
 	if (err != SUCCESS) {
 		printf("queue_add: pthread_spin_lock() failed: %s\n", strerror(err));
 		return QUEUE_ERROR;
 	}
 
+	long acquired = start ? qprof_now() : 0;
 	q->add_attempts++;
 	if (q->count == q->max_count) {
-		err = pthread_spin_unlock(&q->spinlock);
+		if (start) qtrace_record(q, QTRACE_ADD_FULL, q->count, start, acquired);
+		err = queue_unlock(q);
 		if (err != SUCCESS) printf("queue_add: pthread_spin_unlock() failed: %s\n", strerror(err)); 
 		return QUEUE_ERROR;
 	}		
 
-	qnode_t *new = malloc(sizeof(qnode_t));
+	long alloc = q->prof.acquired_ns ? qprof_now() : 0;
+	qnode_t *new = qpool_alloc(&q->pool);
+	if (alloc) q->prof.alloc_ns += qprof_now() - alloc;
 	if (new == NULL) {
 		printf("Cannot allocate memory for new node\n");
-		err = pthread_spin_unlock(&q->spinlock);
+		err = queue_unlock(q);
 		if (err != SUCCESS) printf("queue_add: pthread_spin_unlock() failed: %s\n", strerror(err)); 
 		return QUEUE_ERROR;
 	}
@@ -111,8 +203,9 @@ int queue_add(queue_t *q, int val) {
 	}
 	q->count++;
 	q->add_count++;
+	if (start) qtrace_record(q, QTRACE_ADD, q->count, start, acquired);
 
-	err = pthread_spin_unlock(&q->spinlock);
+	err = queue_unlock(q);
 	if (err != SUCCESS) { 
 		printf("queue_add: pthread_spin_unlock() failed: %s\n", strerror(err)); 
 	}
@@ -123,15 +216,18 @@ int queue_get(queue_t *q, int *val) {
 	if (q == NULL) return QUEUE_ERROR;
 	
 	int err;	
-	err = pthread_spin_lock(&q->spinlock);
+	long start = qtrace_on() ? qprof_now() : 0;
+	err = queue_lock(q);
 	if (err != SUCCESS) {
 		printf("queue_get: pthread_spin_lock() failed: %s\n", strerror(err));
 		return QUEUE_ERROR;
 	}
 	
+	long acquired = start ? qprof_now() : 0;
 	q->get_attempts++;
 	if (q->count == 0) {
-		err = pthread_spin_unlock(&q->spinlock);
+		if (start) qtrace_record(q, QTRACE_GET_EMPTY, q->count, start, acquired);
+		err = queue_unlock(q);
 		if (err != SUCCESS) printf("queue_get: pthread_spin_unlock() failed: %s\n", strerror(err)); 
 		return QUEUE_ERROR;
 	}
@@ -140,11 +236,12 @@ int queue_get(queue_t *q, int *val) {
 	*val = tmp->val;
 	q->first = q->first->next;
 	if (q->first == NULL) q->last = NULL;
-	free(tmp);
+	qpool_free(&q->pool, tmp);
 	q->count--;
 	q->get_count++;
+	if (start) qtrace_record(q, QTRACE_GET, q->count, start, acquired);
 
-	err = pthread_spin_unlock(&q->spinlock);
+	err = queue_unlock(q);
 	if (err != SUCCESS) {
 		printf("queue_get: pthread_spin_unlock() failed: %s\n", strerror(err)); 
 	}
@@ -152,8 +249,28 @@ int queue_get(queue_t *q, int *val) {
 }
 
 void queue_print_stats(queue_t *q) {
-	printf("queue stats: current size %d; attempts: (%ld %ld %ld); counts (%ld %ld %ld)\n",
-		q->count,
+	printf("queue stats: lock %s; current size %d; attempts: (%ld %ld %ld); counts (%ld %ld %ld)\n",
+		lock_names[q->lock], q->count,
 		q->add_attempts, q->get_attempts, q->add_attempts - q->get_attempts,  //попытки
 		q->add_count, q->get_count, q->add_count -q->get_count);
+	qprof_print(&q->prof);
+}
+
+void queue_set_profiling(queue_t *q, int enabled) {
+	if (q == NULL) return;
+	qprof_set(&q->prof, enabled);
+}
+
+int queue_lock_type(const char *name) {
+	for (int i = QUEUE_LOCK_SPIN; i <= QUEUE_LOCK_MCS; i++) {
+		if (strcmp(name, lock_names[i]) == 0)
+			return i;
+	}
+	return ERROR;
+}
+
+const char *queue_lock_name(int lock) {
+	if (lock < QUEUE_LOCK_SPIN || lock > QUEUE_LOCK_MCS)
+		return "unknown";
+	return lock_names[lock];
 }
@@ -9,36 +9,77 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "../qcache.h"
+#include "../qpool.h"
+#include "../qprof.h"
+#include "../qtrace.h"
+
 #define SUCCESS 0
 #define ERROR -1
 #define QUEUE_ERROR 0
 #define QUEUE_SUCCESS 1
 
+#include "qlock.h"
+
+// queue_opts_t.lock
+enum {
+	QUEUE_LOCK_SPIN,	// pthread_spin_lock(): cheapest alone, unfair under contention
+	QUEUE_LOCK_TICKET,	// FIFO, waiters read one shared counter
+	QUEUE_LOCK_MCS,		// FIFO, every waiter spins on its own line
+};
+#define QUEUE_HAS_LOCKS		// queue-stress -l
+#define QUEUE_LOCK_NAMES "spin|ticket|mcs"
+
 typedef struct _QueueNode {
 	int val;
 	struct _QueueNode *next;
 } qnode_t;
 
-typedef struct _Queue {
-	qnode_t *first;
-	qnode_t *last;
+typedef struct _QueueOpts {
+	int storage;		// QPOOL_* flags, 0 - nodes come from malloc()
+	int numa_node;		// QPOOL_NO_NODE - leave placement to the kernel
+	int no_monitor;		// do not start the qmonitor thread
+	int lock;		// QUEUE_LOCK_*
+} queue_opts_t;
 
+typedef struct _Queue {
+	// set up once, read afterwards
 	pthread_t qmonitor_tid;
-	pthread_spinlock_t spinlock;
+	int monitored;
+	int max_count;
 
+	// the lock and what both sides write under it
+	QCACHE_ALIGNED pthread_spinlock_t spinlock;
+	qlock_ticket_t ticket;
+	qlock_mcs_t mcs;
+	int lock;
 	int count;
-	int max_count;
 
+	// producer side
+	QCACHE_ALIGNED qnode_t *last;
 	long add_attempts;
-	long get_attempts;
 	long add_count;
+
+	// consumer side
+	QCACHE_ALIGNED qnode_t *first;
+	long get_attempts;
 	long get_count;
+
+	// the free list is shared by both sides
+	QCACHE_ALIGNED qpool_t pool;
+
+	QCACHE_ALIGNED qprof_t prof;
 } queue_t;
 
 queue_t* queue_init(int max_count);
+queue_t* queue_init_opts(int max_count, const queue_opts_t *opts);
 void queue_destroy(queue_t *q);
 int queue_add(queue_t *q, int val);
 int queue_get(queue_t *q, int *val);
 void queue_print_stats(queue_t *q);
+void queue_set_profiling(queue_t *q, int enabled);
+// QUEUE_LOCK_* for "spin", "ticket" or "mcs", ERROR for anything else
+int queue_lock_type(const char *name);
+const char *queue_lock_name(int lock);
 
 #endif		// __FITOS_QUEUE_H__
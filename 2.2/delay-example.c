@@ -0,0 +1,125 @@
+// Delayed items on the blocking mutex+condvar queue:
+//   gcc -If delay-example.c f/queue.c f/twheel.c qpool.c qtrace.c -lpthread
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "queue.h"
+
+#define RED "\033[41m"
+#define NOCOLOR "\033[0m"
+#define ITEMS 20000
+#define CONSUMERS 2
+#define MAX_DELAY_MS 5000		// past 4096 ms items start on the third wheel level
+#define POISON -1
+
+static queue_t *q;
+static struct timespec deadlines[ITEMS];
+static long late_ns[CONSUMERS];
+static long max_late_ns[CONSUMERS];
+static long received[CONSUMERS];
+static long early[CONSUMERS];
+
+static long ts_ns(const struct timespec *ts) {
+	return ts->tv_sec * 1000000000L + ts->tv_nsec;
+}
+
+void *consumer(void *arg) {
+	long id = (long)arg;
+
+	while (1) {
+		int val;
+		if (queue_get(q, &val) != QUEUE_SUCCESS)
+			continue;
+		if (val == POISON)
+			break;
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long late = ts_ns(&now) - ts_ns(&deadlines[val]);
+		if (late < 0) {
+			if (early[id]++ < 10)
+				printf(RED "ERROR: item %d handed out %ld ns early" NOCOLOR "\n", val, -late);
+			continue;
+		}
+		received[id]++;
+		late_ns[id] += late;
+		if (late > max_late_ns[id])
+			max_late_ns[id] = late;
+	}
+	return NULL;
+}
+
+int main() {
+	pthread_t tids[CONSUMERS];
+	int err;
+
+	printf("main [%d %d %d]\n", getpid(), getppid(), gettid());
+	queue_opts_t opts = {
+		.storage = QPOOL_PREALLOC,
+		.numa_node = QPOOL_NO_NODE,
+		.no_monitor = 1,
+	};
+	q = queue_init_opts(ITEMS + CONSUMERS, &opts);
+	if (q == NULL) {
+		printf(RED "ERROR: Failed to initialize queue" NOCOLOR "\n");
+		return ERROR;
+	}
+
+	for (long i = 0; i < CONSUMERS; i++) {
+		err = pthread_create(&tids[i], NULL, consumer, (void *)i);
+		if (err != SUCCESS) {
+			printf("main: pthread_create() failed: %s\n", strerror(err));
+			return ERROR;
+		}
+	}
+
+	struct timespec start, last;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last = start;
+	srand(getpid());
+	for (int i = 0; i < ITEMS; i++) {
+		long at = ts_ns(&start) + (rand() % (MAX_DELAY_MS * 1000L)) * 1000L;
+		deadlines[i].tv_sec = at / 1000000000L;
+		deadlines[i].tv_nsec = at % 1000000000L;
+		if (at > ts_ns(&last))
+			last = deadlines[i];
+		if (queue_add_at(q, i, &deadlines[i]) != QUEUE_SUCCESS) {
+			printf(RED "ERROR: queue_add_at() failed" NOCOLOR "\n");
+			return ERROR;
+		}
+	}
+
+	// the pills are due after every item
+	long pill = ts_ns(&last) + 2000000;
+	last.tv_sec = pill / 1000000000L;
+	last.tv_nsec = pill % 1000000000L;
+	for (int i = 0; i < CONSUMERS; i++) {
+		if (queue_add_at(q, POISON, &last) != QUEUE_SUCCESS) {
+			printf(RED "ERROR: queue_add_at() failed" NOCOLOR "\n");
+			return ERROR;
+		}
+	}
+
+	long total = 0, total_early = 0, total_late = 0, max_late = 0;
+	for (int i = 0; i < CONSUMERS; i++) {
+		err = pthread_join(tids[i], NULL);
+		if (err != SUCCESS)
+			printf("main: pthread_join() failed: %s\n", strerror(err));
+		total += received[i];
+		total_early += early[i];
+		total_late += late_ns[i];
+		if (max_late_ns[i] > max_late)
+			max_late = max_late_ns[i];
+	}
+
+	printf("main: %ld of %d items; early %ld; lateness avg %ld us max %ld us\n",
+		total, ITEMS, total_early, total ? total_late / total / 1000 : 0, max_late / 1000);
+	queue_print_stats(q);
+	queue_destroy(q);
+	return total == ITEMS && total_early == 0 ? SUCCESS : ERROR;
+}
@@ -4,6 +4,24 @@
 
 #include "queue.h"
 
+#define FC_SPINS 256		// slot checks before a waiter blocks on the mutex
+#define FC_PASSES 4		// a combiner stops earlier when a pass finds only its own call
+
+static const char *lock_names[] = { "mutex", "fc" };
+
+// flat combining slot of the calling thread, the same in every queue.
+// Ids of exited threads go to a free list and are handed out again before
+// new ones, so only threads alive at the same time compete for the slots.
+static int fc_next_id;
+static __thread int fc_id = ERROR;
+static pthread_key_t fc_key;
+static pthread_once_t fc_key_once = PTHREAD_ONCE_INIT;
+// Treiber stack of ids: id + 1 in the low half, 0 - empty, and a count of
+// pops in the high half, so a head popped and pushed back in between does
+// not let a stale compare-and-swap through
+static unsigned long fc_free_head;
+static int fc_free_next[QUEUE_FC_SLOTS];
+
 void *qmonitor(void *arg) {
 	queue_t *q = (queue_t *)arg;
 	printf("qmonitor: [%d %d %d]\n", getpid(), getppid(), gettid());
@@ -26,9 +44,13 @@ void *qmonitor(void *arg) {
 }
 
 queue_t* queue_init(int max_count) {
+	return queue_init_opts(max_count, NULL);
+}
+
+queue_t* queue_init_opts(int max_count, const queue_opts_t *opts) {
 	int err;
 
-	queue_t *q = malloc(sizeof(queue_t));
+	queue_t *q = qcache_alloc(sizeof(queue_t));
 	if (q == NULL) {
 		printf("Cannot allocate memory for a queue\n");
         return NULL;
@@ -40,19 +62,53 @@ queue_t* queue_init(int max_count) {
 	q->count = 0;
 	q->add_attempts = q->get_attempts = 0;
 	q->add_count = q->get_count = 0;
+	memset(&q->prof, 0, sizeof(q->prof));
+
+	err = qpool_init(&q->pool, sizeof(qnode_t), max_count,
+		opts ? opts->storage : 0, opts ? opts->numa_node : QPOOL_NO_NODE);
+	if (err != SUCCESS) {
+		printf("queue_init: qpool_init() failed\n");
+		free(q);
+		return NULL;
+	}
+
+	q->lock = opts ? opts->lock : QUEUE_LOCK_MUTEX;
+	q->fc_slots = NULL;
+	q->fc_used = 0;
+	q->fc_rounds = q->fc_ops = 0;
+	if (q->lock == QUEUE_LOCK_COMBINING) {
+		q->fc_slots = qcache_alloc(QUEUE_FC_SLOTS * sizeof(queue_fc_slot_t));
+		if (q->fc_slots == NULL) {
+			printf("Cannot allocate memory for combining slots\n");
+			qpool_destroy(&q->pool);
+			free(q);
+			return NULL;
+		}
+		memset(q->fc_slots, 0, QUEUE_FC_SLOTS * sizeof(queue_fc_slot_t));
+	} else if (q->lock != QUEUE_LOCK_MUTEX) {
+		printf("queue_init: unknown lock type %d\n", q->lock);
+		qpool_destroy(&q->pool);
+		free(q);
+		return NULL;
+	}
 
 	err = pthread_mutex_init(&q->mutex, NULL);
 	if (err != SUCCESS) {
 		printf("queue_init: pthread_mutex_init() failed: %s\n", strerror(err));
+		free(q->fc_slots);
+		qpool_destroy(&q->pool);
 		free(q);
 		return NULL;
 	}
 
-	err = pthread_create(&q->qmonitor_tid, NULL, qmonitor, q);
+	q->monitored = opts == NULL || !opts->no_monitor;
+	err = q->monitored ? pthread_create(&q->qmonitor_tid, NULL, qmonitor, q) : SUCCESS;
 	if (err != SUCCESS) {
 		printf("queue_init: pthread_create() failed: %s\n", strerror(err));
 		err = pthread_mutex_destroy(&q->mutex);
 		if (err != SUCCESS) printf("queue_init: pthread_mutex_destroy() failed: %s\n", strerror(err));
+		free(q->fc_slots);
+        qpool_destroy(&q->pool);
         free(q);
 		return NULL;
 	}
@@ -63,13 +119,15 @@ void queue_destroy(queue_t *q) {
 	if (q == NULL) return;
 
 	int err;
-	err = pthread_cancel(q->qmonitor_tid);
-    if (err != SUCCESS) {
-        printf("queue_destroy: pthread_cancel() failed: %s\n", strerror(err));
-    }	
-	err = pthread_join(q->qmonitor_tid, NULL);
-	if (err != SUCCESS) {
-		printf("queue_destroy: pthread_join() failed: %s\n", strerror(err));
+	if (q->monitored) {
+		err = pthread_cancel(q->qmonitor_tid);
+		if (err != SUCCESS) {
+			printf("queue_destroy: pthread_cancel() failed: %s\n", strerror(err));
+		}
+		err = pthread_join(q->qmonitor_tid, NULL);
+		if (err != SUCCESS) {
+			printf("queue_destroy: pthread_join() failed: %s\n", strerror(err));
+		}
 	}
 	err = pthread_mutex_destroy(&q->mutex);
 	if (err != SUCCESS) {
@@ -80,33 +138,45 @@ void queue_destroy(queue_t *q) {
 	while(current != NULL) {
 		qnode_t *tmp = current;
         current = current->next;
-        free(tmp);
+        qpool_free(&q->pool, tmp);
 	}
+	qpool_destroy(&q->pool);
+	free(q->fc_slots);
 	free(q);
 }
 
-int queue_add(queue_t *q, int val) {
-	if (q == NULL) return QUEUE_ERROR;
+// the profiled path pays for the clock only when profiling is switched on
+static int queue_lock(queue_t *q) {
+	if (!qprof_on(&q->prof))
+		return pthread_mutex_lock(&q->mutex);
 
-	int err;
-	err = pthread_mutex_lock(&q->mutex);
-	if (err != SUCCESS) {
-		printf("queue_add: pthread_mutex_lock() failed: %s\n", strerror(err));
-		return QUEUE_ERROR;
+	long start = 0;
+	if (pthread_mutex_trylock(&q->mutex) != SUCCESS) {
+		start = qprof_now();
+		int err = pthread_mutex_lock(&q->mutex);
+		if (err != SUCCESS)
+			return err;
 	}
+	qprof_acquired(&q->prof, start);
+	return SUCCESS;
+}
+
+static int queue_unlock(queue_t *q) {
+	qprof_release(&q->prof);
+	return pthread_mutex_unlock(&q->mutex);
+}
 
+// under the lock
+static int queue_put(queue_t *q, int val) {
 	q->add_attempts++;
-	if (q->count == q->max_count) {
-		err = pthread_mutex_unlock(&q->mutex);
-		if (err != SUCCESS) printf("queue_add: pthread_mutex_unlock() failed: %s\n", strerror(err)); 
+	if (q->count == q->max_count)
 		return QUEUE_ERROR;
-	}		
 
-	qnode_t *new = malloc(sizeof(qnode_t));
+	long alloc = q->prof.acquired_ns ? qprof_now() : 0;
+	qnode_t *new = qpool_alloc(&q->pool);
+	if (alloc) q->prof.alloc_ns += qprof_now() - alloc;
 	if (new == NULL) {
 		printf("Cannot allocate memory for new node\n");
-		err = pthread_mutex_unlock(&q->mutex);
-		if (err != SUCCESS) printf("queue_add: pthread_mutex_unlock() failed: %s\n", strerror(err)); 
 		return QUEUE_ERROR;
 	}
 
@@ -120,51 +190,247 @@ int queue_add(queue_t *q, int val) {
 	}
 	q->count++;
 	q->add_count++;
+	return QUEUE_SUCCESS;
+}
+
+// under the lock
+static int queue_take(queue_t *q, int *val) {
+	q->get_attempts++;
+	if (q->count == 0)
+		return QUEUE_ERROR;
+
+	qnode_t *tmp = q->first;
+	*val = tmp->val;
+	q->first = q->first->next;
+	if (q->first == NULL) q->last = NULL;
+	qpool_free(&q->pool, tmp);
+	q->count--;
+	q->get_count++;
+	return QUEUE_SUCCESS;
+}
+
+static int trace_op(int op, int ret) {
+	if (op == QUEUE_FC_ADD)
+		return ret == QUEUE_SUCCESS ? QTRACE_ADD : QTRACE_ADD_FULL;
+	return ret == QUEUE_SUCCESS ? QTRACE_GET : QTRACE_GET_EMPTY;
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
 
-	err = pthread_mutex_unlock(&q->mutex);
+static void fc_id_put(int id) {
+	unsigned long head = __atomic_load_n(&fc_free_head, __ATOMIC_RELAXED);
+	unsigned long next;
+	do {
+		__atomic_store_n(&fc_free_next[id], (int)(head & 0xffffffffUL), __ATOMIC_RELAXED);
+		next = (head & ~0xffffffffUL) | (unsigned long)(id + 1);
+	} while (!__atomic_compare_exchange_n(&fc_free_head, &head, next, 1,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static int fc_id_get(void) {
+	unsigned long head = __atomic_load_n(&fc_free_head, __ATOMIC_ACQUIRE);
+	unsigned long next;
+	do {
+		if ((head & 0xffffffffUL) == 0)
+			return ERROR;
+		int id = (int)(head & 0xffffffffUL) - 1;
+		next = ((head >> 32) + 1) << 32 | (unsigned)__atomic_load_n(&fc_free_next[id], __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&fc_free_head, &head, next, 1,
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	return (int)(head & 0xffffffffUL) - 1;
+}
+
+// runs at thread exit; calls are synchronous, so the slot is idle in every queue
+static void fc_id_release(void *arg) {
+	fc_id_put((int)(long)arg - 1);
+}
+
+static void fc_key_init(void) {
+	int err = pthread_key_create(&fc_key, fc_id_release);
+	if (err != SUCCESS) printf("fc_key_init: pthread_key_create() failed: %s\n", strerror(err));
+}
+
+// ERROR when every slot belongs to a live thread; asked again on the next call
+static int fc_id_take(void) {
+	pthread_once(&fc_key_once, fc_key_init);
+	int id = fc_id_get();
+	if (id == ERROR && __atomic_load_n(&fc_next_id, __ATOMIC_RELAXED) < QUEUE_FC_SLOTS) {
+		id = __atomic_fetch_add(&fc_next_id, 1, __ATOMIC_RELAXED);
+		if (id >= QUEUE_FC_SLOTS)
+			return ERROR;
+	}
+	if (id != ERROR && pthread_setspecific(fc_key, (void *)(long)(id + 1)) != SUCCESS) {
+		// without the destructor the id would leak, give it back now
+		fc_id_put(id);
+		return ERROR;
+	}
+	return id;
+}
+
+static queue_fc_slot_t *fc_slot(queue_t *q) {
+	if (fc_id == ERROR && (fc_id = fc_id_take()) == ERROR)
+		return NULL;
+
+	// the combiner scans up to the highest slot in use
+	int used = __atomic_load_n(&q->fc_used, __ATOMIC_RELAXED);
+	while (used <= fc_id && !__atomic_compare_exchange_n(&q->fc_used, &used, fc_id + 1, 1,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return &q->fc_slots[fc_id];
+}
+
+// under the lock: runs every published call, the holder's own among them,
+// while the queue lines stay in this core's cache
+static void queue_combine(queue_t *q) {
+	int used = __atomic_load_n(&q->fc_used, __ATOMIC_ACQUIRE);
+	for (int pass = 0; pass < FC_PASSES; pass++) {
+		long ops = 0;
+		for (int i = 0; i < used; i++) {
+			queue_fc_slot_t *slot = &q->fc_slots[i];
+			int op = __atomic_load_n(&slot->op, __ATOMIC_ACQUIRE);
+			if (op == QUEUE_FC_NONE)
+				continue;
+			slot->ret = op == QUEUE_FC_ADD ? queue_put(q, slot->val) : queue_take(q, &slot->val);
+			slot->depth = q->count;
+			// the owner may reuse the slot right after this
+			__atomic_store_n(&slot->op, QUEUE_FC_NONE, __ATOMIC_RELEASE);
+			ops++;
+		}
+		q->fc_ops += ops;
+		if (ops <= 1)
+			break;
+	}
+	q->fc_rounds++;
+}
+
+// publishes the call and waits until some lock holder has run it, or takes
+// the lock and runs it along with everybody else's
+static int queue_fc_call(queue_t *q, queue_fc_slot_t *slot, int op, int *val, const char *func) {
+	long start = qtrace_on() ? qprof_now() : 0;
+	slot->val = *val;
+	__atomic_store_n(&slot->op, op, __ATOMIC_RELEASE);
+
+	int err = SUCCESS;
+	for (int spins = 0; ; spins++) {
+		if (__atomic_load_n(&slot->op, __ATOMIC_ACQUIRE) == QUEUE_FC_NONE)
+			goto done;
+		if (pthread_mutex_trylock(&q->mutex) == SUCCESS) {
+			if (qprof_on(&q->prof)) qprof_acquired(&q->prof, 0);
+			break;
+		}
+		if (spins == FC_SPINS) {
+			// nobody is combining for us soon, or the holder is off the CPU
+			err = queue_lock(q);
+			break;
+		}
+		if (spins % 16 == 15)
+			sched_yield();
+		else
+			cpu_relax();
+	}
+	if (err != SUCCESS) {
+		printf("%s: pthread_mutex_lock() failed: %s\n", func, strerror(err));
+		// the call stays published, only a combiner can take it back safely
+		while (__atomic_load_n(&slot->op, __ATOMIC_ACQUIRE) != QUEUE_FC_NONE)
+			sched_yield();
+		goto done;
+	}
+	queue_combine(q);
+	err = queue_unlock(q);
+	if (err != SUCCESS) printf("%s: pthread_mutex_unlock() failed: %s\n", func, strerror(err));
+
+done:
+	*val = slot->val;
+	if (start) qtrace_record(q, trace_op(op, slot->ret), slot->depth, start, qprof_now());
+	return slot->ret;
+}
+
+int queue_add(queue_t *q, int val) {
+	if (q == NULL) return QUEUE_ERROR;
+
+	queue_fc_slot_t *slot;
+	if (q->lock == QUEUE_LOCK_COMBINING && (slot = fc_slot(q)) != NULL)
+		return queue_fc_call(q, slot, QUEUE_FC_ADD, &val, "queue_add");
+
+	int err;
+	long start = qtrace_on() ? qprof_now() : 0;
+	err = queue_lock(q);
+	if (err != SUCCESS) {
+		printf("queue_add: pthread_mutex_lock() failed: %s\n", strerror(err));
+		return QUEUE_ERROR;
+	}
+
+	long acquired = start ? qprof_now() : 0;
+	int ret = queue_put(q, val);
+	if (start) qtrace_record(q, trace_op(QUEUE_FC_ADD, ret), q->count, start, acquired);
+
+	err = queue_unlock(q);
 	if (err != SUCCESS) {
 		printf("queue_add: pthread_mutex_unlock() failed: %s\n", strerror(err)); 
 	}
-	return QUEUE_SUCCESS;
+	return ret;
 }
 
 int queue_get(queue_t *q, int *val) {
 	if (q == NULL) return QUEUE_ERROR;
 
+	queue_fc_slot_t *slot;
+	if (q->lock == QUEUE_LOCK_COMBINING && (slot = fc_slot(q)) != NULL)
+		return queue_fc_call(q, slot, QUEUE_FC_GET, val, "queue_get");
+
 	int err;	
-	err = pthread_mutex_lock(&q->mutex);
+	long start = qtrace_on() ? qprof_now() : 0;
+	err = queue_lock(q);
 	if (err != SUCCESS) {
 		printf("queue_get: pthread_mutex_lock() failed: %s\n", strerror(err));
 		return QUEUE_ERROR;
 	}
 	
-	q->get_attempts++;
-	if (q->count == 0) {
-		err = pthread_mutex_unlock(&q->mutex);
-		if (err != SUCCESS) printf("queue_get: pthread_mutex_unlock() failed: %s\n", strerror(err)); 
-		return QUEUE_ERROR;
-	}
+	long acquired = start ? qprof_now() : 0;
+	int ret = queue_take(q, val);
+	if (start) qtrace_record(q, trace_op(QUEUE_FC_GET, ret), q->count, start, acquired);
 
-	qnode_t *tmp = q->first;
-	*val = tmp->val;
-	q->first = q->first->next;
-	if (q->first == NULL) q->last = NULL;
-	free(tmp);
-	q->count--;
-	q->get_count++;
-
-	err = pthread_mutex_unlock(&q->mutex);
+	err = queue_unlock(q);
 	if (err != SUCCESS) {
 		printf("queue_get: pthread_mutex_unlock() failed: %s\n", strerror(err)); 
 	}
-	return QUEUE_SUCCESS;
+	return ret;
 }
 
 void queue_print_stats(queue_t *q) {
 	if (q == NULL) return;
 	
-	printf("queue stats: current size %d; attempts: (%ld %ld %ld); counts (%ld %ld %ld)\n",
-		q->count,
+	printf("queue stats: lock %s; current size %d; attempts: (%ld %ld %ld); counts (%ld %ld %ld)\n",
+		lock_names[q->lock], q->count,
 		q->add_attempts, q->get_attempts, q->add_attempts - q->get_attempts,  //попытки
 		q->add_count, q->get_count, q->add_count -q->get_count);
+	if (q->fc_rounds)
+		printf("combining stats: rounds %ld; calls %ld; %.1f calls per round\n",
+			q->fc_rounds, q->fc_ops, (double)q->fc_ops / q->fc_rounds);
+	qprof_print(&q->prof);
+}
+
+void queue_set_profiling(queue_t *q, int enabled) {
+	if (q == NULL) return;
+	qprof_set(&q->prof, enabled);
+}
+
+int queue_lock_type(const char *name) {
+	for (int i = QUEUE_LOCK_MUTEX; i <= QUEUE_LOCK_COMBINING; i++) {
+		if (strcmp(name, lock_names[i]) == 0)
+			return i;
+	}
+	return ERROR;
+}
+
+const char *queue_lock_name(int lock) {
+	if (lock < QUEUE_LOCK_MUTEX || lock > QUEUE_LOCK_COMBINING)
+		return "unknown";
+	return lock_names[lock];
 }
@@ -9,36 +9,93 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "../qcache.h"
+#include "../qpool.h"
+#include "../qprof.h"
+#include "../qtrace.h"
+
 #define SUCCESS 0
 #define ERROR -1
 #define QUEUE_ERROR 0
 #define QUEUE_SUCCESS 1
 
+// queue_opts_t.lock
+enum {
+	QUEUE_LOCK_MUTEX,	// every call takes the mutex for itself
+	QUEUE_LOCK_COMBINING,	// flat combining: the mutex holder runs everybody's calls
+};
+#define QUEUE_HAS_LOCKS		// queue-stress -l
+#define QUEUE_LOCK_NAMES "mutex|fc"
+
+// flat combining publication slots, one per live thread, reused after a
+// thread exits; threads past the last slot take the mutex themselves
+#define QUEUE_FC_SLOTS 128
+
+enum {
+	QUEUE_FC_NONE,		// nothing published, or the combiner is done with it
+	QUEUE_FC_ADD,
+	QUEUE_FC_GET,
+};
+
+typedef struct _QueueFcSlot {
+	int op;			// QUEUE_FC_*, set by the owner, reset by the combiner
+	int val;		// in for an add, out for a get
+	int ret;		// what queue_add() or queue_get() returns
+	int depth;		// queue size right after the call, for tracing
+} QCACHE_ALIGNED queue_fc_slot_t;
+
 typedef struct _QueueNode {
 	int val;
 	struct _QueueNode *next;
 } qnode_t;
 
-typedef struct _Queue {
-	qnode_t *first;
-	qnode_t *last;
+typedef struct _QueueOpts {
+	int storage;		// QPOOL_* flags, 0 - nodes come from malloc()
+	int numa_node;		// QPOOL_NO_NODE - leave placement to the kernel
+	int no_monitor;		// do not start the qmonitor thread
+	int lock;		// QUEUE_LOCK_*
+} queue_opts_t;
 
+typedef struct _Queue {
+	// set up once, read afterwards
 	pthread_t qmonitor_tid;
-	pthread_mutex_t mutex;
+	int monitored;
+	int max_count;
+	int lock;
+	queue_fc_slot_t *fc_slots;
+	int fc_used;		// slots below this may hold requests
 
+	// the lock and what both sides write under it
+	QCACHE_ALIGNED pthread_mutex_t mutex;
 	int count;
-	int max_count;
+	long fc_rounds;		// combining passes
+	long fc_ops;		// calls they ran
 
+	// producer side
+	QCACHE_ALIGNED qnode_t *last;
 	long add_attempts;
-	long get_attempts;
 	long add_count;
+
+	// consumer side
+	QCACHE_ALIGNED qnode_t *first;
+	long get_attempts;
 	long get_count;
+
+	// the free list is shared by both sides
+	QCACHE_ALIGNED qpool_t pool;
+
+	QCACHE_ALIGNED qprof_t prof;
 } queue_t;
 
 queue_t* queue_init(int max_count);
+queue_t* queue_init_opts(int max_count, const queue_opts_t *opts);
 void queue_destroy(queue_t *q);
 int queue_add(queue_t *q, int val);
 int queue_get(queue_t *q, int *val);
 void queue_print_stats(queue_t *q);
+void queue_set_profiling(queue_t *q, int enabled);
+// QUEUE_LOCK_* for "mutex" or "fc", ERROR for anything else
+int queue_lock_type(const char *name);
+const char *queue_lock_name(int lock);
 
 #endif		// __FITOS_QUEUE_H__
@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "executor.h"
+
+#define TASKS 200000
+#define CHILDREN 4
+
+static executor_t *ex;
+static exec_wait_t done;
+static long results[TASKS];
+
+void work(void *arg) {
+	long n = (long)arg;
+	long sum = 0;
+	for (long i = 0; i < 1000; i++)
+		sum += i * n;
+	results[n] = sum;
+}
+
+// every parent task submits a few children from inside the pool
+void parent(void *arg) {
+	long n = (long)arg;
+	for (long i = 0; i < CHILDREN; i++) {
+		long child = n + i;
+		while (executor_submit(ex, work, (void *)child, &done) != SUCCESS)
+			sched_yield();
+	}
+}
+
+int main() {
+	printf("main [%d %d %d]\n", getpid(), getppid(), gettid());
+
+	ex = executor_init(2, 8, 1024, 65536);
+	if (ex == NULL) {
+		printf("main: executor_init() failed\n");
+		return ERROR;
+	}
+	if (exec_wait_init(&done) != SUCCESS) {
+		executor_destroy(ex);
+		return ERROR;
+	}
+
+	for (long n = 0; n < TASKS; n += CHILDREN) {
+		while (executor_submit(ex, parent, (void *)n, &done) != SUCCESS)
+			sched_yield();
+	}
+	exec_wait(&done);
+
+	long bad = 0;
+	for (long n = 0; n < TASKS; n++) {
+		if (results[n] != n * 999 * 1000 / 2)
+			bad++;
+	}
+	printf("main: %d tasks done, %ld wrong results\n", TASKS, bad);
+	executor_print_stats(ex);
+
+	exec_wait_destroy(&done);
+	executor_destroy(ex);
+	return bad == 0 ? SUCCESS : ERROR;
+}
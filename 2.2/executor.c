@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "executor.h"
+
+#define IDLE_TIMEOUT_MS 200
+#define SPAWN_BACKLOG 2		// queued tasks per worker before another worker is started
+
+static __thread exec_worker_t *current_worker;
+
+void *exec_monitor(void *arg) {
+	executor_t *ex = (executor_t *)arg;
+	long last = 0;
+	printf("exec_monitor: [%d %d %d]\n", getpid(), getppid(), gettid());
+
+	while (1) {
+		long completed = __atomic_load_n(&ex->completed, __ATOMIC_RELAXED);
+		ex->rate = completed - last;
+		last = completed;
+		executor_print_stats(ex);
+		sleep(1);
+	}
+	return NULL;
+}
+
+int exec_wait_init(exec_wait_t *w) {
+	int err;
+	w->pending = 0;
+	err = pthread_mutex_init(&w->mutex, NULL);
+	if (err != SUCCESS) {
+		printf("exec_wait_init: pthread_mutex_init() failed: %s\n", strerror(err));
+		return ERROR;
+	}
+	err = pthread_cond_init(&w->cond, NULL);
+	if (err != SUCCESS) {
+		printf("exec_wait_init: pthread_cond_init() failed: %s\n", strerror(err));
+		pthread_mutex_destroy(&w->mutex);
+		return ERROR;
+	}
+	return SUCCESS;
+}
+
+void exec_wait_destroy(exec_wait_t *w) {
+	int err = pthread_cond_destroy(&w->cond);
+	if (err != SUCCESS) printf("exec_wait_destroy: pthread_cond_destroy() failed: %s\n", strerror(err));
+	err = pthread_mutex_destroy(&w->mutex);
+	if (err != SUCCESS) printf("exec_wait_destroy: pthread_mutex_destroy() failed: %s\n", strerror(err));
+}
+
+static void exec_wait_add(exec_wait_t *w, long n) {
+	pthread_mutex_lock(&w->mutex);
+	w->pending += n;
+	if (w->pending == 0)
+		pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+void exec_wait(exec_wait_t *w) {
+	pthread_mutex_lock(&w->mutex);
+	while (w->pending > 0)
+		pthread_cond_wait(&w->cond, &w->mutex);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+static int task_alloc(executor_t *ex, exec_fn_t fn, void *arg, exec_wait_t *wait) {
+	pthread_mutex_lock(&ex->tasks_lock);
+	int idx = ex->free_task;
+	if (idx != ERROR)
+		ex->free_task = ex->tasks[idx].next_free;
+	pthread_mutex_unlock(&ex->tasks_lock);
+	if (idx == ERROR)
+		return ERROR;
+
+	ex->tasks[idx].fn = fn;
+	ex->tasks[idx].arg = arg;
+	ex->tasks[idx].wait = wait;
+	return idx;
+}
+
+static void task_free(executor_t *ex, int idx) {
+	pthread_mutex_lock(&ex->tasks_lock);
+	ex->tasks[idx].next_free = ex->free_task;
+	ex->free_task = idx;
+	pthread_mutex_unlock(&ex->tasks_lock);
+}
+
+static int take_task(executor_t *ex, exec_worker_t *w) {
+	int idx;
+	if (queue_get(w->local, &idx) == QUEUE_SUCCESS)
+		return idx;
+	if (queue_get(ex->overflow, &idx) == QUEUE_SUCCESS)
+		return idx;
+
+	// retired workers' queues are scanned too, late submissions may land there
+	for (int i = 1; i < ex->max_workers; i++) {
+		exec_worker_t *victim = &ex->workers[(w->id + i) % ex->max_workers];
+		if (victim->local->count == 0)
+			continue;
+		if (queue_get(victim->local, &idx) == QUEUE_SUCCESS) {
+			w->stolen++;
+			return idx;
+		}
+	}
+	return ERROR;
+}
+
+static void run_task(executor_t *ex, int idx) {
+	exec_fn_t fn = ex->tasks[idx].fn;
+	void *arg = ex->tasks[idx].arg;
+	exec_wait_t *wait = ex->tasks[idx].wait;
+
+	task_free(ex, idx);
+	fn(arg);
+	__atomic_add_fetch(&ex->completed, 1, __ATOMIC_RELAXED);
+	if (wait != NULL)
+		exec_wait_add(wait, -1);
+}
+
+void *exec_worker(void *arg) {
+	exec_worker_t *w = (exec_worker_t *)arg;
+	executor_t *ex = w->ex;
+	current_worker = w;
+
+	while (1) {
+		int idx = take_task(ex, w);
+		if (idx != ERROR) {
+			__atomic_sub_fetch(&ex->queued, 1, __ATOMIC_SEQ_CST);
+			run_task(ex, idx);
+			w->executed++;
+			continue;
+		}
+
+		pthread_mutex_lock(&ex->lock);
+		// pairs with the queued/idle check in executor_submit(), one side always sees the other
+		__atomic_add_fetch(&ex->idle, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ex->queued, __ATOMIC_SEQ_CST) > 0) {
+			__atomic_sub_fetch(&ex->idle, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&ex->lock);
+			continue;
+		}
+		if (ex->shutdown) {
+			__atomic_sub_fetch(&ex->idle, 1, __ATOMIC_SEQ_CST);
+			break;
+		}
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += IDLE_TIMEOUT_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		int err = pthread_cond_timedwait(&ex->work, &ex->lock, &deadline);
+		__atomic_sub_fetch(&ex->idle, 1, __ATOMIC_SEQ_CST);
+
+		// an elastic pool gives back the workers it no longer needs
+		if (err == ETIMEDOUT && ex->nworkers > ex->min_workers
+			&& __atomic_load_n(&ex->queued, __ATOMIC_SEQ_CST) == 0)
+			break;
+		pthread_mutex_unlock(&ex->lock);
+	}
+
+	w->running = 0;
+	ex->nworkers--;
+	pthread_mutex_unlock(&ex->lock);
+	return NULL;
+}
+
+// caller holds ex->lock
+static int spawn_worker(executor_t *ex) {
+	int err;
+	for (int i = 0; i < ex->max_workers; i++) {
+		exec_worker_t *w = &ex->workers[i];
+		if (w->running)
+			continue;
+
+		if (w->started) {
+			err = pthread_join(w->tid, NULL);
+			if (err != SUCCESS) printf("spawn_worker: pthread_join() failed: %s\n", strerror(err));
+			w->started = 0;
+		}
+		w->running = 1;
+		err = pthread_create(&w->tid, NULL, exec_worker, w);
+		if (err != SUCCESS) {
+			printf("spawn_worker: pthread_create() failed: %s\n", strerror(err));
+			w->running = 0;
+			return ERROR;
+		}
+		w->started = 1;
+		ex->nworkers++;
+		return SUCCESS;
+	}
+	return ERROR;
+}
+
+executor_t* executor_init(int min_workers, int max_workers, int local_size, int max_tasks) {
+	int err;
+	if (min_workers < 1 || max_workers < min_workers || local_size < 1 || max_tasks < 1) {
+		printf("executor_init: bad arguments\n");
+		return NULL;
+	}
+
+	executor_t *ex = calloc(1, sizeof(executor_t));
+	if (ex == NULL) {
+		printf("Cannot allocate memory for an executor\n");
+		return NULL;
+	}
+	ex->min_workers = min_workers;
+	ex->max_workers = max_workers;
+	ex->max_tasks = max_tasks;
+
+	ex->tasks = malloc(max_tasks * sizeof(exec_task_t));
+	ex->workers = calloc(max_workers, sizeof(exec_worker_t));
+	if (ex->tasks == NULL || ex->workers == NULL) {
+		printf("Cannot allocate memory for an executor\n");
+		goto free_ex;
+	}
+	for (int i = 0; i < max_tasks; i++)
+		ex->tasks[i].next_free = i + 1 < max_tasks ? i + 1 : ERROR;
+	ex->free_task = 0;
+
+	// the executor monitor reports for all of its queues
+	queue_opts_t opts = { .storage = 0, .numa_node = QPOOL_NO_NODE, .no_monitor = 1 };
+	ex->overflow = queue_init_opts(max_tasks, &opts);
+	if (ex->overflow == NULL)
+		goto free_ex;
+	for (int i = 0; i < max_workers; i++) {
+		ex->workers[i].ex = ex;
+		ex->workers[i].id = i;
+		ex->workers[i].local = queue_init_opts(local_size, &opts);
+		if (ex->workers[i].local == NULL)
+			goto free_queues;
+	}
+
+	err = pthread_mutex_init(&ex->lock, NULL);
+	if (err != SUCCESS) {
+		printf("executor_init: pthread_mutex_init() failed: %s\n", strerror(err));
+		goto free_queues;
+	}
+	err = pthread_mutex_init(&ex->tasks_lock, NULL);
+	if (err != SUCCESS) {
+		printf("executor_init: pthread_mutex_init() failed: %s\n", strerror(err));
+		goto destroy_lock;
+	}
+	err = pthread_cond_init(&ex->work, NULL);
+	if (err != SUCCESS) {
+		printf("executor_init: pthread_cond_init() failed: %s\n", strerror(err));
+		goto destroy_tasks_lock;
+	}
+
+	pthread_mutex_lock(&ex->lock);
+	for (int i = 0; i < min_workers; i++) {
+		if (spawn_worker(ex) != SUCCESS) {
+			pthread_mutex_unlock(&ex->lock);
+			executor_destroy(ex);
+			return NULL;
+		}
+	}
+	pthread_mutex_unlock(&ex->lock);
+
+	err = pthread_create(&ex->monitor_tid, NULL, exec_monitor, ex);
+	if (err != SUCCESS) {
+		printf("executor_init: pthread_create() failed: %s\n", strerror(err));
+		ex->monitor_tid = 0;
+		executor_destroy(ex);
+		return NULL;
+	}
+	return ex;
+
+destroy_tasks_lock:
+	pthread_mutex_destroy(&ex->tasks_lock);
+destroy_lock:
+	pthread_mutex_destroy(&ex->lock);
+free_queues:
+	for (int i = 0; i < max_workers; i++)
+		queue_destroy(ex->workers[i].local);
+	queue_destroy(ex->overflow);
+free_ex:
+	free(ex->workers);
+	free(ex->tasks);
+	free(ex);
+	return NULL;
+}
+
+// runs everything already submitted before the workers are stopped
+void executor_destroy(executor_t *ex) {
+	if (ex == NULL) return;
+
+	int err;
+	if (ex->monitor_tid) {
+		err = pthread_cancel(ex->monitor_tid);
+		if (err != SUCCESS) printf("executor_destroy: pthread_cancel() failed: %s\n", strerror(err));
+		err = pthread_join(ex->monitor_tid, NULL);
+		if (err != SUCCESS) printf("executor_destroy: pthread_join() failed: %s\n", strerror(err));
+	}
+
+	pthread_mutex_lock(&ex->lock);
+	ex->shutdown = 1;
+	pthread_cond_broadcast(&ex->work);
+	pthread_mutex_unlock(&ex->lock);
+
+	for (int i = 0; i < ex->max_workers; i++) {
+		if (!ex->workers[i].started)
+			continue;
+		err = pthread_join(ex->workers[i].tid, NULL);
+		if (err != SUCCESS) printf("executor_destroy: pthread_join() failed: %s\n", strerror(err));
+	}
+
+	for (int i = 0; i < ex->max_workers; i++)
+		queue_destroy(ex->workers[i].local);
+	queue_destroy(ex->overflow);
+	pthread_cond_destroy(&ex->work);
+	pthread_mutex_destroy(&ex->tasks_lock);
+	pthread_mutex_destroy(&ex->lock);
+	free(ex->workers);
+	free(ex->tasks);
+	free(ex);
+}
+
+int executor_submit(executor_t *ex, exec_fn_t fn, void *arg, exec_wait_t *wait) {
+	if (ex == NULL || fn == NULL) return ERROR;
+
+	int idx = task_alloc(ex, fn, arg, wait);
+	if (idx == ERROR)
+		return ERROR;
+	if (wait != NULL)
+		exec_wait_add(wait, 1);
+
+	// tasks spawned by a task stay on the same worker, others are spread round-robin
+	exec_worker_t *w = current_worker;
+	if (w == NULL || w->ex != ex) {
+		unsigned next = __atomic_fetch_add(&ex->next_worker, 1, __ATOMIC_RELAXED);
+		w = &ex->workers[next % ex->max_workers];
+	}
+
+	__atomic_add_fetch(&ex->queued, 1, __ATOMIC_SEQ_CST);
+	if ((!w->running || queue_add(w->local, idx) != QUEUE_SUCCESS)
+		&& queue_add(ex->overflow, idx) != QUEUE_SUCCESS) {
+		__atomic_sub_fetch(&ex->queued, 1, __ATOMIC_SEQ_CST);
+		if (wait != NULL)
+			exec_wait_add(wait, -1);
+		task_free(ex, idx);
+		return ERROR;
+	}
+	__atomic_add_fetch(&ex->submitted, 1, __ATOMIC_RELAXED);
+
+	long queued = __atomic_load_n(&ex->queued, __ATOMIC_SEQ_CST);
+	int idle = __atomic_load_n(&ex->idle, __ATOMIC_SEQ_CST);
+	if (idle > 0) {
+		pthread_mutex_lock(&ex->lock);
+		pthread_cond_signal(&ex->work);
+		pthread_mutex_unlock(&ex->lock);
+	} else if (ex->nworkers < ex->max_workers && queued > (long)ex->nworkers * SPAWN_BACKLOG) {
+		pthread_mutex_lock(&ex->lock);
+		if (!ex->shutdown && ex->idle == 0 && ex->nworkers < ex->max_workers)
+			spawn_worker(ex);
+		pthread_mutex_unlock(&ex->lock);
+	}
+	return SUCCESS;
+}
+
+void executor_print_stats(executor_t *ex) {
+	if (ex == NULL) return;
+
+	int local_depth = 0;
+	long stolen = 0;
+	for (int i = 0; i < ex->max_workers; i++) {
+		local_depth += ex->workers[i].local->count;
+		stolen += ex->workers[i].stolen;
+	}
+	printf("executor stats: workers %d (idle %d, max %d); tasks: submitted %ld completed %ld queued %ld stolen %ld; "
+		"%ld tasks/s; depth: local %d overflow %d\n",
+		ex->nworkers, ex->idle, ex->max_workers,
+		ex->submitted, ex->completed, ex->queued, stolen,
+		ex->rate, local_depth, ex->overflow->count);
+	queue_print_stats(ex->overflow);
+}
@@ -0,0 +1,76 @@
+#ifndef __FITOS_EXECUTOR_H__
+#define __FITOS_EXECUTOR_H__
+
+// Worker pool on top of queue_t. Queues carry indexes into a task table,
+// so it needs a backend whose queue_get() does not block: 2.2/a or 2.2/e.
+//   gcc -Ie executor-example.c executor.c e/queue.c qpool.c qtrace.c -lpthread
+
+#define _GNU_SOURCE
+#include <pthread.h>
+
+#include "queue.h"
+
+typedef void (*exec_fn_t)(void *arg);
+
+// completion counter, a future is a counter waited on for one task
+typedef struct _ExecWait {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	long pending;
+} exec_wait_t;
+
+typedef struct _ExecTask {
+	exec_fn_t fn;
+	void *arg;
+	exec_wait_t *wait;
+	int next_free;
+} exec_task_t;
+
+struct _Executor;
+
+typedef struct _ExecWorker {
+	struct _Executor *ex;
+	pthread_t tid;
+	int id;
+	int running;		// the thread has not retired yet
+	int started;		// the thread was created and not joined yet
+	queue_t *local;		// tasks submitted by this worker go here first
+	long executed;
+	long stolen;
+} exec_worker_t;
+
+typedef struct _Executor {
+	pthread_mutex_t lock;		// workers, idle and shutdown
+	pthread_cond_t work;		// idle workers park here
+	pthread_mutex_t tasks_lock;	// free task slots
+	exec_task_t *tasks;
+	int max_tasks;
+	int free_task;
+
+	queue_t *overflow;		// shared by everyone once a local queue is full
+	exec_worker_t *workers;
+	int min_workers;
+	int max_workers;
+	int nworkers;
+	int idle;
+	int shutdown;
+	unsigned next_worker;
+
+	long queued;			// tasks sitting in local and overflow queues
+	long submitted;
+	long completed;
+	long rate;			// tasks per second, updated by the monitor
+
+	pthread_t monitor_tid;
+} executor_t;
+
+executor_t* executor_init(int min_workers, int max_workers, int local_size, int max_tasks);
+void executor_destroy(executor_t *ex);
+int executor_submit(executor_t *ex, exec_fn_t fn, void *arg, exec_wait_t *wait);
+void executor_print_stats(executor_t *ex);
+
+int exec_wait_init(exec_wait_t *w);
+void exec_wait_destroy(exec_wait_t *w);
+void exec_wait(exec_wait_t *w);
+
+#endif		// __FITOS_EXECUTOR_H__
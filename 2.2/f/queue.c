@@ -4,6 +4,28 @@
 
 #include "queue.h"
 
+#define DELAY_TICK_NS 1000000L		// timing wheel resolution
+#define NS_PER_SEC 1000000000L
+
+static unsigned long queue_tick(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * NS_PER_SEC + ts.tv_nsec) / DELAY_TICK_NS;
+}
+
+// rounds up, an item is never handed out before its deadline
+static unsigned long deadline_tick(const struct timespec *deadline) {
+	return (deadline->tv_sec * NS_PER_SEC + deadline->tv_nsec + DELAY_TICK_NS - 1) / DELAY_TICK_NS;
+}
+
+static struct timespec tick_deadline(unsigned long tick) {
+	struct timespec ts;
+	long ns = tick * DELAY_TICK_NS;
+	ts.tv_sec = ns / NS_PER_SEC;
+	ts.tv_nsec = ns % NS_PER_SEC;
+	return ts;
+}
+
 void *qmonitor(void *arg) {
 	int err;
 	queue_t *q = (queue_t *)arg;
@@ -26,9 +48,13 @@ void *qmonitor(void *arg) {
 }
 
 queue_t* queue_init(int max_count) {
+	return queue_init_opts(max_count, NULL);
+}
+
+queue_t* queue_init_opts(int max_count, const queue_opts_t *opts) {
 	int err;
 
-	queue_t *q = malloc(sizeof(queue_t));
+	queue_t *q = qcache_alloc(sizeof(queue_t));
 	if (q == NULL) {
 		printf("Cannot allocate memory for a queue\n");
 		return NULL;
@@ -38,31 +64,54 @@ queue_t* queue_init(int max_count) {
 	q->last = NULL;
 	q->max_count = max_count;
 	q->count = 0;
+	q->delayed = 0;
+	twheel_init(&q->wheel, queue_tick());
 	q->add_attempts = q->get_attempts = 0;
 	q->add_count = q->get_count = 0;
+	memset(&q->prof, 0, sizeof(q->prof));
+
+	err = qpool_init(&q->pool, sizeof(qnode_t), max_count,
+		opts ? opts->storage : 0, opts ? opts->numa_node : QPOOL_NO_NODE);
+	if (err != SUCCESS) {
+		printf("queue_init: qpool_init() failed\n");
+		free(q);
+		return NULL;
+	}
 
 	err = pthread_mutex_init(&q->mutex, NULL);
 	if (err != SUCCESS) {
 		printf("queue_init: pthread_mutex_init() failed: %s\n", strerror(err));
+		qpool_destroy(&q->pool);
 		free(q);
 		return NULL;
 	}
-	err = pthread_cond_init(&q->cond, NULL);
+	// timed waits for delayed items use the clock of their deadlines
+	pthread_condattr_t attr;
+	err = pthread_condattr_init(&attr);
+	if (err == SUCCESS) {
+		err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		if (err == SUCCESS)
+			err = pthread_cond_init(&q->cond, &attr);
+		pthread_condattr_destroy(&attr);
+	}
 	if (err != SUCCESS) {
 		printf("queue_init: pthread_cond_init() failed: %s\n", strerror(err));
 		err = pthread_mutex_destroy(&q->mutex);
 		if (err != SUCCESS) printf("queue_init: pthread_mutex_destroy() failed: %s\n", strerror(err));
+		qpool_destroy(&q->pool);
 		free(q);
 		return NULL;
 	}
 
-	err = pthread_create(&q->qmonitor_tid, NULL, qmonitor, q);
+	q->monitored = opts == NULL || !opts->no_monitor;
+	err = q->monitored ? pthread_create(&q->qmonitor_tid, NULL, qmonitor, q) : SUCCESS;
 	if (err != SUCCESS) {
 		printf("queue_init: pthread_create() failed: %s\n", strerror(err));
 		err = pthread_cond_destroy(&q->cond);
 		if (err != SUCCESS) printf("queue_init: pthread_cond_destroy() failed: %s\n", strerror(err));
 		err = pthread_mutex_destroy(&q->mutex);
 		if (err != SUCCESS) printf("queue_init: pthread_mutex_destroy() failed: %s\n", strerror(err));
+        qpool_destroy(&q->pool);
         free(q);
 		return NULL;
 	}
@@ -73,13 +122,15 @@ void queue_destroy(queue_t *q) {
 	if (q == NULL) return;
 
 	int err;
-	err = pthread_cancel(q->qmonitor_tid);
-    if (err != SUCCESS) {
-        printf("queue_destroy: pthread_cancel() failed: %s\n", strerror(err));
-    }	
-	err = pthread_join(q->qmonitor_tid, NULL);
-	if (err != SUCCESS) {
-		printf("queue_destroy: pthread_join() failed: %s\n", strerror(err));
+	if (q->monitored) {
+		err = pthread_cancel(q->qmonitor_tid);
+		if (err != SUCCESS) {
+			printf("queue_destroy: pthread_cancel() failed: %s\n", strerror(err));
+		}
+		err = pthread_join(q->qmonitor_tid, NULL);
+		if (err != SUCCESS) {
+			printf("queue_destroy: pthread_join() failed: %s\n", strerror(err));
+		}
 	}
 	err = pthread_cond_destroy(&q->cond);
 	if (err != SUCCESS) {
@@ -94,24 +145,102 @@ void queue_destroy(queue_t *q) {
 	while(current != NULL) {
 		qnode_t *tmp = current;
         current = current->next;
-        free(tmp);
+        qpool_free(&q->pool, tmp);
+	}
+	twheel_link_t *link = twheel_drain(&q->wheel);
+	while (link != NULL) {
+		qdelayed_t *d = (qdelayed_t *)link;
+		link = link->next;
+		free(d->node);
+		free(d);
 	}
+	qpool_destroy(&q->pool);
 	free(q);
 }
 
-int queue_add(queue_t *q, int val) {
+// the profiled path pays for the clock only when profiling is switched on
+static int queue_lock(queue_t *q) {
+	if (!qprof_on(&q->prof))
+		return pthread_mutex_lock(&q->mutex);
+
+	long start = 0;
+	if (pthread_mutex_trylock(&q->mutex) != SUCCESS) {
+		start = qprof_now();
+		int err = pthread_mutex_lock(&q->mutex);
+		if (err != SUCCESS)
+			return err;
+	}
+	qprof_acquired(&q->prof, start);
+	return SUCCESS;
+}
+
+static int queue_unlock(queue_t *q) {
+	qprof_release(&q->prof);
+	return pthread_mutex_unlock(&q->mutex);
+}
+
+// Moves the items whose deadline has passed from the wheel to the list.
+// Pooled queues take the node here, the slot was reserved by queue_put().
+static void queue_expire(queue_t *q) {
+	if (q->delayed == 0)
+		return;
+
+	twheel_link_t *link = twheel_advance(&q->wheel, queue_tick());
+	while (link != NULL) {
+		qdelayed_t *d = (qdelayed_t *)link;
+		link = link->next;
+
+		qnode_t *new = d->node ? d->node : qpool_alloc(&q->pool);
+		new->val = d->val;
+		new->next = NULL;
+		if (!q->first)
+			q->first = q->last = new;
+		else {
+			q->last->next = new;
+			q->last = new;
+		}
+		q->count++;
+		q->delayed--;
+		free(d);
+	}
+}
+
+static int queue_put(queue_t *q, int val, const struct timespec *deadline) {
 	if (q == NULL) return QUEUE_ERROR;
 
 	int err;	
-	qnode_t *new = malloc(sizeof(qnode_t));
-	if (new == NULL) {
-		printf("Cannot allocate memory for new node\n");		
-		return QUEUE_ERROR;
+	long start = qtrace_on() ? qprof_now() : 0;
+	// pooled nodes are taken under the lock, once a free slot is guaranteed
+	qnode_t *new = NULL;
+	// timed like the pool below, added to the profile once the lock is held
+	long malloc_ns = 0;
+	if (q->pool.nodes == NULL) {
+		long alloc = qprof_on(&q->prof) ? qprof_now() : 0;
+		new = malloc(sizeof(qnode_t));
+		if (alloc) malloc_ns = qprof_now() - alloc;
+		if (new == NULL) {
+			printf("Cannot allocate memory for new node\n");
+			return QUEUE_ERROR;
+		}
+	}
+	// an item that is due already skips the wheel
+	qdelayed_t *delayed = NULL;
+	if (deadline != NULL && deadline_tick(deadline) > queue_tick()) {
+		delayed = malloc(sizeof(qdelayed_t));
+		if (delayed == NULL) {
+			printf("Cannot allocate memory for new node\n");
+			free(new);
+			return QUEUE_ERROR;
+		}
+		delayed->link.expires = deadline_tick(deadline);
+		delayed->val = val;
+		delayed->node = new;
 	}
-	err = pthread_mutex_lock(&q->mutex);
+	err = queue_lock(q);
 	if (err != SUCCESS) {
 		printf("queue_add: pthread_mutex_lock() failed: %s\n", strerror(err));
 		free(new);		
+		free(delayed);
 		return QUEUE_ERROR;
 	}
 	int old_cancel_state;
@@ -119,30 +248,46 @@ int queue_add(queue_t *q, int val) {
 	if (err != SUCCESS) {
 		printf("queue_add: pthread_setcancelstate() failed: %s\n", strerror(err)); 
 		free(new);	
-		err = pthread_mutex_unlock(&q->mutex);
+		free(delayed);
+		err = queue_unlock(q);
 		if (err != SUCCESS) printf("queue_add: pthread_mutex_unlock() failed: %s\n", strerror(err)); 
 		return QUEUE_ERROR;
 	}
 
 	q->add_attempts++;	
-	while (q->count == q->max_count) {
+	while (q->count + q->delayed == q->max_count) {
+		long blocked = q->prof.acquired_ns ? qprof_block_begin(&q->prof) : 0;
 		err = pthread_cond_wait(&q->cond, &q->mutex);
+		if (blocked) qprof_block_end(&q->prof, blocked);
 		if (err != SUCCESS){
 			printf("queue_get: pthread_cond_wait() failed: %s\n", strerror(err)); 
 			return QUEUE_ERROR;
 		}
 	}			
 
-	new->val = val;
-	new->next = NULL;
-	if (!q->first)
-		q->first = q->last = new;
-	else {
-		q->last->next = new;
-		q->last = q->last->next;
+	long acquired = start ? qprof_now() : 0;
+	q->prof.alloc_ns += malloc_ns;
+	if (delayed != NULL) {
+		twheel_add(&q->wheel, &delayed->link);
+		q->delayed++;
+	} else {
+		if (new == NULL) {
+			long alloc = q->prof.acquired_ns ? qprof_now() : 0;
+			new = qpool_alloc(&q->pool);
+			if (alloc) q->prof.alloc_ns += qprof_now() - alloc;
+		}
+		new->val = val;
+		new->next = NULL;
+		if (!q->first)
+			q->first = q->last = new;
+		else {
+			q->last->next = new;
+			q->last = q->last->next;
+		}
+		q->count++;
 	}
-	q->count++;
 	q->add_count++;
+	if (start) qtrace_record(q, QTRACE_ADD, q->count, start, acquired);
 
 	err = pthread_cond_broadcast(&q->cond);
 	if (err != SUCCESS) {
@@ -153,18 +298,28 @@ int queue_add(queue_t *q, int val) {
 	if (err != SUCCESS) {
 		printf("queue_add: pthread_setcancelstate() failed: %s\n", strerror(err));
 	}
-	err = pthread_mutex_unlock(&q->mutex);
+	err = queue_unlock(q);
 	if (err != SUCCESS) {
 		printf("queue_add: pthread_mutex_unlock() failed: %s\n", strerror(err));
 	}		
 	return QUEUE_SUCCESS;
 }
 
+int queue_add(queue_t *q, int val) {
+	return queue_put(q, val, NULL);
+}
+
+int queue_add_at(queue_t *q, int val, const struct timespec *deadline) {
+	if (deadline == NULL) return QUEUE_ERROR;
+	return queue_put(q, val, deadline);
+}
+
 int queue_get(queue_t *q, int *val) {
 	if (q == NULL) return QUEUE_ERROR;
 
 	int err;	
-	err = pthread_mutex_lock(&q->mutex);
+	long start = qtrace_on() ? qprof_now() : 0;
+	err = queue_lock(q);
 	if (err != SUCCESS) {
 		printf("queue_get: pthread_mutex_lock() failed: %s\n", strerror(err));
 		return QUEUE_ERROR;
@@ -173,27 +328,39 @@ int queue_get(queue_t *q, int *val) {
 	err = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancel_state);
 	if (err != SUCCESS) {
 		printf("queue_get: pthread_setcancelstate() failed: %s\n", strerror(err)); 
-		err = pthread_mutex_unlock(&q->mutex);
+		err = queue_unlock(q);
 		if (err != SUCCESS) printf("queue_get: pthread_mutex_unlock() failed: %s\n", strerror(err)); 
 		return QUEUE_ERROR;
 	}
 	
 	q->get_attempts++;
+	queue_expire(q);
 	while (q->count == 0) {
-		err = pthread_cond_wait(&q->cond, &q->mutex);
+		long blocked = q->prof.acquired_ns ? qprof_block_begin(&q->prof) : 0;
+		// with delayed items pending sleep until the earliest of them is due
+		if (q->delayed > 0) {
+			struct timespec due = tick_deadline(twheel_next(&q->wheel));
+			err = pthread_cond_timedwait(&q->cond, &q->mutex, &due);
+			if (err == ETIMEDOUT) err = SUCCESS;
+		} else
+			err = pthread_cond_wait(&q->cond, &q->mutex);
+		if (blocked) qprof_block_end(&q->prof, blocked);
 		if (err != SUCCESS){ 
 			printf("queue_get: pthread_cond_wait() failed: %s\n", strerror(err)); 
 			return QUEUE_ERROR;
 		}
+		queue_expire(q);
 	}
 
+	long acquired = start ? qprof_now() : 0;
 	qnode_t *tmp = q->first;
 	*val = tmp->val;
 	q->first = q->first->next;
 	if (q->first == NULL) q->last = NULL;
-	free(tmp);
+	qpool_free(&q->pool, tmp);
 	q->count--;
 	q->get_count++;
+	if (start) qtrace_record(q, QTRACE_GET, q->count, start, acquired);
 
 	err = pthread_cond_broadcast(&q->cond);
 	if (err != SUCCESS) {
@@ -204,7 +371,7 @@ int queue_get(queue_t *q, int *val) {
 	if (err != SUCCESS) {
 		printf("queue_get: pthread_setcancelstate() failed: %s\n", strerror(err));
 	}
-	err = pthread_mutex_unlock(&q->mutex);
+	err = queue_unlock(q);
 	if (err != SUCCESS) {
 		printf("queue_get: pthread_mutex_unlock() failed: %s\n", strerror(err)); 
 	}	
@@ -212,8 +379,14 @@ int queue_get(queue_t *q, int *val) {
 }
 
 void queue_print_stats(queue_t *q) {
-	printf("queue stats: current size %d; attempts: (%ld %ld %ld); counts (%ld %ld %ld)\n",
-		q->count,
+	printf("queue stats: current size %d; delayed %d; attempts: (%ld %ld %ld); counts (%ld %ld %ld)\n",
+		q->count, q->delayed,
 		q->add_attempts, q->get_attempts, q->add_attempts - q->get_attempts,  //попытки
 		q->add_count, q->get_count, q->add_count -q->get_count);
+	qprof_print(&q->prof);
+}
+
+void queue_set_profiling(queue_t *q, int enabled) {
+	if (q == NULL) return;
+	qprof_set(&q->prof, enabled);
 }
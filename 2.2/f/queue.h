@@ -8,6 +8,13 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <time.h>
+
+#include "../qcache.h"
+#include "../qpool.h"
+#include "../qprof.h"
+#include "../qtrace.h"
+#include "twheel.h"
 
 #define SUCCESS 0
 #define ERROR -1
@@ -19,27 +26,57 @@ typedef struct _QueueNode {
 	struct _QueueNode *next;
 } qnode_t;
 
-typedef struct _Queue {
-	qnode_t *first;
-	qnode_t *last;
+// an item added with queue_add_at() that is not due yet
+typedef struct _QueueDelayed {
+	twheel_link_t link;	// first, the wheel hands back links
+	int val;
+	qnode_t *node;		// preallocated unless the queue is pooled
+} qdelayed_t;
 
+typedef struct _QueueOpts {
+	int storage;		// QPOOL_* flags, 0 - nodes come from malloc()
+	int numa_node;		// QPOOL_NO_NODE - leave placement to the kernel
+	int no_monitor;		// do not start the qmonitor thread
+} queue_opts_t;
+
+typedef struct _Queue {
+	// set up once, read afterwards
 	pthread_t qmonitor_tid;
-	pthread_mutex_t mutex;
-	pthread_cond_t cond; 
+	int monitored;
+	int max_count;		// bounds due and delayed items together
 
-	int count;
-	int max_count;
+	// the lock and what both sides write under it
+	QCACHE_ALIGNED pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int count;		// items that are due
+	int delayed;
 
+	// producer side
+	QCACHE_ALIGNED qnode_t *last;
 	long add_attempts;
-	long get_attempts;
 	long add_count;
+
+	// consumer side
+	QCACHE_ALIGNED qnode_t *first;
+	long get_attempts;
 	long get_count;
+
+	// the free list is shared by both sides
+	QCACHE_ALIGNED qpool_t pool;
+
+	QCACHE_ALIGNED twheel_t wheel;	// items waiting for their deadline
+
+	QCACHE_ALIGNED qprof_t prof;
 } queue_t;
 
 queue_t* queue_init(int max_count);
+queue_t* queue_init_opts(int max_count, const queue_opts_t *opts);
 void queue_destroy(queue_t *q);
 int queue_add(queue_t *q, int val);
+// the item becomes visible to queue_get() at deadline (CLOCK_MONOTONIC)
+int queue_add_at(queue_t *q, int val, const struct timespec *deadline);
 int queue_get(queue_t *q, int *val);
 void queue_print_stats(queue_t *q);
+void queue_set_profiling(queue_t *q, int enabled);
 
 #endif		// __FITOS_QUEUE_H__
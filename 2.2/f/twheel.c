@@ -0,0 +1,126 @@
+#include <string.h>
+
+#include "twheel.h"
+
+#define LEVEL_SHIFT(level) ((level) * TWHEEL_BITS)
+#define MAX_AHEAD ((1UL << LEVEL_SHIFT(TWHEEL_LEVELS)) - 1)
+
+void twheel_init(twheel_t *w, unsigned long now) {
+	memset(w, 0, sizeof(twheel_t));
+	w->now = now;
+}
+
+static void slot_append(twheel_t *w, int level, int idx, twheel_link_t *link) {
+	twheel_slot_t *slot = &w->slots[level][idx];
+	link->next = NULL;
+	if (slot->first == NULL)
+		slot->first = link;
+	else
+		slot->last->next = link;
+	slot->last = link;
+	w->used[level] |= 1ULL << idx;
+}
+
+static twheel_link_t *slot_take(twheel_t *w, int level, int idx) {
+	twheel_slot_t *slot = &w->slots[level][idx];
+	twheel_link_t *list = slot->first;
+	slot->first = slot->last = NULL;
+	w->used[level] &= ~(1ULL << idx);
+	return list;
+}
+
+// the level comes from the distance, the slot from the absolute tick
+static void place(twheel_t *w, twheel_link_t *link) {
+	unsigned long at = link->expires < w->now ? w->now : link->expires;
+	// too far for the top level: park it at the farthest slot, it is placed
+	// again with its real expiry when that slot is cascaded
+	if (at - w->now > MAX_AHEAD)
+		at = w->now + MAX_AHEAD;
+
+	unsigned long delta = at - w->now;
+	int level = 0;
+	while (level < TWHEEL_LEVELS - 1 && delta >> LEVEL_SHIFT(level + 1) != 0)
+		level++;
+	slot_append(w, level, (at >> LEVEL_SHIFT(level)) & TWHEEL_MASK, link);
+}
+
+void twheel_add(twheel_t *w, twheel_link_t *link) {
+	place(w, link);
+	w->count++;
+}
+
+static inline uint64_t rotate_right(uint64_t x, int n) {
+	return n == 0 ? x : (x >> n) | (x << (64 - n));
+}
+
+unsigned long twheel_next(twheel_t *w) {
+	if (w->count == 0)
+		return TWHEEL_NONE;
+
+	unsigned long next = TWHEEL_NONE;
+	for (int level = 0; level < TWHEEL_LEVELS; level++) {
+		if (w->used[level] == 0)
+			continue;
+		// first range start of this level that has not been cascaded yet
+		int shift = LEVEL_SHIFT(level);
+		unsigned long unit = (w->now + (1UL << shift) - 1) >> shift;
+		int ahead = __builtin_ctzll(rotate_right(w->used[level], unit & TWHEEL_MASK));
+		unsigned long tick = (unit + ahead) << shift;
+		if (tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+twheel_link_t *twheel_advance(twheel_t *w, unsigned long now) {
+	twheel_link_t *expired = NULL, **tail = &expired;
+
+	while (w->count > 0) {
+		unsigned long tick = twheel_next(w);
+		if (tick > now)
+			break;
+		w->now = tick;
+
+		// a range starts at this tick on every level whose lower bits are zero
+		for (int level = 1; level < TWHEEL_LEVELS; level++) {
+			if (tick & ((1UL << LEVEL_SHIFT(level)) - 1))
+				break;
+			twheel_link_t *link = slot_take(w, level, (tick >> LEVEL_SHIFT(level)) & TWHEEL_MASK);
+			while (link != NULL) {
+				twheel_link_t *next = link->next;
+				place(w, link);
+				link = next;
+			}
+		}
+
+		twheel_link_t *link = slot_take(w, 0, tick & TWHEEL_MASK);
+		while (link != NULL) {
+			*tail = link;
+			tail = &link->next;
+			link = link->next;
+			w->count--;
+		}
+		w->now = tick + 1;
+	}
+	*tail = NULL;
+	if (w->now <= now)
+		w->now = now + 1;
+	return expired;
+}
+
+twheel_link_t *twheel_drain(twheel_t *w) {
+	twheel_link_t *all = NULL;
+	for (int level = 0; level < TWHEEL_LEVELS; level++) {
+		for (int idx = 0; idx < TWHEEL_SLOTS; idx++) {
+			twheel_link_t *link = slot_take(w, level, idx);
+			while (link != NULL) {
+				twheel_link_t *next = link->next;
+				link->next = all;
+				all = link;
+				link = next;
+			}
+		}
+	}
+	w->count = 0;
+	return all;
+}
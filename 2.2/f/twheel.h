@@ -0,0 +1,46 @@
+#ifndef __FITOS_TWHEEL_H__
+#define __FITOS_TWHEEL_H__
+
+// Hierarchical timing wheel over abstract ticks. Level L holds entries
+// due 64^L to 64^(L+1) ticks ahead, one slot per 64^L ticks; a level-L slot
+// is moved one level down (cascaded) when its time range starts. Adding,
+// expiring and finding the next event are O(1): every level keeps a bitmap
+// of its non-empty slots. Entries are intrusive and owned by the caller.
+// Not thread safe, the owner serializes access.
+
+#include <stdint.h>
+
+#define TWHEEL_BITS 6
+#define TWHEEL_SLOTS (1 << TWHEEL_BITS)
+#define TWHEEL_MASK (TWHEEL_SLOTS - 1)
+#define TWHEEL_LEVELS 4
+#define TWHEEL_NONE ((unsigned long)-1)
+
+typedef struct _TwheelLink {
+	struct _TwheelLink *next;
+	unsigned long expires;		// tick
+} twheel_link_t;
+
+typedef struct _TwheelSlot {
+	twheel_link_t *first;		// entries of one slot keep insertion order
+	twheel_link_t *last;
+} twheel_slot_t;
+
+typedef struct _Twheel {
+	unsigned long now;		// next tick to process
+	long count;
+	uint64_t used[TWHEEL_LEVELS];
+	twheel_slot_t slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+} twheel_t;
+
+void twheel_init(twheel_t *w, unsigned long now);
+void twheel_add(twheel_t *w, twheel_link_t *link);
+// Moves every entry due at or before tick 'now' to the returned list,
+// in order of expiry.
+twheel_link_t *twheel_advance(twheel_t *w, unsigned long now);
+// earliest tick at which twheel_advance() may return something, TWHEEL_NONE when empty
+unsigned long twheel_next(twheel_t *w);
+// takes all entries out, for teardown
+twheel_link_t *twheel_drain(twheel_t *w);
+
+#endif		// __FITOS_TWHEEL_H__
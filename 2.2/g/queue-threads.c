@@ -94,11 +94,20 @@ int main() {
 	queue_t *q;
 	int err;
 	printf("main [%d %d %d]\n", getpid(), getppid(), gettid());
-	q = queue_init(1000000);
+	// the storage is faulted in up front so the first items do not pay for page faults
+	queue_opts_t opts = {
+		.storage = QPOOL_HUGEPAGES | QPOOL_PREFAULT,
+		.numa_node = QPOOL_NO_NODE,
+	};
+	q = queue_init_opts(1000000, &opts);
 	if (q == NULL) {  
         printf(RED"ERROR: Failed to initialize queue" NOCOLOR "\n");
         return ERROR;
     }
+	queue_set_profiling(q, getenv("QUEUE_PROFILE") != NULL);
+	char *trace_path = getenv("QUEUE_TRACE");
+	if (trace_path != NULL && qtrace_start(trace_path) != SUCCESS)
+		printf(RED"ERROR: Failed to start tracing to %s" NOCOLOR "\n", trace_path);
 
 	err = pthread_create(&reader_tid, NULL, reader, q);
 	if (err != SUCCESS) {
@@ -126,6 +135,7 @@ int main() {
 	if (result != SUCCESS) {
 		return ERROR;
 	}	
+	qtrace_stop();
 	queue_destroy(q);
 	printf("main: queue was destroyed\n");
 	return SUCCESS;
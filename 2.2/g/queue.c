@@ -27,8 +27,12 @@ void *qmonitor(void *arg) {
 }
 
 queue_t* queue_init(int max_count) {
+	return queue_init_opts(max_count, NULL);
+}
+
+queue_t* queue_init_opts(int max_count, const queue_opts_t *opts) {
 	int err;
-	queue_t *q = malloc(sizeof(queue_t));
+	queue_t *q = qcache_alloc(sizeof(queue_t));
 	if (q == NULL) {
 		printf("Cannot allocate memory for a queue\n");
 		abort();
@@ -40,10 +44,20 @@ queue_t* queue_init(int max_count) {
 	q->count = 0;
 	q->add_attempts = q->get_attempts = 0;
 	q->add_count = q->get_count = 0;
+	memset(&q->prof, 0, sizeof(q->prof));
+
+	err = qpool_init(&q->pool, sizeof(qnode_t), max_count,
+		opts ? opts->storage : 0, opts ? opts->numa_node : QPOOL_NO_NODE);
+	if (err != SUCCESS) {
+		printf("queue_init: qpool_init() failed\n");
+		free(q);
+		return NULL;
+	}
 
 	err = sem_init(&q->empty_slots, SEMAPHORE_PRIVATE, max_count);
 	if (err != SUCCESS) {
 		printf("queue_init: sem_init(empty_slots) failed: %s\n", strerror(err));
+		qpool_destroy(&q->pool);
 		free(q);
 		return NULL;
 	}
@@ -53,6 +67,7 @@ queue_t* queue_init(int max_count) {
 		printf("queue_init: sem_init(filled_slots) failed: %s\n", strerror(err));
 		err = sem_destroy(&q->empty_slots);
 		if (err != SUCCESS) printf("queue_init: sem_destroy(empty_slots) failed: %s\n", strerror(err));
+		qpool_destroy(&q->pool);
 		free(q);
 		return NULL;
 	}
@@ -63,11 +78,13 @@ queue_t* queue_init(int max_count) {
 		if (err != SUCCESS) printf("queue_init: sem_destroy(empty_slots) failed: %s\n", strerror(err));
 		err = sem_destroy(&q->filled_slots);
 		if (err != SUCCESS) printf("queue_init: sem_destroy(filled_slots) failed: %s\n", strerror(err));
+		qpool_destroy(&q->pool);
 		free(q);
 		return NULL;
 	}
 
-	err = pthread_create(&q->qmonitor_tid, NULL, qmonitor, q);
+	q->monitored = opts == NULL || !opts->no_monitor;
+	err = q->monitored ? pthread_create(&q->qmonitor_tid, NULL, qmonitor, q) : SUCCESS;
 	if (err != SUCCESS) {
 		printf("queue_init: pthread_create() failed: %s\n", strerror(err));
 		err = sem_destroy(&q->empty_slots);
@@ -76,6 +93,7 @@ queue_t* queue_init(int max_count) {
 		if (err != SUCCESS) printf("queue_init: sem_destroy(filled_slots) failed: %s\n", strerror(err));
 		err = sem_destroy(&q->queue_lock);
 		if (err != SUCCESS) printf("queue_init: sem_destroy(queue_lock) failed: %s\n", strerror(err));
+        qpool_destroy(&q->pool);
         free(q);
 		return NULL;
 	}
@@ -86,13 +104,15 @@ void queue_destroy(queue_t *q) {
 	if (q == NULL) return;
 
 	int err;
-	err = pthread_cancel(q->qmonitor_tid);
-    if (err != SUCCESS) {
-        printf("queue_destroy: pthread_cancel() failed: %s\n", strerror(err));
-    }	
-	err = pthread_join(q->qmonitor_tid, NULL);
-	if (err != SUCCESS) {
-		printf("queue_destroy: pthread_join() failed: %s\n", strerror(err));
+	if (q->monitored) {
+		err = pthread_cancel(q->qmonitor_tid);
+		if (err != SUCCESS) {
+			printf("queue_destroy: pthread_cancel() failed: %s\n", strerror(err));
+		}
+		err = pthread_join(q->qmonitor_tid, NULL);
+		if (err != SUCCESS) {
+			printf("queue_destroy: pthread_join() failed: %s\n", strerror(err));
+		}
 	}
 	err = sem_destroy(&q->empty_slots);
     if (err != SUCCESS) {
@@ -111,20 +131,64 @@ void queue_destroy(queue_t *q) {
 	while(current != NULL) {
 		qnode_t *tmp = current;
         current = current->next;
-        free(tmp);
+        qpool_free(&q->pool, tmp);
 	}
+	qpool_destroy(&q->pool);
 	free(q);
 }
 
+// the profiled path pays for the clock only when profiling is switched on
+static int slot_wait(queue_t *q, sem_t *slots, long *blocked) {
+	*blocked = 0;
+	if (!qprof_on(&q->prof))
+		return sem_wait(slots);
+	if (sem_trywait(slots) == SUCCESS)
+		return SUCCESS;
+
+	long start = qprof_now();
+	int err = sem_wait(slots);
+	*blocked = qprof_now() - start;
+	return err;
+}
+
+static int queue_lock(queue_t *q) {
+	if (!qprof_on(&q->prof))
+		return sem_wait(&q->queue_lock);
+
+	long start = 0;
+	if (sem_trywait(&q->queue_lock) != SUCCESS) {
+		start = qprof_now();
+		int err = sem_wait(&q->queue_lock);
+		if (err != SUCCESS)
+			return err;
+	}
+	qprof_acquired(&q->prof, start);
+	return SUCCESS;
+}
+
+static int queue_unlock(queue_t *q) {
+	qprof_release(&q->prof);
+	return sem_post(&q->queue_lock);
+}
+
 int queue_add(queue_t *q, int val) {
 	if (q == NULL) return QUEUE_ERROR;
 
 	int err;	
+	long start = qtrace_on() ? qprof_now() : 0;
 	q->add_attempts++;
-	qnode_t *new = malloc(sizeof(qnode_t));
-	if (new == NULL) {
-		printf("Cannot allocate memory for new node\n");		
-		return QUEUE_ERROR;
+	// pooled nodes are taken under the lock, once a free slot is guaranteed
+	qnode_t *new = NULL;
+	// timed like the pool below, added to the profile once the lock is held
+	long malloc_ns = 0;
+	if (q->pool.nodes == NULL) {
+		long alloc = qprof_on(&q->prof) ? qprof_now() : 0;
+		new = malloc(sizeof(qnode_t));
+		if (alloc) malloc_ns = qprof_now() - alloc;
+		if (new == NULL) {
+			printf("Cannot allocate memory for new node\n");
+			return QUEUE_ERROR;
+		}
 	}
 	int old_cancel_state;
 	err = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancel_state);
@@ -133,7 +197,8 @@ int queue_add(queue_t *q, int val) {
 		free(new);
 		return QUEUE_ERROR;
 	}
-	err = sem_wait(&q->empty_slots);
+	long blocked;
+	err = slot_wait(q, &q->empty_slots, &blocked);
     if (err != SUCCESS) {
         printf("queue_add: sem_wait(empty_slots) failed: %s\n", strerror(err));
 		err = pthread_setcancelstate(old_cancel_state, NULL); 
@@ -141,7 +206,7 @@ int queue_add(queue_t *q, int val) {
 		free(new);	
         return QUEUE_ERROR;
     }
-	err = sem_wait(&q->queue_lock);
+	err = queue_lock(q);
     if (err != SUCCESS) {
         printf("queue_add: sem_wait(queue_lock) failed: %s\n", strerror(err));
 		err = sem_post(&q->empty_slots);
@@ -152,6 +217,14 @@ int queue_add(queue_t *q, int val) {
         return QUEUE_ERROR;
     }
 
+	long acquired = start ? qprof_now() : 0;
+	q->prof.blocked_ns += blocked;
+	q->prof.alloc_ns += malloc_ns;
+	if (new == NULL) {
+		long alloc = q->prof.acquired_ns ? qprof_now() : 0;
+		new = qpool_alloc(&q->pool);
+		if (alloc) q->prof.alloc_ns += qprof_now() - alloc;
+	}
 	new->val = val;
 	new->next = NULL;
 	if (!q->first)
@@ -162,8 +235,9 @@ int queue_add(queue_t *q, int val) {
 	}
 	q->count++;
 	q->add_count++;
+	if (start) qtrace_record(q, QTRACE_ADD, q->count, start, acquired);
 
-	err = sem_post(&q->queue_lock);
+	err = queue_unlock(q);
 	if (err != SUCCESS) {
 		printf("queue_add: sem_post(queue_lock) failed: %s\n", strerror(err));
 	}
@@ -181,6 +255,7 @@ int queue_get(queue_t *q, int *val) {
 	if (q == NULL) return QUEUE_ERROR;
 	
 	int err;
+	long start = qtrace_on() ? qprof_now() : 0;
 	q->get_attempts++;
 	int old_cancel_state;	
 	err = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancel_state);
@@ -188,14 +263,15 @@ int queue_get(queue_t *q, int *val) {
 		printf("queue_get: pthread_setcancelstate() failed: %s\n", strerror(err)); 
 		return QUEUE_ERROR;
 	}
-    err = sem_wait(&q->filled_slots);
+	long blocked;
+    err = slot_wait(q, &q->filled_slots, &blocked);
     if (err != SUCCESS) {
         printf("queue_get: sem_wait(filled_slots) failed: %s\n", strerror(err));
 		err = pthread_setcancelstate(old_cancel_state, NULL); 
 		if (err != SUCCESS) printf("queue_get: pthread_setcancelstate() failed: %s\n", strerror(err)); 
         return QUEUE_ERROR;
     }
-    err = sem_wait(&q->queue_lock);
+    err = queue_lock(q);
     if (err != SUCCESS) {
         printf("queue_get: sem_wait(queue_lock) failed: %s\n", strerror(err));
 		err = sem_post(&q->empty_slots);
@@ -205,15 +281,18 @@ int queue_get(queue_t *q, int *val) {
         return QUEUE_ERROR;
     }
 
+	long acquired = start ? qprof_now() : 0;
+	q->prof.blocked_ns += blocked;
 	qnode_t *tmp = q->first;
 	*val = tmp->val;
 	q->first = q->first->next;
 	if (q->first == NULL) q->last = NULL;
-	free(tmp);
+	qpool_free(&q->pool, tmp);
 	q->count--;
 	q->get_count++;
+	if (start) qtrace_record(q, QTRACE_GET, q->count, start, acquired);
 
-	err = sem_post(&q->queue_lock);
+	err = queue_unlock(q);
 	if (err != SUCCESS) {
 		printf("queue_get: sem_post(queue_lock) failed: %s\n", strerror(err));
 	}
@@ -234,4 +313,10 @@ void queue_print_stats(queue_t *q) {
 		q->count,
 		q->add_attempts, q->get_attempts, q->add_attempts - q->get_attempts,  //попытки
 		q->add_count, q->get_count, q->add_count -q->get_count);
+	qprof_print(&q->prof);
+}
+
+void queue_set_profiling(queue_t *q, int enabled) {
+	if (q == NULL) return;
+	qprof_set(&q->prof, enabled);
 }
@@ -10,6 +10,11 @@
 #include <unistd.h>
 #include <semaphore.h> 
 
+#include "../qcache.h"
+#include "../qpool.h"
+#include "../qprof.h"
+#include "../qtrace.h"
+
 #define SUCCESS 0
 #define ERROR -1
 #define QUEUE_ERROR 0
@@ -21,29 +26,48 @@ typedef struct _QueueNode {
 	struct _QueueNode *next;
 } qnode_t;
 
-typedef struct _Queue {
-	qnode_t *first;
-	qnode_t *last;
+typedef struct _QueueOpts {
+	int storage;		// QPOOL_* flags, 0 - nodes come from malloc()
+	int numa_node;		// QPOOL_NO_NODE - leave placement to the kernel
+	int no_monitor;		// do not start the qmonitor thread
+} queue_opts_t;
 
+typedef struct _Queue {
+	// set up once, read afterwards
 	pthread_t qmonitor_tid;
+	int monitored;
+	int max_count;
 
-	sem_t empty_slots;    
-    sem_t filled_slots;   
-    sem_t queue_lock;          
-
+	// the lock and what both sides write under it
+	QCACHE_ALIGNED sem_t queue_lock;
 	int count;
-	int max_count;
 
+	// producers wait on empty slots, consumers on filled ones
+	QCACHE_ALIGNED sem_t empty_slots;
+	QCACHE_ALIGNED sem_t filled_slots;
+
+	// producer side
+	QCACHE_ALIGNED qnode_t *last;
 	long add_attempts;
-	long get_attempts;
 	long add_count;
+
+	// consumer side
+	QCACHE_ALIGNED qnode_t *first;
+	long get_attempts;
 	long get_count;
+
+	// the free list is shared by both sides
+	QCACHE_ALIGNED qpool_t pool;
+
+	QCACHE_ALIGNED qprof_t prof;
 } queue_t;
 
 queue_t* queue_init(int max_count);
+queue_t* queue_init_opts(int max_count, const queue_opts_t *opts);
 void queue_destroy(queue_t *q);
 int queue_add(queue_t *q, int val);
 int queue_get(queue_t *q, int *val);
 void queue_print_stats(queue_t *q);
+void queue_set_profiling(queue_t *q, int enabled);
 
 #endif		// __FITOS_QUEUE_H__
@@ -0,0 +1,483 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+
+#include "queue.h"
+
+#define SPIN_BUDGET 2000		// polls before a wait counts as long
+#define SHORT_PARK_NS 20000		// about what a sleep and a wakeup cost
+#define EPOCH_WAITS 1024		// contended waits between two decisions
+#define MODE_RECHECK 63			// spinners reread the mode this often
+
+static const char *mode_names[] = { "spin", "spin-park", "block" };
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static inline int queue_mode(queue_t *q) {
+	return __atomic_load_n(&q->adapt.mode, __ATOMIC_RELAXED);
+}
+
+static void wait_begin(queue_t *q) {
+	int n = __atomic_add_fetch(&q->adapt.waiting, 1, __ATOMIC_RELAXED);
+	if (n > __atomic_load_n(&q->adapt.max_waiting, __ATOMIC_RELAXED))
+		__atomic_store_n(&q->adapt.max_waiting, n, __ATOMIC_RELAXED);
+}
+
+static void wait_end(queue_t *q) {
+	__atomic_sub_fetch(&q->adapt.waiting, 1, __ATOMIC_RELAXED);
+}
+
+// Called under the mutex after every contended wait. Spinning pays off while
+// waits end within the budget and the waiters still leave a CPU to the lock
+// holder; sleeping pays off once most spins run out anyway.
+static void adapt(queue_t *q) {
+	queue_adapt_t *a = &q->adapt;
+	long spins = a->spin_ok + a->spin_over;
+	long parks = a->park_short + a->park_long;
+	if (spins + parks < EPOCH_WAITS)
+		return;
+
+	int oversubscribed = __atomic_load_n(&a->max_waiting, __ATOMIC_RELAXED) >= a->ncpus;
+	int mode = a->mode;
+	if (!a->pinned) {
+		switch (mode) {
+		case QUEUE_MODE_SPIN:
+			if (oversubscribed || a->spin_over * 4 > spins)
+				mode = QUEUE_MODE_SPIN_PARK;
+			break;
+		case QUEUE_MODE_SPIN_PARK:
+			if (a->spin_over * 4 > spins * 3)
+				mode = QUEUE_MODE_BLOCK;
+			else if (!oversubscribed && a->spin_over * 16 < spins)
+				mode = QUEUE_MODE_SPIN;
+			break;
+		case QUEUE_MODE_BLOCK:
+			if (!oversubscribed && a->park_short * 4 > parks * 3)
+				mode = QUEUE_MODE_SPIN_PARK;
+			break;
+		}
+	}
+	if (mode != a->mode) {
+		__atomic_store_n(&a->mode, mode, __ATOMIC_RELAXED);
+		a->switches++;
+	}
+	a->spin_ok = a->spin_over = 0;
+	a->park_short = a->park_long = 0;
+	__atomic_store_n(&a->max_waiting, 0, __ATOMIC_RELAXED);
+}
+
+static void count_park(queue_t *q, long start) {
+	if (qprof_now() - start < SHORT_PARK_NS)
+		q->adapt.park_short++;
+	else
+		q->adapt.park_long++;
+}
+
+void *qmonitor(void *arg) {
+	int err;
+	queue_t *q = (queue_t *)arg;
+	printf("qmonitor: [%d %d %d]\n", getpid(), getppid(), gettid());
+
+	while (1) {
+		err = pthread_mutex_lock(&q->mutex);
+		if (err != SUCCESS) {
+			printf("qmonitor: pthread_mutex_lock() failed: %s\n", strerror(err));
+			continue;
+		}
+		queue_print_stats(q);
+		err = pthread_mutex_unlock(&q->mutex);
+		if (err != SUCCESS) {
+			printf("qmonitor: pthread_mutex_unlock() failed: %s\n", strerror(err));
+		}
+		sleep(1);
+	}
+	return NULL;
+}
+
+queue_t* queue_init(int max_count) {
+	return queue_init_opts(max_count, NULL);
+}
+
+queue_t* queue_init_opts(int max_count, const queue_opts_t *opts) {
+	int err;
+
+	queue_t *q = qcache_alloc(sizeof(queue_t));
+	if (q == NULL) {
+		printf("Cannot allocate memory for a queue\n");
+		return NULL;
+	}
+
+	q->first = NULL;
+	q->last = NULL;
+	q->max_count = max_count;
+	q->count = 0;
+	q->add_attempts = q->get_attempts = 0;
+	q->add_count = q->get_count = 0;
+	memset(&q->prof, 0, sizeof(q->prof));
+	memset(&q->adapt, 0, sizeof(q->adapt));
+	q->adapt.mode = QUEUE_MODE_SPIN_PARK;
+	q->adapt.ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (q->adapt.ncpus < 1)
+		q->adapt.ncpus = 1;
+
+	err = qpool_init(&q->pool, sizeof(qnode_t), max_count,
+		opts ? opts->storage : 0, opts ? opts->numa_node : QPOOL_NO_NODE);
+	if (err != SUCCESS) {
+		printf("queue_init: qpool_init() failed\n");
+		free(q);
+		return NULL;
+	}
+
+	err = pthread_mutex_init(&q->mutex, NULL);
+	if (err != SUCCESS) {
+		printf("queue_init: pthread_mutex_init() failed: %s\n", strerror(err));
+		qpool_destroy(&q->pool);
+		free(q);
+		return NULL;
+	}
+	err = pthread_cond_init(&q->cond, NULL);
+	if (err != SUCCESS) {
+		printf("queue_init: pthread_cond_init() failed: %s\n", strerror(err));
+		err = pthread_mutex_destroy(&q->mutex);
+		if (err != SUCCESS) printf("queue_init: pthread_mutex_destroy() failed: %s\n", strerror(err));
+		qpool_destroy(&q->pool);
+		free(q);
+		return NULL;
+	}
+
+	q->monitored = opts == NULL || !opts->no_monitor;
+	err = q->monitored ? pthread_create(&q->qmonitor_tid, NULL, qmonitor, q) : SUCCESS;
+	if (err != SUCCESS) {
+		printf("queue_init: pthread_create() failed: %s\n", strerror(err));
+		err = pthread_cond_destroy(&q->cond);
+		if (err != SUCCESS) printf("queue_init: pthread_cond_destroy() failed: %s\n", strerror(err));
+		err = pthread_mutex_destroy(&q->mutex);
+		if (err != SUCCESS) printf("queue_init: pthread_mutex_destroy() failed: %s\n", strerror(err));
+		qpool_destroy(&q->pool);
+		free(q);
+		return NULL;
+	}
+	return q;
+}
+
+void queue_destroy(queue_t *q) {
+	if (q == NULL) return;
+
+	int err;
+	if (q->monitored) {
+		err = pthread_cancel(q->qmonitor_tid);
+		if (err != SUCCESS) {
+			printf("queue_destroy: pthread_cancel() failed: %s\n", strerror(err));
+		}
+		err = pthread_join(q->qmonitor_tid, NULL);
+		if (err != SUCCESS) {
+			printf("queue_destroy: pthread_join() failed: %s\n", strerror(err));
+		}
+	}
+	err = pthread_cond_destroy(&q->cond);
+	if (err != SUCCESS) {
+		printf("queue_destroy: pthread_cond_destroy() failed: %s\n", strerror(err));
+	}
+	err = pthread_mutex_destroy(&q->mutex);
+	if (err != SUCCESS) {
+		printf("queue_destroy: pthread_mutex_destroy() failed: %s\n", strerror(err));
+	}
+
+	qnode_t *current = q->first;
+	while(current != NULL) {
+		qnode_t *tmp = current;
+		current = current->next;
+		qpool_free(&q->pool, tmp);
+	}
+	qpool_destroy(&q->pool);
+	free(q);
+}
+
+// Uncontended locks cost one trylock. Contended ones are always timed,
+// the clock read is cheap next to the wait and feeds adapt().
+static int queue_lock(queue_t *q) {
+	if (pthread_mutex_trylock(&q->mutex) == SUCCESS) {
+		if (qprof_on(&q->prof))
+			qprof_acquired(&q->prof, 0);
+		return SUCCESS;
+	}
+
+	long start = qprof_now();
+	int mode = queue_mode(q);
+	long i = 0;
+	wait_begin(q);
+	if (mode != QUEUE_MODE_BLOCK) {
+		for (i = 1; mode == QUEUE_MODE_SPIN || i < SPIN_BUDGET; i++) {
+			cpu_relax();
+			if (pthread_mutex_trylock(&q->mutex) == SUCCESS) {
+				if (i < SPIN_BUDGET)
+					q->adapt.spin_ok++;
+				else
+					q->adapt.spin_over++;
+				goto acquired;
+			}
+			if ((i & MODE_RECHECK) == 0)
+				mode = queue_mode(q);
+		}
+	}
+
+	long parked = qprof_now();
+	int err = pthread_mutex_lock(&q->mutex);
+	if (err != SUCCESS) {
+		wait_end(q);
+		return err;
+	}
+	if (i != 0)
+		q->adapt.spin_over++;
+	count_park(q, parked);
+
+acquired:
+	wait_end(q);
+	adapt(q);
+	if (qprof_on(&q->prof))
+		qprof_acquired(&q->prof, start);
+	return SUCCESS;
+}
+
+static int queue_unlock(queue_t *q) {
+	qprof_release(&q->prof);
+	return pthread_mutex_unlock(&q->mutex);
+}
+
+static inline int queue_ready(queue_t *q, int adding) {
+	int count = __atomic_load_n(&q->count, __ATOMIC_RELAXED);
+	return adding ? count < q->max_count : count > 0;
+}
+
+// Called and returns with the mutex held. Spinners drop the mutex and poll
+// the count, sleepers wait on cond; producers and consumers only signal
+// cond when somebody sleeps there.
+static int queue_wait(queue_t *q, int adding) {
+	int spun_out = 0, parked = 0, err = SUCCESS;
+	long start = qprof_now();
+	long blocked = q->prof.acquired_ns ? qprof_block_begin(&q->prof) : 0;
+
+	wait_begin(q);
+	while (!queue_ready(q, adding)) {
+		int mode = queue_mode(q);
+		if (mode != QUEUE_MODE_BLOCK && !(spun_out && mode == QUEUE_MODE_SPIN_PARK)) {
+			err = pthread_mutex_unlock(&q->mutex);
+			if (err != SUCCESS)
+				break;
+			for (long i = 1; !queue_ready(q, adding); i++) {
+				if (i == SPIN_BUDGET) {
+					spun_out = 1;
+					if (mode != QUEUE_MODE_SPIN)
+						break;
+				}
+				if ((i & MODE_RECHECK) == 0 && (mode = queue_mode(q)) != QUEUE_MODE_SPIN && spun_out)
+					break;
+				cpu_relax();
+			}
+			err = pthread_mutex_lock(&q->mutex);
+			if (err != SUCCESS)
+				break;
+			continue;
+		}
+
+		q->adapt.parked++;
+		parked = 1;
+		err = pthread_cond_wait(&q->cond, &q->mutex);
+		q->adapt.parked--;
+		if (err != SUCCESS)
+			break;
+	}
+	wait_end(q);
+	if (err != SUCCESS)
+		return err;
+
+	if (blocked) qprof_block_end(&q->prof, blocked);
+	if (parked)
+		count_park(q, start);
+	if (spun_out)
+		q->adapt.spin_over++;
+	else if (!parked)
+		q->adapt.spin_ok++;
+	adapt(q);
+	return SUCCESS;
+}
+
+static int queue_wake(queue_t *q) {
+	if (q->adapt.parked == 0)
+		return SUCCESS;
+	return pthread_cond_broadcast(&q->cond);
+}
+
+int queue_add(queue_t *q, int val) {
+	if (q == NULL) return QUEUE_ERROR;
+
+	int err;
+	long start = qtrace_on() ? qprof_now() : 0;
+	// pooled nodes are taken under the lock, once a free slot is guaranteed
+	qnode_t *new = NULL;
+	if (q->pool.nodes == NULL) {
+		new = malloc(sizeof(qnode_t));
+		if (new == NULL) {
+			printf("Cannot allocate memory for new node\n");
+			return QUEUE_ERROR;
+		}
+	}
+	err = queue_lock(q);
+	if (err != SUCCESS) {
+		printf("queue_add: pthread_mutex_lock() failed: %s\n", strerror(err));
+		free(new);
+		return QUEUE_ERROR;
+	}
+	int old_cancel_state;
+	err = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancel_state);
+	if (err != SUCCESS) {
+		printf("queue_add: pthread_setcancelstate() failed: %s\n", strerror(err));
+		free(new);
+		err = queue_unlock(q);
+		if (err != SUCCESS) printf("queue_add: pthread_mutex_unlock() failed: %s\n", strerror(err));
+		return QUEUE_ERROR;
+	}
+
+	q->add_attempts++;
+	if (q->count == q->max_count) {
+		err = queue_wait(q, 1);
+		if (err != SUCCESS) {
+			printf("queue_add: queue_wait() failed: %s\n", strerror(err));
+			return QUEUE_ERROR;
+		}
+	}
+
+	long acquired = start ? qprof_now() : 0;
+	if (new == NULL) {
+		long alloc = q->prof.acquired_ns ? qprof_now() : 0;
+		new = qpool_alloc(&q->pool);
+		if (alloc) q->prof.alloc_ns += qprof_now() - alloc;
+	}
+	new->val = val;
+	new->next = NULL;
+	if (!q->first)
+		q->first = q->last = new;
+	else {
+		q->last->next = new;
+		q->last = q->last->next;
+	}
+	// spinners read count without the mutex
+	__atomic_store_n(&q->count, q->count + 1, __ATOMIC_RELEASE);
+	q->add_count++;
+	if (start) qtrace_record(q, QTRACE_ADD, q->count, start, acquired);
+
+	err = queue_wake(q);
+	if (err != SUCCESS) {
+		printf("queue_add: pthread_cond_broadcast() failed: %s\n", strerror(err));
+		return QUEUE_ERROR;
+	}
+	err = pthread_setcancelstate(old_cancel_state, NULL);
+	if (err != SUCCESS) {
+		printf("queue_add: pthread_setcancelstate() failed: %s\n", strerror(err));
+	}
+	err = queue_unlock(q);
+	if (err != SUCCESS) {
+		printf("queue_add: pthread_mutex_unlock() failed: %s\n", strerror(err));
+	}
+	return QUEUE_SUCCESS;
+}
+
+int queue_get(queue_t *q, int *val) {
+	if (q == NULL) return QUEUE_ERROR;
+
+	int err;
+	long start = qtrace_on() ? qprof_now() : 0;
+	err = queue_lock(q);
+	if (err != SUCCESS) {
+		printf("queue_get: pthread_mutex_lock() failed: %s\n", strerror(err));
+		return QUEUE_ERROR;
+	}
+	int old_cancel_state;
+	err = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_cancel_state);
+	if (err != SUCCESS) {
+		printf("queue_get: pthread_setcancelstate() failed: %s\n", strerror(err));
+		err = queue_unlock(q);
+		if (err != SUCCESS) printf("queue_get: pthread_mutex_unlock() failed: %s\n", strerror(err));
+		return QUEUE_ERROR;
+	}
+
+	q->get_attempts++;
+	if (q->count == 0) {
+		err = queue_wait(q, 0);
+		if (err != SUCCESS) {
+			printf("queue_get: queue_wait() failed: %s\n", strerror(err));
+			return QUEUE_ERROR;
+		}
+	}
+
+	long acquired = start ? qprof_now() : 0;
+	qnode_t *tmp = q->first;
+	*val = tmp->val;
+	q->first = q->first->next;
+	if (q->first == NULL) q->last = NULL;
+	qpool_free(&q->pool, tmp);
+	__atomic_store_n(&q->count, q->count - 1, __ATOMIC_RELEASE);
+	q->get_count++;
+	if (start) qtrace_record(q, QTRACE_GET, q->count, start, acquired);
+
+	err = queue_wake(q);
+	if (err != SUCCESS) {
+		printf("queue_get: pthread_cond_broadcast() failed: %s\n", strerror(err));
+		return QUEUE_ERROR;
+	}
+	err = pthread_setcancelstate(old_cancel_state, NULL);
+	if (err != SUCCESS) {
+		printf("queue_get: pthread_setcancelstate() failed: %s\n", strerror(err));
+	}
+	err = queue_unlock(q);
+	if (err != SUCCESS) {
+		printf("queue_get: pthread_mutex_unlock() failed: %s\n", strerror(err));
+	}
+	return QUEUE_SUCCESS;
+}
+
+void queue_print_stats(queue_t *q) {
+	printf("queue stats: current size %d; attempts: (%ld %ld %ld); counts (%ld %ld %ld)\n",
+		q->count,
+		q->add_attempts, q->get_attempts, q->add_attempts - q->get_attempts,
+		q->add_count, q->get_count, q->add_count -q->get_count);
+	printf("adaptive stats: mode %s%s; switches %ld; epoch: spins (%ld ok %ld over) parks (%ld short %ld long)\n",
+		mode_names[q->adapt.mode], q->adapt.pinned ? " (pinned)" : "", q->adapt.switches,
+		q->adapt.spin_ok, q->adapt.spin_over, q->adapt.park_short, q->adapt.park_long);
+	qprof_print(&q->prof);
+}
+
+void queue_set_profiling(queue_t *q, int enabled) {
+	if (q == NULL) return;
+	qprof_set(&q->prof, enabled);
+}
+
+void queue_set_mode(queue_t *q, int mode) {
+	if (q == NULL || mode < QUEUE_MODE_AUTO || mode > QUEUE_MODE_BLOCK) return;
+
+	int err = pthread_mutex_lock(&q->mutex);
+	if (err != SUCCESS) {
+		printf("queue_set_mode: pthread_mutex_lock() failed: %s\n", strerror(err));
+		return;
+	}
+	q->adapt.pinned = mode != QUEUE_MODE_AUTO;
+	if (q->adapt.pinned && mode != q->adapt.mode) {
+		__atomic_store_n(&q->adapt.mode, mode, __ATOMIC_RELAXED);
+		q->adapt.switches++;
+	}
+	// parked threads do not see a switch to spinning until they are woken up
+	err = pthread_cond_broadcast(&q->cond);
+	if (err != SUCCESS) {
+		printf("queue_set_mode: pthread_cond_broadcast() failed: %s\n", strerror(err));
+	}
+	err = pthread_mutex_unlock(&q->mutex);
+	if (err != SUCCESS) {
+		printf("queue_set_mode: pthread_mutex_unlock() failed: %s\n", strerror(err));
+	}
+}
@@ -0,0 +1,98 @@
+#ifndef __FITOS_QUEUE_H__
+#define __FITOS_QUEUE_H__
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "../qcache.h"
+#include "../qpool.h"
+#include "../qprof.h"
+#include "../qtrace.h"
+
+#define SUCCESS 0
+#define ERROR -1
+#define QUEUE_ERROR 0
+#define QUEUE_SUCCESS 1
+
+// How a thread waits for the lock or for room/items. The queue measures how
+// waits end and moves between the modes on its own; items always live in
+// one list under one mutex, so a switch never touches them.
+#define QUEUE_MODE_AUTO -1	// queue_set_mode(): let the queue choose again
+enum {
+	QUEUE_MODE_SPIN,	// spin until done, never sleep
+	QUEUE_MODE_SPIN_PARK,	// spin for a while, then sleep in the kernel
+	QUEUE_MODE_BLOCK,	// sleep right away
+};
+
+// Everything but mode, waiting and max_waiting is updated under the mutex.
+// The wait counters cover the current decision epoch only.
+typedef struct _QueueAdapt {
+	int mode;
+	int pinned;		// set by queue_set_mode(), no switching
+	int ncpus;
+	int waiting;		// threads spinning or sleeping for the lock or a slot
+	int max_waiting;	// most threads waiting at once in this epoch
+	int parked;		// threads sleeping on cond
+	long spin_ok;		// waits that ended within SPIN_BUDGET
+	long spin_over;		// waits that outlasted it
+	long park_short;	// sleeps too short to be worth two context switches
+	long park_long;
+	long switches;
+} queue_adapt_t;
+
+typedef struct _QueueNode {
+	int val;
+	struct _QueueNode *next;
+} qnode_t;
+
+typedef struct _QueueOpts {
+	int storage;		// QPOOL_* flags, 0 - nodes come from malloc()
+	int numa_node;		// QPOOL_NO_NODE - leave placement to the kernel
+	int no_monitor;		// do not start the qmonitor thread
+} queue_opts_t;
+
+typedef struct _Queue {
+	// set up once, read afterwards
+	pthread_t qmonitor_tid;
+	int monitored;
+	int max_count;
+
+	// the lock and what both sides write under it
+	QCACHE_ALIGNED pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int count;		// spinners poll it without the lock
+
+	// producer side
+	QCACHE_ALIGNED qnode_t *last;
+	long add_attempts;
+	long add_count;
+
+	// consumer side
+	QCACHE_ALIGNED qnode_t *first;
+	long get_attempts;
+	long get_count;
+
+	// waiters of both sides update it, mostly outside the lock
+	QCACHE_ALIGNED queue_adapt_t adapt;
+
+	// the free list is shared by both sides
+	QCACHE_ALIGNED qpool_t pool;
+
+	QCACHE_ALIGNED qprof_t prof;
+} queue_t;
+
+queue_t* queue_init(int max_count);
+queue_t* queue_init_opts(int max_count, const queue_opts_t *opts);
+void queue_destroy(queue_t *q);
+int queue_add(queue_t *q, int val);
+int queue_get(queue_t *q, int *val);
+void queue_print_stats(queue_t *q);
+void queue_set_profiling(queue_t *q, int enabled);
+void queue_set_mode(queue_t *q, int mode);
+
+#endif		// __FITOS_QUEUE_H__
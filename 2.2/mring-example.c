@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "mring.h"
+
+#define RED "\033[41m"
+#define NOCOLOR "\033[0m"
+#define PRODUCERS 2
+#define ITEMS 1000000		// per producer
+#define BATCH 256
+#define SEQ_BITS 24
+
+// log and metrics see every item independently, process runs after both of them
+enum { LOG, METRICS, PROCESS, STAGES };
+static const char *stage_names[STAGES] = { "log", "metrics", "process" };
+
+static mring_t *r;
+static int stage_ids[STAGES];
+
+void *producer(void *arg) {
+	long id = (long)arg;
+	for (int seq = 0; seq < ITEMS; seq++) {
+		while (mring_publish(r, (id << SEQ_BITS) | seq) != QUEUE_SUCCESS)
+			sched_yield();
+	}
+	return NULL;
+}
+
+void *consumer(void *arg) {
+	long stage = (long)arg;
+	int vals[BATCH];
+	int expected[PRODUCERS] = { 0 };
+	long seen = 0, errors = 0;
+
+	while (seen < (long)PRODUCERS * ITEMS) {
+		int n = mring_consume(r, stage_ids[stage], vals, BATCH);
+		if (n == 0) {
+			sched_yield();
+			continue;
+		}
+		for (int i = 0; i < n; i++) {
+			int id = vals[i] >> SEQ_BITS;
+			int seq = vals[i] & ((1 << SEQ_BITS) - 1);
+			if (seq != expected[id]) {
+				if (errors++ < 10)
+					printf(RED"ERROR: %s: producer %d seq %d but expected - %d" NOCOLOR "\n",
+						stage_names[stage], id, seq, expected[id]);
+			}
+			expected[id] = seq + 1;
+		}
+		seen += n;
+	}
+	printf("%s: got %ld items, %ld errors\n", stage_names[stage], seen, errors);
+	return (void *)errors;
+}
+
+int main() {
+	pthread_t producers[PRODUCERS], consumers[STAGES];
+	int err;
+
+	printf("main [%d %d %d]\n", getpid(), getppid(), gettid());
+	r = mring_init(1 << 16);
+	if (r == NULL)
+		return ERROR;
+
+	int process_deps[] = { 0, 0 };
+	stage_ids[LOG] = mring_add_consumer(r, NULL, 0);
+	stage_ids[METRICS] = mring_add_consumer(r, NULL, 0);
+	process_deps[0] = stage_ids[LOG];
+	process_deps[1] = stage_ids[METRICS];
+	stage_ids[PROCESS] = mring_add_consumer(r, process_deps, 2);
+
+	for (long i = 0; i < STAGES; i++) {
+		err = pthread_create(&consumers[i], NULL, consumer, (void *)i);
+		if (err != SUCCESS) {
+			printf("main: pthread_create() failed: %s\n", strerror(err));
+			return ERROR;
+		}
+	}
+	for (long i = 0; i < PRODUCERS; i++) {
+		err = pthread_create(&producers[i], NULL, producer, (void *)i);
+		if (err != SUCCESS) {
+			printf("main: pthread_create() failed: %s\n", strerror(err));
+			return ERROR;
+		}
+	}
+
+	long errors = 0;
+	for (int i = 0; i < PRODUCERS; i++)
+		pthread_join(producers[i], NULL);
+	for (int i = 0; i < STAGES; i++) {
+		void *ret;
+		pthread_join(consumers[i], &ret);
+		errors += (long)ret;
+	}
+	mring_print_stats(r);
+	mring_destroy(r);
+	return errors == 0 ? SUCCESS : ERROR;
+}
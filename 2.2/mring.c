@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+
+#include "mring.h"
+
+void *mring_monitor(void *arg) {
+	mring_t *r = (mring_t *)arg;
+	printf("mring_monitor: [%d %d %d]\n", getpid(), getppid(), gettid());
+
+	while (1) {
+		mring_print_stats(r);
+		sleep(1);
+	}
+	return NULL;
+}
+
+mring_t* mring_init(long size) {
+	int err;
+	if (size < 2 || (size & (size - 1)) != 0) {
+		printf("mring_init: size %ld is not a power of two\n", size);
+		return NULL;
+	}
+
+	mring_t *r = aligned_alloc(CACHE_LINE, sizeof(mring_t));
+	if (r == NULL) {
+		printf("Cannot allocate memory for a ring\n");
+		return NULL;
+	}
+	memset(r, 0, sizeof(mring_t));
+	r->size = size;
+	r->mask = size - 1;
+	r->items = malloc(size * sizeof(int));
+	r->published = malloc(size * sizeof(long));
+	if (r->items == NULL || r->published == NULL) {
+		printf("Cannot allocate memory for a ring\n");
+		free(r->items);
+		free(r->published);
+		free(r);
+		return NULL;
+	}
+	for (long i = 0; i < size; i++)
+		r->published[i] = -1;
+
+	err = pthread_create(&r->qmonitor_tid, NULL, mring_monitor, r);
+	if (err != SUCCESS) {
+		printf("mring_init: pthread_create() failed: %s\n", strerror(err));
+		free(r->items);
+		free(r->published);
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+void mring_destroy(mring_t *r) {
+	if (r == NULL) return;
+
+	int err;
+	err = pthread_cancel(r->qmonitor_tid);
+	if (err != SUCCESS) {
+		printf("mring_destroy: pthread_cancel() failed: %s\n", strerror(err));
+	}
+	err = pthread_join(r->qmonitor_tid, NULL);
+	if (err != SUCCESS) {
+		printf("mring_destroy: pthread_join() failed: %s\n", strerror(err));
+	}
+	free(r->items);
+	free(r->published);
+	free(r);
+}
+
+// consumers are wired up before any producer or consumer runs
+int mring_add_consumer(mring_t *r, const int *deps, int ndeps) {
+	if (r == NULL || ndeps < 0 || ndeps > MRING_MAX_DEPS) return ERROR;
+	if (r->nconsumers == MRING_MAX_CONSUMERS) {
+		printf("mring_add_consumer: too many consumers\n");
+		return ERROR;
+	}
+
+	int id = r->nconsumers;
+	mring_consumer_t *c = &r->consumers[id];
+	for (int i = 0; i < ndeps; i++) {
+		if (deps[i] < 0 || deps[i] >= id) {
+			printf("mring_add_consumer: bad dependency %d\n", deps[i]);
+			return ERROR;
+		}
+		c->deps[i] = deps[i];
+		r->consumers[deps[i]].gating = 0;
+	}
+	c->ndeps = ndeps;
+	c->gating = 1;
+	c->next.value = 0;
+	r->nconsumers++;
+	return id;
+}
+
+static long min_gating(mring_t *r) {
+	long min = __atomic_load_n(&r->claim.value, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < r->nconsumers; i++) {
+		if (!r->consumers[i].gating)
+			continue;
+		long next = __atomic_load_n(&r->consumers[i].next.value, __ATOMIC_ACQUIRE);
+		if (next < min)
+			min = next;
+	}
+	return min;
+}
+
+int mring_publish(mring_t *r, int val) {
+	if (r == NULL) return QUEUE_ERROR;
+
+	long seq = __atomic_load_n(&r->claim.value, __ATOMIC_RELAXED);
+	do {
+		// the slot is free once every gating consumer has moved past its previous round
+		if (seq - min_gating(r) >= r->size) {
+			__atomic_add_fetch(&r->full_attempts, 1, __ATOMIC_RELAXED);
+			return QUEUE_ERROR;
+		}
+	} while (!__atomic_compare_exchange_n(&r->claim.value, &seq, seq + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	r->items[seq & r->mask] = val;
+	__atomic_store_n(&r->published[seq & r->mask], seq, __ATOMIC_RELEASE);
+	return QUEUE_SUCCESS;
+}
+
+// highest sequence + 1 the consumer may read
+static long barrier(mring_t *r, mring_consumer_t *c, long next, int max) {
+	if (c->ndeps > 0) {
+		long limit = next + max;
+		for (int i = 0; i < c->ndeps; i++) {
+			long dep = __atomic_load_n(&r->consumers[c->deps[i]].next.value, __ATOMIC_ACQUIRE);
+			if (dep < limit)
+				limit = dep;
+		}
+		return limit;
+	}
+
+	// producers may publish out of order, stop at the first gap
+	long seq = next;
+	while (seq < next + max && __atomic_load_n(&r->published[seq & r->mask], __ATOMIC_ACQUIRE) == seq)
+		seq++;
+	return seq;
+}
+
+// every consumer id is driven by one thread
+int mring_consume(mring_t *r, int consumer, int *vals, int max) {
+	if (r == NULL || consumer < 0 || consumer >= r->nconsumers || max < 1) return 0;
+
+	mring_consumer_t *c = &r->consumers[consumer];
+	long next = c->next.value;
+	long limit = barrier(r, c, next, max);
+	if (limit <= next) {
+		c->empty_polls++;
+		return 0;
+	}
+
+	int n = 0;
+	for (long seq = next; seq < limit; seq++)
+		vals[n++] = r->items[seq & r->mask];
+	__atomic_store_n(&c->next.value, limit, __ATOMIC_RELEASE);
+	return n;
+}
+
+void mring_print_stats(mring_t *r) {
+	long claimed = r->claim.value;
+	printf("mring stats: size %ld; published %ld; full attempts %ld\n", r->size, claimed, r->full_attempts);
+	for (int i = 0; i < r->nconsumers; i++) {
+		mring_consumer_t *c = &r->consumers[i];
+		printf("  consumer %d%s: read %ld; behind %ld; empty polls %ld\n",
+			i, c->gating ? " (gating)" : "", c->next.value, claimed - c->next.value, c->empty_polls);
+	}
+}
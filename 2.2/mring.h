@@ -0,0 +1,61 @@
+#ifndef __FITOS_MRING_H__
+#define __FITOS_MRING_H__
+
+// Multicast ring: every consumer sees every item. Each consumer keeps its own
+// sequence cursor; a consumer with dependencies only reads what all of them
+// have already processed (a sequence barrier). Producers are gated by the
+// consumers nobody depends on, i.e. by the slowest end of every chain.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define SUCCESS 0
+#define ERROR -1
+#define QUEUE_ERROR 0
+#define QUEUE_SUCCESS 1
+
+#define MRING_MAX_CONSUMERS 16
+#define MRING_MAX_DEPS 4
+#define CACHE_LINE 64
+
+// cursors live on their own cache lines, each is written by one thread
+typedef struct _MringSeq {
+	long value;
+} __attribute__((aligned(CACHE_LINE))) mring_seq_t;
+
+typedef struct _MringConsumer {
+	mring_seq_t next;		// next sequence to read, everything below is processed
+	int deps[MRING_MAX_DEPS];
+	int ndeps;			// 0 - reads whatever producers published
+	int gating;			// nobody depends on it, producers wait for it
+	long empty_polls;
+} mring_consumer_t;
+
+typedef struct _Mring {
+	mring_seq_t claim;		// next sequence a producer may claim
+	int *items;
+	long *published;		// sequence stored in a slot, -1 - never written
+	long size;
+	long mask;
+
+	mring_consumer_t consumers[MRING_MAX_CONSUMERS];
+	int nconsumers;
+
+	pthread_t qmonitor_tid;
+	long full_attempts;
+} mring_t;
+
+mring_t* mring_init(long size);
+void mring_destroy(mring_t *r);
+int mring_add_consumer(mring_t *r, const int *deps, int ndeps);
+int mring_publish(mring_t *r, int val);
+int mring_consume(mring_t *r, int consumer, int *vals, int max);
+void mring_print_stats(mring_t *r);
+
+#endif		// __FITOS_MRING_H__
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perfcnt.h"
+
+#define SUCCESS 0
+#define ERROR -1
+// MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM on Intel cores since Skylake
+#define INTEL_HITM_RAW 0x04d2
+
+static const char *names[PERFCNT_NR] = {
+	"cycles", "instructions", "llc-misses", "hitm", "cs", "migrations",
+};
+
+static int hitm_config(unsigned long long *config) {
+	const char *env = getenv("PERFCNT_HITM");
+	if (env != NULL) {
+		*config = strtoull(env, NULL, 0);
+		return *config != 0 ? SUCCESS : ERROR;
+	}
+
+	// there is no generic HITM event, only guess on Intel
+	FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+	if (cpuinfo == NULL)
+		return ERROR;
+	char line[256];
+	int intel = 0;
+	while (fgets(line, sizeof(line), cpuinfo) != NULL) {
+		if (strncmp(line, "vendor_id", 9) == 0) {
+			intel = strstr(line, "GenuineIntel") != NULL;
+			break;
+		}
+	}
+	fclose(cpuinfo);
+	*config = INTEL_HITM_RAW;
+	return intel ? SUCCESS : ERROR;
+}
+
+static int open_counter(int idx) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.exclude_hv = 1;
+
+	switch (idx) {
+	case PERFCNT_CYCLES:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CPU_CYCLES;
+		break;
+	case PERFCNT_INSTRUCTIONS:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+		break;
+	case PERFCNT_LLC_MISSES:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		break;
+	case PERFCNT_HITM:
+		attr.type = PERF_TYPE_RAW;
+		if (hitm_config(&attr.config) != SUCCESS)
+			return ERROR;
+		break;
+	case PERFCNT_CTX_SWITCHES:
+		attr.type = PERF_TYPE_SOFTWARE;
+		attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+		break;
+	case PERFCNT_MIGRATIONS:
+		attr.type = PERF_TYPE_SOFTWARE;
+		attr.config = PERF_COUNT_SW_CPU_MIGRATIONS;
+		break;
+	}
+
+	// switches and migrations happen in the kernel, so try with it first
+	int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd == ERROR && (errno == EACCES || errno == EPERM)) {
+		attr.exclude_kernel = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+	return fd;
+}
+
+// counts the calling thread from now on
+void perfcnt_open(perfcnt_t *pc) {
+	memset(pc, 0, sizeof(perfcnt_t));
+	for (int i = 0; i < PERFCNT_NR; i++)
+		pc->fd[i] = open_counter(i);
+}
+
+void perfcnt_close(perfcnt_t *pc) {
+	for (int i = 0; i < PERFCNT_NR; i++) {
+		if (pc->fd[i] == ERROR)
+			continue;
+
+		unsigned long long buf[3];	// value, time enabled, time running
+		if (read(pc->fd[i], buf, sizeof(buf)) == sizeof(buf) && buf[2] != 0) {
+			// scale up if the counter was multiplexed with others
+			pc->value[i] = buf[2] < buf[1] ? (unsigned long long)((double)buf[0] * buf[1] / buf[2]) : buf[0];
+			pc->valid[i] = 1;
+		}
+		if (close(pc->fd[i]) != SUCCESS)
+			printf("perfcnt_close: close() failed: %s\n", strerror(errno));
+		pc->fd[i] = ERROR;
+	}
+}
+
+void perfcnt_add(perfcnt_t *sum, const perfcnt_t *pc) {
+	for (int i = 0; i < PERFCNT_NR; i++) {
+		if (!pc->valid[i])
+			continue;
+		sum->value[i] += pc->value[i];
+		sum->valid[i] = 1;
+	}
+}
+
+void perfcnt_print(const char *label, const perfcnt_t *pc) {
+	printf("perf %s:", label);
+	for (int i = 0; i < PERFCNT_NR; i++) {
+		if (pc->valid[i])
+			printf(" %s %llu", names[i], pc->value[i]);
+		else
+			printf(" %s n/a", names[i]);
+	}
+	if (pc->valid[PERFCNT_CYCLES] && pc->valid[PERFCNT_INSTRUCTIONS] && pc->value[PERFCNT_CYCLES] != 0)
+		printf(" ipc %.2f", (double)pc->value[PERFCNT_INSTRUCTIONS] / pc->value[PERFCNT_CYCLES]);
+	printf("\n");
+}
@@ -0,0 +1,30 @@
+#ifndef __FITOS_PERFCNT_H__
+#define __FITOS_PERFCNT_H__
+
+#define _GNU_SOURCE
+#include <stdio.h>
+
+// Hardware and software counters of one thread, read through perf_event_open().
+// A counter the kernel or the container refuses stays closed and prints as n/a.
+enum {
+	PERFCNT_CYCLES,
+	PERFCNT_INSTRUCTIONS,
+	PERFCNT_LLC_MISSES,
+	PERFCNT_HITM,		// loads served from a modified line in another core's cache
+	PERFCNT_CTX_SWITCHES,
+	PERFCNT_MIGRATIONS,
+	PERFCNT_NR
+};
+
+typedef struct _PerfCounters {
+	int fd[PERFCNT_NR];
+	int valid[PERFCNT_NR];
+	unsigned long long value[PERFCNT_NR];
+} perfcnt_t;
+
+void perfcnt_open(perfcnt_t *pc);
+void perfcnt_close(perfcnt_t *pc);
+void perfcnt_add(perfcnt_t *sum, const perfcnt_t *pc);
+void perfcnt_print(const char *label, const perfcnt_t *pc);
+
+#endif		// __FITOS_PERFCNT_H__
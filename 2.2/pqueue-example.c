@@ -0,0 +1,173 @@
+// Throughput of every durability mode, then recovery after a crash:
+// a child adds and consumes part of the items and dies without closing
+// the queue, the parent reopens it and checks what is left.
+//   gcc pqueue-example.c pqueue.c -lpthread && ./a.out [dir]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "pqueue.h"
+
+#define RED "\033[41m"
+#define NOCOLOR "\033[0m"
+#define PRODUCERS 16
+#define SEQ_BITS 24
+#define SEGMENT_SIZE (1L << 20)
+#define BATCH_US 0
+
+typedef struct _Producer {
+	pthread_t tid;
+	int id;
+	int items;
+} producer_t;
+
+static pqueue_t *pq;
+static const char *mode_names[] = { "none", "batch", "item" };
+
+static double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void wipe(const char *path) {
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+			unlinkat(dirfd(dir), entry->d_name, 0);
+	}
+	closedir(dir);
+}
+
+void *producer(void *arg) {
+	producer_t *p = (producer_t *)arg;
+	for (int seq = 0; seq < p->items; seq++) {
+		if (pqueue_add(pq, (p->id << SEQ_BITS) | seq) != QUEUE_SUCCESS) {
+			printf(RED "ERROR: pqueue_add() failed" NOCOLOR "\n");
+			break;
+		}
+	}
+	return NULL;
+}
+
+static int produce(int items) {
+	producer_t producers[PRODUCERS];
+	for (int i = 0; i < PRODUCERS; i++) {
+		producers[i].id = i;
+		producers[i].items = items;
+		int err = pthread_create(&producers[i].tid, NULL, producer, &producers[i]);
+		if (err != SUCCESS) {
+			printf("produce: pthread_create() failed: %s\n", strerror(err));
+			return ERROR;
+		}
+	}
+	for (int i = 0; i < PRODUCERS; i++)
+		pthread_join(producers[i].tid, NULL);
+	return SUCCESS;
+}
+
+// child: add, consume a third, die without pqueue_close()
+static void crash_run(const char *dir, int durability, int items) {
+	// the batch leader waits a little so that more adds share its msync()
+	pqueue_opts_t opts = { .segment_size = SEGMENT_SIZE, .durability = durability, .batch_us = BATCH_US };
+	pq = pqueue_open(dir, &opts);
+	if (pq == NULL)
+		_exit(ERROR);
+
+	double start = now_sec();
+	if (produce(items) != SUCCESS)
+		_exit(ERROR);
+	double elapsed = now_sec() - start;
+
+	int val;
+	for (long i = 0; i < (long)PRODUCERS * items / 3; i++)
+		pqueue_get(pq, &val);
+	printf("%-5s: %.0f adds/s with %d producers\n", mode_names[durability],
+		PRODUCERS * items / elapsed, PRODUCERS);
+	pqueue_print_stats(pq);
+	fflush(stdout);
+	_exit(SUCCESS);
+}
+
+// parent: everything not consumed must be there, in order per producer
+static int check_recovery(const char *dir, int durability, int items) {
+	pqueue_opts_t opts = { .durability = durability };
+	pq = pqueue_open(dir, &opts);
+	if (pq == NULL)
+		return ERROR;
+
+	long expected = PRODUCERS * (long)items - PRODUCERS * (long)items / 3;
+	long left = 0, errors = 0;
+	int last[PRODUCERS];
+	for (int i = 0; i < PRODUCERS; i++)
+		last[i] = -1;
+
+	int val;
+	while (pqueue_get(pq, &val) == QUEUE_SUCCESS) {
+		int id = val >> SEQ_BITS, seq = val & ((1 << SEQ_BITS) - 1);
+		if (id < 0 || id >= PRODUCERS || seq <= last[id]) {
+			if (errors++ < 10)
+				printf(RED "ERROR: unexpected value %d after recovery" NOCOLOR "\n", val);
+			continue;
+		}
+		last[id] = seq;
+		left++;
+	}
+	// a producer may have had all of its items consumed before the crash
+	for (int i = 0; i < PRODUCERS; i++) {
+		if (last[i] != items - 1 && last[i] != -1) {
+			printf(RED "ERROR: producer %d ends at %d, expected %d" NOCOLOR "\n", i, last[i], items - 1);
+			errors++;
+		}
+	}
+	if (left != expected) {
+		printf(RED "ERROR: %ld items after recovery, expected %ld" NOCOLOR "\n", left, expected);
+		errors++;
+	}
+	printf("%-5s: recovered %ld of %ld unconsumed items in %ld us\n",
+		mode_names[durability], pq->recovered, expected, pq->recovery_ns / 1000);
+	pqueue_close(pq);
+	return errors == 0 ? SUCCESS : ERROR;
+}
+
+int main(int argc, char *argv[]) {
+	const char *dir = argc > 1 ? argv[1] : "/tmp/pqueue-example";
+	// syncing every item is slow, it gets fewer
+	int items[] = { 50000, 10000, 500 };
+	int failed = 0;
+
+	for (int mode = PQUEUE_DURABLE_NONE; mode <= PQUEUE_DURABLE_ITEM; mode++) {
+		wipe(dir);
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == ERROR) {
+			printf("main: fork() failed: %s\n", strerror(errno));
+			return ERROR;
+		}
+		if (pid == 0)
+			crash_run(dir, mode, items[mode]);
+
+		int status;
+		if (waitpid(pid, &status, 0) == ERROR || !WIFEXITED(status) || WEXITSTATUS(status) != SUCCESS) {
+			printf(RED "ERROR: the %s run failed" NOCOLOR "\n", mode_names[mode]);
+			failed++;
+			continue;
+		}
+		if (check_recovery(dir, mode, items[mode]) != SUCCESS)
+			failed++;
+	}
+	wipe(dir);
+	rmdir(dir);
+	return failed ? ERROR : SUCCESS;
+}
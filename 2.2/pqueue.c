@@ -0,0 +1,470 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pqueue.h"
+
+#define OFFSET_MAGIC 0x314f455545555150ULL	// "PQUEUEO1"
+#define OFFSET_FILE "offset"
+#define SEGMENT_FORMAT "seg-%020lu.log"
+#define NAME_SIZE 64
+#define NO_SEGMENT ((uint64_t)-1)
+
+static long page_size;
+
+static long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static uint32_t rec_check(uint64_t seq, int32_t val) {
+	uint64_t x = seq * 0x9e3779b97f4a7c15ULL ^ (uint32_t)val;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	return (uint32_t)x | 1;
+}
+
+static int rec_valid(const pqueue_rec_t *r, uint64_t seq) {
+	return r->seq == seq && r->check == rec_check(seq, r->val);
+}
+
+static int segment_map(pqueue_t *pq, pqueue_segment_t *seg, uint64_t index, int create) {
+	char name[NAME_SIZE];
+	snprintf(name, sizeof(name), SEGMENT_FORMAT, (unsigned long)index);
+
+	int fd = openat(pq->dirfd, name, O_RDWR | (create ? O_CREAT : 0), 0644);
+	if (fd == ERROR) {
+		printf("pqueue: openat() failed for %s: %s\n", name, strerror(errno));
+		return ERROR;
+	}
+	// a new file is sparse and reads as zeroes, which no valid record is
+	if (create && ftruncate(fd, pq->segment_size) == ERROR) {
+		printf("pqueue: ftruncate() failed for %s: %s\n", name, strerror(errno));
+		close(fd);
+		return ERROR;
+	}
+	void *addr = mmap(NULL, pq->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		printf("pqueue: mmap() failed for %s: %s\n", name, strerror(errno));
+		return ERROR;
+	}
+	seg->index = index;
+	seg->recs = addr;
+	return SUCCESS;
+}
+
+static void segment_unmap(pqueue_t *pq, pqueue_segment_t *seg) {
+	if (seg->recs != NULL && munmap(seg->recs, pq->segment_size) == ERROR)
+		printf("pqueue: munmap() failed: %s\n", strerror(errno));
+	seg->recs = NULL;
+	seg->index = NO_SEGMENT;
+}
+
+static void segment_remove(pqueue_t *pq, uint64_t index) {
+	char name[NAME_SIZE];
+	snprintf(name, sizeof(name), SEGMENT_FORMAT, (unsigned long)index);
+	if (unlinkat(pq->dirfd, name, 0) == ERROR && errno != ENOENT)
+		printf("pqueue: unlinkat() failed for %s: %s\n", name, strerror(errno));
+}
+
+// [from, to) must lie in seg
+static int sync_records(pqueue_t *pq, pqueue_segment_t *seg, uint64_t from, uint64_t to) {
+	if (from >= to)
+		return SUCCESS;
+	long start = (from % pq->per_segment) * sizeof(pqueue_rec_t);
+	long end = ((to - 1) % pq->per_segment + 1) * sizeof(pqueue_rec_t);
+	start &= ~(page_size - 1);
+	if (msync((char *)seg->recs + start, end - start, MS_SYNC) == ERROR) {
+		printf("pqueue: msync() failed: %s\n", strerror(errno));
+		return ERROR;
+	}
+	return SUCCESS;
+}
+
+static int sync_offset(pqueue_t *pq) {
+	if (msync(pq->offset, page_size, MS_SYNC) == ERROR) {
+		printf("pqueue: msync() failed for the offset: %s\n", strerror(errno));
+		return ERROR;
+	}
+	return SUCCESS;
+}
+
+// a new file is only durable once its directory entry is
+static int sync_dir(pqueue_t *pq) {
+	if (pq->durability == PQUEUE_DURABLE_NONE)
+		return SUCCESS;
+	if (fsync(pq->dirfd) == ERROR) {
+		printf("pqueue: fsync() failed for the directory: %s\n", strerror(errno));
+		return ERROR;
+	}
+	return SUCCESS;
+}
+
+static int offset_map(pqueue_t *pq) {
+	int fd = openat(pq->dirfd, OFFSET_FILE, O_RDWR | O_CREAT, 0644);
+	if (fd == ERROR) {
+		printf("pqueue: openat() failed for %s: %s\n", OFFSET_FILE, strerror(errno));
+		return ERROR;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == ERROR || (st.st_size < page_size && ftruncate(fd, page_size) == ERROR)) {
+		printf("pqueue: cannot size %s: %s\n", OFFSET_FILE, strerror(errno));
+		close(fd);
+		return ERROR;
+	}
+	void *addr = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		printf("pqueue: mmap() failed for %s: %s\n", OFFSET_FILE, strerror(errno));
+		return ERROR;
+	}
+	pq->offset = addr;
+	return SUCCESS;
+}
+
+// finds the oldest and the newest segment files, SUCCESS with none found too
+static int find_segments(pqueue_t *pq, uint64_t *first, uint64_t *last) {
+	int fd = dup(pq->dirfd);
+	DIR *dir = fd == ERROR ? NULL : fdopendir(fd);
+	if (dir == NULL) {
+		printf("pqueue: fdopendir() failed: %s\n", strerror(errno));
+		if (fd != ERROR) close(fd);
+		return ERROR;
+	}
+	rewinddir(dir);
+
+	*first = *last = NO_SEGMENT;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		unsigned long index;
+		char tail;
+		if (sscanf(entry->d_name, "seg-%lu.lo%c", &index, &tail) != 2 || tail != 'g')
+			continue;
+		if (*first == NO_SEGMENT || index < *first)
+			*first = index;
+		if (*last == NO_SEGMENT || index > *last)
+			*last = index;
+	}
+	closedir(dir);
+	return SUCCESS;
+}
+
+// Maps the newest segment and finds the end of the log in it. Only the
+// unconsumed part is scanned; records past the first invalid one are
+// leftovers of writes the crash interrupted and are wiped, otherwise a
+// later append could make them look valid again.
+static int recover(pqueue_t *pq, uint64_t first, uint64_t last) {
+	long start = now_ns();
+	uint64_t seg_start = last * pq->per_segment;
+	uint64_t seg_end = seg_start + pq->per_segment;
+
+	if (segment_map(pq, &pq->head_seg, last, 0) != SUCCESS)
+		return ERROR;
+	if (pq->tail < first * pq->per_segment)
+		pq->tail = first * pq->per_segment;
+	if (pq->tail > seg_end)
+		pq->tail = seg_end;
+
+	uint64_t seq = pq->tail > seg_start ? pq->tail : seg_start;
+	pqueue_rec_t *recs = pq->head_seg.recs;
+	while (seq < seg_end && rec_valid(&recs[seq - seg_start], seq))
+		seq++;
+	pq->head = seq;
+	for (seq++; seq < seg_end; seq++) {
+		if (rec_valid(&recs[seq - seg_start], seq))
+			memset(&recs[seq - seg_start], 0, sizeof(pqueue_rec_t));
+	}
+
+	// what survived a process crash may still be only in the page cache,
+	// and so are the wiped leftovers
+	pq->flushed = pq->head;
+	if (pq->durability != PQUEUE_DURABLE_NONE && msync(recs, pq->segment_size, MS_SYNC) == ERROR)
+		printf("pqueue: msync() failed: %s\n", strerror(errno));
+
+	// whatever is older than the tail segment was consumed already
+	for (uint64_t index = first; index < pq->tail / pq->per_segment && index < last; index++)
+		segment_remove(pq, index);
+
+	pq->offset->tail = pq->tail;
+	pq->recovered = pq->head - pq->tail;
+	pq->recovery_ns = now_ns() - start;
+	return SUCCESS;
+}
+
+pqueue_t* pqueue_open(const char *dir, const pqueue_opts_t *opts) {
+	int err;
+
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+
+	pqueue_t *pq = calloc(1, sizeof(pqueue_t));
+	if (pq == NULL) {
+		printf("pqueue_open: memory allocation failed\n");
+		return NULL;
+	}
+	pq->durability = opts ? opts->durability : PQUEUE_DURABLE_BATCH;
+	pq->batch_us = opts ? opts->batch_us : 0;
+	pq->segment_size = opts && opts->segment_size ? opts->segment_size : PQUEUE_SEGMENT_SIZE;
+	pq->segment_size = (pq->segment_size + page_size - 1) & ~(page_size - 1);
+	pq->head_seg.index = pq->tail_seg.index = NO_SEGMENT;
+
+	if (mkdir(dir, 0755) == ERROR && errno != EEXIST) {
+		printf("pqueue_open: mkdir() failed for %s: %s\n", dir, strerror(errno));
+		free(pq);
+		return NULL;
+	}
+	pq->dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (pq->dirfd == ERROR) {
+		printf("pqueue_open: open() failed for %s: %s\n", dir, strerror(errno));
+		free(pq);
+		return NULL;
+	}
+	if (offset_map(pq) != SUCCESS)
+		goto fail;
+
+	// an existing queue keeps the segment size it was created with
+	if (pq->offset->magic == OFFSET_MAGIC) {
+		pq->segment_size = pq->offset->segment_size;
+	} else {
+		pq->offset->magic = OFFSET_MAGIC;
+		pq->offset->tail = 0;
+		pq->offset->segment_size = pq->segment_size;
+	}
+	pq->per_segment = pq->segment_size / sizeof(pqueue_rec_t);
+	pq->tail = pq->offset->tail;
+
+	uint64_t first, last;
+	if (find_segments(pq, &first, &last) != SUCCESS)
+		goto fail;
+	if (last == NO_SEGMENT) {
+		pq->head = pq->flushed = pq->tail;
+		if (segment_map(pq, &pq->head_seg, pq->head / pq->per_segment, 1) != SUCCESS)
+			goto fail;
+	} else if (recover(pq, first, last) != SUCCESS) {
+		goto fail;
+	}
+	if (sync_dir(pq) != SUCCESS)
+		goto fail;
+
+	err = pthread_mutex_init(&pq->lock, NULL);
+	if (err != SUCCESS) {
+		printf("pqueue_open: pthread_mutex_init() failed: %s\n", strerror(err));
+		goto fail;
+	}
+	err = pthread_cond_init(&pq->flushed_cond, NULL);
+	if (err != SUCCESS) {
+		printf("pqueue_open: pthread_cond_init() failed: %s\n", strerror(err));
+		pthread_mutex_destroy(&pq->lock);
+		goto fail;
+	}
+	return pq;
+
+fail:
+	segment_unmap(pq, &pq->head_seg);
+	if (pq->offset != NULL)
+		munmap(pq->offset, page_size);
+	close(pq->dirfd);
+	free(pq);
+	return NULL;
+}
+
+void pqueue_close(pqueue_t *pq) {
+	if (pq == NULL) return;
+
+	if (pq->durability != PQUEUE_DURABLE_NONE)
+		pqueue_sync(pq);
+	segment_unmap(pq, &pq->head_seg);
+	segment_unmap(pq, &pq->tail_seg);
+	if (munmap(pq->offset, page_size) == ERROR)
+		printf("pqueue_close: munmap() failed: %s\n", strerror(errno));
+	close(pq->dirfd);
+
+	int err = pthread_cond_destroy(&pq->flushed_cond);
+	if (err != SUCCESS)
+		printf("pqueue_close: pthread_cond_destroy() failed: %s\n", strerror(err));
+	err = pthread_mutex_destroy(&pq->lock);
+	if (err != SUCCESS)
+		printf("pqueue_close: pthread_mutex_destroy() failed: %s\n", strerror(err));
+	free(pq);
+}
+
+// Called under the lock once head has left the mapped segment. What is
+// still unsynced in the old segment is synced first, group commits only
+// ever look at the current one.
+static int head_roll(pqueue_t *pq) {
+	if (pq->durability != PQUEUE_DURABLE_NONE) {
+		if (sync_records(pq, &pq->head_seg, pq->flushed, pq->head) != SUCCESS)
+			return ERROR;
+		pq->flushed = pq->head;
+	}
+	segment_unmap(pq, &pq->head_seg);
+	if (segment_map(pq, &pq->head_seg, pq->head / pq->per_segment, 1) != SUCCESS)
+		return ERROR;
+	return sync_dir(pq);
+}
+
+// Called under the lock. The first waiter becomes the leader and syncs
+// everything appended so far, including what others added while it
+// waited; the rest sleep until a commit covers their record.
+static int group_commit(pqueue_t *pq, uint64_t seq) {
+	while (pq->flushed <= seq) {
+		if (pq->flushing) {
+			pthread_cond_wait(&pq->flushed_cond, &pq->lock);
+			continue;
+		}
+		pq->flushing = 1;
+		if (pq->batch_us) {
+			pthread_mutex_unlock(&pq->lock);
+			usleep(pq->batch_us);
+			pthread_mutex_lock(&pq->lock);
+		}
+
+		// the segment cannot roll over while flushing is set
+		uint64_t from = pq->flushed, to = pq->head;
+		pqueue_segment_t seg = pq->head_seg;
+		pthread_mutex_unlock(&pq->lock);
+		long start = now_ns();
+		int err = sync_records(pq, &seg, from, to);
+		if (err == SUCCESS)
+			err = sync_offset(pq);
+		long took = now_ns() - start;
+		pthread_mutex_lock(&pq->lock);
+
+		if (err == SUCCESS) {
+			pq->flushed = to;
+			pq->commits++;
+			pq->committed += to - from;
+			pq->commit_ns += took;
+		}
+		pq->flushing = 0;
+		pthread_cond_broadcast(&pq->flushed_cond);
+		if (err != SUCCESS)
+			return ERROR;
+	}
+	return SUCCESS;
+}
+
+int pqueue_add(pqueue_t *pq, int val) {
+	if (pq == NULL) return QUEUE_ERROR;
+
+	int err = pthread_mutex_lock(&pq->lock);
+	if (err != SUCCESS) {
+		printf("pqueue_add: pthread_mutex_lock() failed: %s\n", strerror(err));
+		return QUEUE_ERROR;
+	}
+	while (pq->head / pq->per_segment != pq->head_seg.index) {
+		if (pq->flushing) {
+			pthread_cond_wait(&pq->flushed_cond, &pq->lock);
+			continue;
+		}
+		if (head_roll(pq) != SUCCESS) {
+			pthread_mutex_unlock(&pq->lock);
+			return QUEUE_ERROR;
+		}
+	}
+
+	uint64_t seq = pq->head;
+	pqueue_rec_t *r = &pq->head_seg.recs[seq % pq->per_segment];
+	r->val = val;
+	r->check = rec_check(seq, val);
+	r->seq = seq;
+	pq->head++;
+	pq->add_count++;
+
+	err = SUCCESS;
+	if (pq->durability == PQUEUE_DURABLE_ITEM) {
+		long start = now_ns();
+		err = sync_records(pq, &pq->head_seg, seq, seq + 1);
+		if (err == SUCCESS) {
+			pq->flushed = seq + 1;
+			pq->commits++;
+			pq->committed++;
+			pq->commit_ns += now_ns() - start;
+		}
+	} else if (pq->durability == PQUEUE_DURABLE_BATCH) {
+		err = group_commit(pq, seq);
+	}
+	pthread_mutex_unlock(&pq->lock);
+	return err == SUCCESS ? QUEUE_SUCCESS : QUEUE_ERROR;
+}
+
+// Called under the lock when tail has left the mapped segment. Fully
+// consumed segments are removed once the offset past them is durable.
+static int tail_move(pqueue_t *pq) {
+	uint64_t index = pq->tail / pq->per_segment;
+	uint64_t old = pq->tail_seg.index;
+
+	segment_unmap(pq, &pq->tail_seg);
+	if (segment_map(pq, &pq->tail_seg, index, 0) != SUCCESS)
+		return ERROR;
+	if (old != NO_SEGMENT && old < index) {
+		// on failure the files stay until the next pqueue_open()
+		if (pq->durability != PQUEUE_DURABLE_NONE && sync_offset(pq) != SUCCESS)
+			return SUCCESS;
+		for (; old < index; old++)
+			segment_remove(pq, old);
+	}
+	return SUCCESS;
+}
+
+int pqueue_get(pqueue_t *pq, int *val) {
+	if (pq == NULL) return QUEUE_ERROR;
+
+	int err = pthread_mutex_lock(&pq->lock);
+	if (err != SUCCESS) {
+		printf("pqueue_get: pthread_mutex_lock() failed: %s\n", strerror(err));
+		return QUEUE_ERROR;
+	}
+	if (pq->tail == pq->head) {
+		pthread_mutex_unlock(&pq->lock);
+		return QUEUE_ERROR;
+	}
+	if (pq->tail / pq->per_segment != pq->tail_seg.index && tail_move(pq) != SUCCESS) {
+		pthread_mutex_unlock(&pq->lock);
+		return QUEUE_ERROR;
+	}
+
+	*val = pq->tail_seg.recs[pq->tail % pq->per_segment].val;
+	pq->tail++;
+	pq->offset->tail = pq->tail;
+	pq->get_count++;
+	err = SUCCESS;
+	if (pq->durability == PQUEUE_DURABLE_ITEM)
+		err = sync_offset(pq);
+	pthread_mutex_unlock(&pq->lock);
+	return err == SUCCESS ? QUEUE_SUCCESS : QUEUE_ERROR;
+}
+
+int pqueue_sync(pqueue_t *pq) {
+	if (pq == NULL) return ERROR;
+
+	pthread_mutex_lock(&pq->lock);
+	while (pq->flushing)
+		pthread_cond_wait(&pq->flushed_cond, &pq->lock);
+	int err = sync_records(pq, &pq->head_seg, pq->flushed, pq->head);
+	if (err == SUCCESS)
+		err = sync_offset(pq);
+	if (err == SUCCESS)
+		pq->flushed = pq->head;
+	pthread_mutex_unlock(&pq->lock);
+	return err;
+}
+
+void pqueue_print_stats(pqueue_t *pq) {
+	printf("pqueue stats: size %lu; counts (%ld %ld); commits %ld, %.1f records and %ld us each; "
+		"recovered %ld records in %ld us\n",
+		(unsigned long)(pq->head - pq->tail), pq->add_count, pq->get_count, pq->commits,
+		pq->commits ? (double)pq->committed / pq->commits : 0.0,
+		pq->commits ? pq->commit_ns / pq->commits / 1000 : 0,
+		pq->recovered, pq->recovery_ns / 1000);
+}
@@ -0,0 +1,88 @@
+#ifndef __FITOS_PQUEUE_H__
+#define __FITOS_PQUEUE_H__
+
+// Persistent queue of ints: an append-only log of fixed-size records split
+// into mmap'd segment files, plus a consumer offset file, in one directory.
+// Items are handed out in the order they were added; an item is delivered
+// again after a crash if the crash came before its consumption was synced.
+//   gcc pqueue-example.c pqueue.c -lpthread
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define SUCCESS 0
+#define ERROR -1
+#define QUEUE_ERROR 0
+#define QUEUE_SUCCESS 1
+
+#define PQUEUE_SEGMENT_SIZE (64L << 20)
+
+// when pqueue_add() may return
+enum {
+	PQUEUE_DURABLE_NONE,	// written to the mapping: survives the process, not the machine
+	PQUEUE_DURABLE_BATCH,	// synced by a group commit shared with concurrent adds
+	PQUEUE_DURABLE_ITEM,	// synced on its own
+};
+
+typedef struct _PqueueOpts {
+	long segment_size;	// bytes, 0 - PQUEUE_SEGMENT_SIZE
+	int durability;
+	int batch_us;		// a group commit leader waits this long for more adds
+} pqueue_opts_t;
+
+typedef struct _PqueueRec {
+	uint64_t seq;		// position in the log, never reused
+	int32_t val;
+	uint32_t check;		// mix of seq and val, never 0: zeroed file space is not a record
+} pqueue_rec_t;
+
+typedef struct _PqueueSegment {
+	uint64_t index;		// segment number, covers seq [index * per_segment, ...)
+	pqueue_rec_t *recs;
+} pqueue_segment_t;
+
+typedef struct _PqueueOffset {
+	uint64_t magic;
+	uint64_t tail;		// first unconsumed seq
+	uint64_t segment_size;	// fixed when the queue is created
+} pqueue_offset_t;
+
+typedef struct _Pqueue {
+	pthread_mutex_t lock;
+	pthread_cond_t flushed_cond;
+
+	int dirfd;
+	long segment_size;
+	uint64_t per_segment;	// records per segment
+	int durability;
+	int batch_us;
+
+	pqueue_segment_t head_seg;	// appends go here
+	pqueue_segment_t tail_seg;	// gets read from here, may map the same file
+	pqueue_offset_t *offset;	// mmap'd offset file
+	uint64_t head;			// next seq to write
+	uint64_t tail;			// next seq to read
+	uint64_t flushed;		// every seq below is on disk
+	int flushing;			// a group commit leader is in msync()
+
+	long add_count;
+	long get_count;
+	long commits;			// msync rounds of group commits
+	long committed;			// records they covered
+	long commit_ns;
+	long recovered;			// unconsumed records found by pqueue_open()
+	long recovery_ns;
+} pqueue_t;
+
+pqueue_t* pqueue_open(const char *dir, const pqueue_opts_t *opts);
+void pqueue_close(pqueue_t *pq);
+int pqueue_add(pqueue_t *pq, int val);
+// does not block, QUEUE_ERROR when the queue is empty
+int pqueue_get(pqueue_t *pq, int *val);
+// makes every add and get so far durable
+int pqueue_sync(pqueue_t *pq);
+void pqueue_print_stats(pqueue_t *pq);
+
+#endif		// __FITOS_PQUEUE_H__
@@ -0,0 +1,31 @@
+#ifndef __FITOS_QCACHE_H__
+#define __FITOS_QCACHE_H__
+
+// Cache line grouping for queue_t. Fields written by one side only, fields
+// written under the lock by both sides and fields that are only read get
+// lines of their own, so a producer and a consumer on different cores do
+// not keep stealing each other's lines. Groups are padded to two lines:
+// the adjacent line prefetcher moves lines in pairs.
+// Build with -DQUEUE_PACKED to get the old packed layout back for comparison.
+
+#include <stdlib.h>
+
+#define QCACHE_LINE 64
+
+#ifdef QUEUE_PACKED
+#define QCACHE_ALIGN 16
+#define QCACHE_ALIGNED
+#else
+#define QCACHE_ALIGN (2 * QCACHE_LINE)
+#define QCACHE_ALIGNED __attribute__((aligned(QCACHE_ALIGN)))
+#endif
+
+// malloc() only guarantees 16 bytes
+static inline void *qcache_alloc(size_t size) {
+	void *p = NULL;
+	if (posix_memalign(&p, QCACHE_ALIGN, size) != 0)
+		return NULL;
+	return p;
+}
+
+#endif		// __FITOS_QCACHE_H__
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "qpool.h"
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+#define PAGE_SIZE_MIN 4096
+#define NUMA_MASK_WORDS 4
+
+static int bind_numa_node(void *addr, size_t len, int node) {
+	unsigned long mask[NUMA_MASK_WORDS];
+	size_t bits = sizeof(mask) * 8;
+
+	if (node < 0 || (size_t)node >= bits) {
+		printf("qpool_init: numa node %d is out of range\n", node);
+		return ERROR;
+	}
+	memset(mask, 0, sizeof(mask));
+	mask[node / (sizeof(long) * 8)] |= 1UL << (node % (sizeof(long) * 8));
+
+	// the kernel reads maxnode - 1 bits of the mask
+	if (syscall(SYS_mbind, addr, len, MPOL_BIND, mask, bits + 1, 0) != SUCCESS) {
+		printf("qpool_init: mbind() to node %d failed: %s\n", node, strerror(errno));
+		return ERROR;
+	}
+	return SUCCESS;
+}
+
+int qpool_init(qpool_t *pool, size_t node_size, int capacity, int flags, int numa_node) {
+	memset(pool, 0, sizeof(qpool_t));
+	// a free node keeps the list link in its first word
+	if (node_size < sizeof(void *))
+		node_size = sizeof(void *);
+	pool->node_size = node_size;
+
+	if (!(flags & (QPOOL_PREALLOC | QPOOL_HUGEPAGES | QPOOL_PREFAULT | QPOOL_MLOCK)) && numa_node == QPOOL_NO_NODE)
+		return SUCCESS;
+	if (capacity <= 0) {
+		printf("qpool_init: bad capacity %d\n", capacity);
+		return ERROR;
+	}
+
+	pool->capacity = capacity;
+	pool->flags = QPOOL_PREALLOC;
+	pool->map_size = node_size * (size_t)capacity;
+
+	void *addr = MAP_FAILED;
+	if (flags & QPOOL_HUGEPAGES) {
+		pool->map_size = (pool->map_size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		addr = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (addr != MAP_FAILED)
+			pool->flags |= QPOOL_HUGEPAGES;
+		else
+			printf("qpool_init: MAP_HUGETLB failed: %s, falling back to THP\n", strerror(errno));
+	}
+	if (addr == MAP_FAILED) {
+		addr = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED) {
+			printf("qpool_init: mmap() failed: %s\n", strerror(errno));
+			return ERROR;
+		}
+		if ((flags & QPOOL_HUGEPAGES) && madvise(addr, pool->map_size, MADV_HUGEPAGE) != SUCCESS)
+			printf("qpool_init: madvise(MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+	}
+	pool->nodes = addr;
+
+	// the policy has to be in place before the first touch
+	if (numa_node != QPOOL_NO_NODE)
+		bind_numa_node(addr, pool->map_size, numa_node);
+
+	if (flags & QPOOL_PREFAULT) {
+		for (size_t off = 0; off < pool->map_size; off += PAGE_SIZE_MIN)
+			pool->nodes[off] = 0;
+		pool->flags |= QPOOL_PREFAULT;
+	}
+	if (flags & QPOOL_MLOCK) {
+		if (mlock(addr, pool->map_size) != SUCCESS)
+			printf("qpool_init: mlock() failed: %s\n", strerror(errno));
+		else
+			pool->flags |= QPOOL_MLOCK;
+	}
+	return SUCCESS;
+}
+
+void qpool_destroy(qpool_t *pool) {
+	if (pool->nodes == NULL)
+		return;
+
+	if (munmap(pool->nodes, pool->map_size) != SUCCESS)
+		printf("qpool_destroy: munmap() failed: %s\n", strerror(errno));
+	pool->nodes = NULL;
+	pool->free = NULL;
+}
+
+// caller serializes access, the queue does it under its own lock
+void *qpool_alloc(qpool_t *pool) {
+	if (pool->nodes == NULL)
+		return malloc(pool->node_size);
+
+	if (pool->free != NULL) {
+		void *node = pool->free;
+		pool->free = *(void **)node;
+		return node;
+	}
+	if (pool->used < pool->capacity)
+		return pool->nodes + (size_t)pool->used++ * pool->node_size;
+	return NULL;
+}
+
+void qpool_free(qpool_t *pool, void *node) {
+	if (pool->nodes == NULL) {
+		free(node);
+		return;
+	}
+	*(void **)node = pool->free;
+	pool->free = node;
+}
@@ -0,0 +1,38 @@
+#ifndef __FITOS_QPOOL_H__
+#define __FITOS_QPOOL_H__
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define SUCCESS 0
+#define ERROR -1
+
+// storage flags for queue_init_opts()
+#define QPOOL_PREALLOC  0x01	// nodes come from one preallocated mapping instead of malloc()
+#define QPOOL_HUGEPAGES 0x02	// back the mapping with MAP_HUGETLB, fall back to THP
+#define QPOOL_PREFAULT  0x04	// touch every page before the queue is used
+#define QPOOL_MLOCK     0x08	// keep the mapping resident
+#define QPOOL_NO_NODE   -1	// do not bind the mapping to a NUMA node
+
+typedef struct _QueuePool {
+	char *nodes;
+	void *free;		// list of returned nodes, linked through their first word
+
+	size_t node_size;
+	size_t map_size;
+	int capacity;
+	int used;		// nodes handed out at least once, the rest is still untouched
+	int flags;		// QPOOL_* flags that actually took effect
+} qpool_t;
+
+int qpool_init(qpool_t *pool, size_t node_size, int capacity, int flags, int numa_node);
+void qpool_destroy(qpool_t *pool);
+void *qpool_alloc(qpool_t *pool);
+void qpool_free(qpool_t *pool, void *node);
+
+#endif		// __FITOS_QPOOL_H__
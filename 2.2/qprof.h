@@ -0,0 +1,92 @@
+#ifndef __FITOS_QPROF_H__
+#define __FITOS_QPROF_H__
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+
+// Lock contention profile of a queue. Everything except 'enabled' is
+// updated by the lock holder, so the counters need no atomics of their own.
+typedef struct _QueueProf {
+	int enabled;		// switched by queue_set_profiling(), read without the lock
+
+	long contended;		// lock was busy on the first try
+	long uncontended;
+	long wait_ns;		// waiting for the lock
+	long max_wait_ns;	// longest single wait: starvation shows up here
+	double wait_sq;		// sum of squared waits in us, for the variance
+	long hold_ns;		// holding the lock
+	long blocked_ns;	// sleeping in cond/sem waits for a slot or an item
+	long alloc_ns;		// getting a node from malloc() or the pool
+
+	long acquired_ns;	// when the current holder got the lock, 0 - not sampled
+} qprof_t;
+
+static inline long qprof_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static inline int qprof_on(qprof_t *p) {
+	return __atomic_load_n(&p->enabled, __ATOMIC_RELAXED);
+}
+
+static inline void qprof_set(qprof_t *p, int enabled) {
+	__atomic_store_n(&p->enabled, enabled, __ATOMIC_RELAXED);
+}
+
+// start == 0 means the lock was taken on the first try
+static inline void qprof_acquired(qprof_t *p, long start) {
+	long now = qprof_now();
+	if (start) {
+		long wait = now - start;
+		p->contended++;
+		p->wait_ns += wait;
+		p->wait_sq += (double)wait * wait / 1e6;
+		if (wait > p->max_wait_ns)
+			p->max_wait_ns = wait;
+	} else {
+		p->uncontended++;
+	}
+	p->acquired_ns = now;
+}
+
+static inline void qprof_release(qprof_t *p) {
+	if (p->acquired_ns == 0)
+		return;
+	p->hold_ns += qprof_now() - p->acquired_ns;
+	p->acquired_ns = 0;
+}
+
+// cond waits drop the lock: the hold interval ends before the wait
+// and a new one starts when the waiter is woken up
+static inline long qprof_block_begin(qprof_t *p) {
+	qprof_release(p);
+	return qprof_now();
+}
+
+static inline void qprof_block_end(qprof_t *p, long start) {
+	long now = qprof_now();
+	p->blocked_ns += now - start;
+	p->acquired_ns = now;
+}
+
+static inline void qprof_print(qprof_t *p) {
+	long total = p->contended + p->uncontended;
+	if (total == 0)
+		return;
+	long avg_wait = p->contended ? p->wait_ns / p->contended : 0;
+	// over all acquisitions, an uncontended one counts as a wait of 0
+	double mean_us = p->wait_ns / 1e3 / total;
+	double variance = p->wait_sq / total - mean_us * mean_us;
+
+	printf("lock stats: acquisitions %ld (contended %ld uncontended %ld); "
+		"avg contended wait %ld ns; max wait %ld us; wait variance %.1f us^2; "
+		"avg hold %ld ns; blocked %ld ms; alloc %ld ms\n",
+		total, p->contended, p->uncontended,
+		avg_wait, p->max_wait_ns / 1000, variance, p->hold_ns / total,
+		p->blocked_ns / 1000000, p->alloc_ns / 1000000);
+}
+
+#endif		// __FITOS_QPROF_H__
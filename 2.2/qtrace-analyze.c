@@ -0,0 +1,233 @@
+// Offline analysis of a trace written by qtrace_start()/qtrace_stop().
+//   gcc -O2 -o qtrace-analyze qtrace-analyze.c
+//   QUEUE_TRACE=/tmp/q.trace ./queue-threads && ./qtrace-analyze /tmp/q.trace
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "qtrace.h"
+
+#define SUCCESS 0
+#define ERROR -1
+#define MAX_QUEUES 64
+#define MAX_THREADS 1024
+#define MAX_REPORTED 20
+#define NS_PER_MS 1000000L
+
+typedef struct {
+	uint64_t addr;
+	long adds, gets, full, empty;
+	long max_depth;
+	uint64_t last_success_ns;
+	int last_depth;
+	long stalls;
+} queue_info_t;
+
+typedef struct {
+	uint32_t tid;
+	long ops[QTRACE_GET_EMPTY + 1];
+	uint64_t first_ns, last_ns;
+	uint64_t wait_ns, max_wait_ns;
+} thread_info_t;
+
+static queue_info_t queues[MAX_QUEUES];
+static int nqueues;
+static thread_info_t threads[MAX_THREADS];
+static int nthreads;
+
+static int cmp_ts(const void *a, const void *b) {
+	const qtrace_rec_t *x = a, *y = b;
+	return x->ts_ns < y->ts_ns ? -1 : x->ts_ns > y->ts_ns;
+}
+
+static int queue_index(uint64_t addr) {
+	for (int i = 0; i < nqueues; i++) {
+		if (queues[i].addr == addr)
+			return i;
+	}
+	if (nqueues == MAX_QUEUES)
+		return ERROR;
+	queues[nqueues].addr = addr;
+	return nqueues++;
+}
+
+static thread_info_t *thread_info(uint32_t tid) {
+	for (int i = 0; i < nthreads; i++) {
+		if (threads[i].tid == tid)
+			return &threads[i];
+	}
+	if (nthreads == MAX_THREADS)
+		return NULL;
+	threads[nthreads].tid = tid;
+	return &threads[nthreads++];
+}
+
+static qtrace_rec_t *load(const char *path, long *count) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		printf("load: fopen() failed for %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	qtrace_header_t header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, QTRACE_MAGIC, sizeof(QTRACE_MAGIC)) != 0
+		|| header.rec_size != sizeof(qtrace_rec_t)) {
+		printf("load: %s is not a queue trace\n", path);
+		fclose(f);
+		return NULL;
+	}
+
+	long cap = 1 << 16, n = 0;
+	qtrace_rec_t *recs = malloc(cap * sizeof(qtrace_rec_t));
+	while (recs != NULL) {
+		size_t got = fread(recs + n, sizeof(qtrace_rec_t), cap - n, f);
+		n += got;
+		if (n < cap)
+			break;
+		cap *= 2;
+		qtrace_rec_t *grown = realloc(recs, cap * sizeof(qtrace_rec_t));
+		if (grown == NULL)
+			free(recs);
+		recs = grown;
+	}
+	fclose(f);
+	if (recs == NULL) {
+		printf("load: memory allocation failed\n");
+		return NULL;
+	}
+	*count = n;
+	return recs;
+}
+
+static void usage(const char *name) {
+	printf("Use %s [-i interval_ms] [-s stall_ms] trace_file\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	long interval_ms = 100;
+	long stall_ms = 10;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:s:")) != -1) {
+		switch (opt) {
+		case 'i': interval_ms = atol(optarg); break;
+		case 's': stall_ms = atol(optarg); break;
+		default:
+			usage(argv[0]);
+			return ERROR;
+		}
+	}
+	if (optind != argc - 1 || interval_ms < 1 || stall_ms < 1) {
+		usage(argv[0]);
+		return ERROR;
+	}
+
+	long n;
+	qtrace_rec_t *recs = load(argv[optind], &n);
+	if (recs == NULL)
+		return ERROR;
+	if (n == 0) {
+		printf("trace is empty\n");
+		free(recs);
+		return SUCCESS;
+	}
+	// every thread's records are in order, the flusher interleaves them
+	qsort(recs, n, sizeof(qtrace_rec_t), cmp_ts);
+
+	uint64_t t0 = recs[0].ts_ns;
+	uint64_t interval_ns = interval_ms * NS_PER_MS;
+	uint64_t stall_ns = stall_ms * NS_PER_MS;
+	uint64_t bucket_end = t0 + interval_ns;
+	long reported_stalls = 0, reported_waits = 0, long_waits = 0;
+
+	printf("depth over time, %ld ms buckets: time_ms queue depth max_depth adds gets full empty\n", interval_ms);
+	long b_adds[MAX_QUEUES] = { 0 }, b_gets[MAX_QUEUES] = { 0 }, b_full[MAX_QUEUES] = { 0 }, b_empty[MAX_QUEUES] = { 0 };
+	int b_max[MAX_QUEUES] = { 0 };
+
+	for (long i = 0; i <= n; i++) {
+		// close every bucket the next record has moved past
+		while (i == n || recs[i].ts_ns >= bucket_end) {
+			for (int qi = 0; qi < nqueues; qi++) {
+				if (b_adds[qi] + b_gets[qi] + b_full[qi] + b_empty[qi] == 0)
+					continue;
+				printf("%8lu %5d %8d %8d %8ld %8ld %8ld %8ld\n",
+					(unsigned long)((bucket_end - t0) / NS_PER_MS - interval_ms), qi, queues[qi].last_depth,
+					b_max[qi], b_adds[qi], b_gets[qi], b_full[qi], b_empty[qi]);
+				b_adds[qi] = b_gets[qi] = b_full[qi] = b_empty[qi] = 0;
+				b_max[qi] = queues[qi].last_depth;
+			}
+			if (i == n)
+				break;
+			bucket_end += interval_ns;
+		}
+		if (i == n)
+			break;
+
+		qtrace_rec_t *r = &recs[i];
+		if (r->op < QTRACE_ADD || r->op > QTRACE_GET_EMPTY)
+			continue;
+		int qi = queue_index(r->queue);
+		thread_info_t *t = thread_info(r->tid);
+		if (qi == ERROR || t == NULL)
+			continue;
+		queue_info_t *q = &queues[qi];
+
+		if (t->ops[QTRACE_ADD] + t->ops[QTRACE_ADD_FULL] + t->ops[QTRACE_GET] + t->ops[QTRACE_GET_EMPTY] == 0)
+			t->first_ns = r->ts_ns;
+		t->last_ns = r->ts_ns;
+		t->ops[r->op]++;
+		t->wait_ns += r->wait_ns;
+		if (r->wait_ns > t->max_wait_ns)
+			t->max_wait_ns = r->wait_ns;
+		if (r->wait_ns >= stall_ns) {
+			long_waits++;
+			if (reported_waits++ < MAX_REPORTED)
+				printf("long wait: tid %u waited %u ms at %lu ms\n",
+					r->tid, r->wait_ns / (uint32_t)NS_PER_MS, (unsigned long)((r->ts_ns - t0) / NS_PER_MS));
+		}
+
+		if (r->op == QTRACE_ADD || r->op == QTRACE_GET) {
+			// nothing moved through the queue although it was not empty
+			if (q->last_success_ns && q->last_depth > 0 && r->ts_ns - q->last_success_ns >= stall_ns) {
+				q->stalls++;
+				if (reported_stalls++ < MAX_REPORTED)
+					printf("stall: queue %d idle for %lu ms at %lu ms with depth %d\n", qi,
+						(unsigned long)((r->ts_ns - q->last_success_ns) / NS_PER_MS),
+						(unsigned long)((q->last_success_ns - t0) / NS_PER_MS), q->last_depth);
+			}
+			q->last_success_ns = r->ts_ns;
+		}
+		switch (r->op) {
+		case QTRACE_ADD: q->adds++; b_adds[qi]++; break;
+		case QTRACE_GET: q->gets++; b_gets[qi]++; break;
+		case QTRACE_ADD_FULL: q->full++; b_full[qi]++; break;
+		case QTRACE_GET_EMPTY: q->empty++; b_empty[qi]++; break;
+		}
+		q->last_depth = r->depth;
+		if (r->depth > b_max[qi])
+			b_max[qi] = r->depth;
+		if (r->depth > q->max_depth)
+			q->max_depth = r->depth;
+	}
+
+	printf("\n%ld records over %.3f s\n", n, (recs[n - 1].ts_ns - t0) / 1e9);
+	for (int qi = 0; qi < nqueues; qi++) {
+		queue_info_t *q = &queues[qi];
+		printf("queue %d (%#lx): adds %ld gets %ld full %ld empty %ld; max depth %ld; stalls %ld\n",
+			qi, (unsigned long)q->addr, q->adds, q->gets, q->full, q->empty, q->max_depth, q->stalls);
+	}
+	printf("long waits (>= %ld ms): %ld\n", stall_ms, long_waits);
+	for (int i = 0; i < nthreads; i++) {
+		thread_info_t *t = &threads[i];
+		long ops = t->ops[QTRACE_ADD] + t->ops[QTRACE_ADD_FULL] + t->ops[QTRACE_GET] + t->ops[QTRACE_GET_EMPTY];
+		double secs = (t->last_ns - t->first_ns) / 1e9;
+		printf("thread %u: adds %ld gets %ld full %ld empty %ld; %.0f ops/s; avg wait %lu ns; max wait %lu ns\n",
+			t->tid, t->ops[QTRACE_ADD], t->ops[QTRACE_GET], t->ops[QTRACE_ADD_FULL], t->ops[QTRACE_GET_EMPTY],
+			secs > 0 ? ops / secs : 0.0, (unsigned long)(t->wait_ns / ops), (unsigned long)t->max_wait_ns);
+	}
+	free(recs);
+	return SUCCESS;
+}
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "qtrace.h"
+
+#define SUCCESS 0
+#define ERROR -1
+#define FLUSH_INTERVAL_US 10000
+
+int qtrace_enabled;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static qtrace_ring_t *rings;		// every ring registered, freed by qtrace_stop()
+static FILE *trace_file;
+static pthread_t flusher_tid;
+static int flusher_stop;
+static int generation;			// bumped by qtrace_stop(), stale thread rings are gone
+static __thread qtrace_ring_t *my_ring;
+static __thread int my_generation;
+// marks the ring of an exiting thread dead, so threads that come and go
+// reuse rings instead of leaving one behind each until qtrace_stop()
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static void ring_release(void *arg) {
+	qtrace_ring_t *ring = arg;
+	pthread_mutex_lock(&rings_lock);
+	// a ring of an older generation is already freed
+	if (my_generation == generation)
+		ring->dead = 1;
+	pthread_mutex_unlock(&rings_lock);
+}
+
+static void ring_key_init(void) {
+	int err = pthread_key_create(&ring_key, ring_release);
+	if (err != SUCCESS)
+		printf("qtrace: pthread_key_create() failed: %s\n", strerror(err));
+}
+
+static qtrace_ring_t *ring_register(void) {
+	pthread_once(&ring_key_once, ring_key_init);
+
+	pthread_mutex_lock(&rings_lock);
+	// a dead ring the flusher has emptied has no reader or writer left
+	qtrace_ring_t *ring;
+	for (ring = rings; ring != NULL; ring = ring->next) {
+		if (ring->dead && ring->tail == ring->head)
+			break;
+	}
+	if (ring != NULL) {
+		ring->dead = 0;
+	} else {
+		ring = calloc(1, sizeof(qtrace_ring_t));
+		if (ring == NULL) {
+			pthread_mutex_unlock(&rings_lock);
+			return NULL;
+		}
+		ring->next = rings;
+		rings = ring;
+	}
+	ring->tid = gettid();
+	pthread_mutex_unlock(&rings_lock);
+
+	if (pthread_setspecific(ring_key, ring) != SUCCESS)
+		printf("qtrace: pthread_setspecific() failed, the ring stays until qtrace_stop()\n");
+	return ring;
+}
+
+void qtrace_record(const void *queue, int op, int depth, long start_ns, long acquired_ns) {
+	qtrace_ring_t *ring = my_ring;
+	int gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+	if (ring == NULL || my_generation != gen) {
+		ring = my_ring = ring_register();
+		my_generation = gen;
+		if (ring == NULL)
+			return;
+	}
+
+	uint64_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == QTRACE_RING_SIZE) {
+		ring->dropped++;
+		return;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	long wait = acquired_ns - start_ns;
+
+	qtrace_rec_t *rec = &ring->recs[head & (QTRACE_RING_SIZE - 1)];
+	rec->ts_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->queue = (uintptr_t)queue;
+	rec->tid = ring->tid;
+	rec->op = op;
+	rec->pad = 0;
+	rec->depth = depth;
+	rec->wait_ns = wait > UINT32_MAX ? UINT32_MAX : (wait < 0 ? 0 : wait);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void flush_rings(void) {
+	pthread_mutex_lock(&rings_lock);
+	for (qtrace_ring_t *ring = rings; ring != NULL; ring = ring->next) {
+		uint64_t tail = ring->tail;
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		while (tail != head) {
+			// write up to the end of the ring at once
+			uint64_t idx = tail & (QTRACE_RING_SIZE - 1);
+			uint64_t n = head - tail;
+			if (n > QTRACE_RING_SIZE - idx)
+				n = QTRACE_RING_SIZE - idx;
+			if (fwrite(&ring->recs[idx], sizeof(qtrace_rec_t), n, trace_file) != n)
+				printf("qtrace: fwrite() failed: %s\n", strerror(errno));
+			tail += n;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&rings_lock);
+}
+
+void *qtrace_flusher(void *arg) {
+	(void)arg;
+	while (!__atomic_load_n(&flusher_stop, __ATOMIC_RELAXED)) {
+		flush_rings();
+		usleep(FLUSH_INTERVAL_US);
+	}
+	return NULL;
+}
+
+int qtrace_start(const char *path) {
+	if (trace_file != NULL) {
+		printf("qtrace_start: tracing is already on\n");
+		return ERROR;
+	}
+	trace_file = fopen(path, "wb");
+	if (trace_file == NULL) {
+		printf("qtrace_start: fopen() failed for %s: %s\n", path, strerror(errno));
+		return ERROR;
+	}
+
+	qtrace_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, QTRACE_MAGIC, sizeof(QTRACE_MAGIC));
+	header.rec_size = sizeof(qtrace_rec_t);
+	if (fwrite(&header, sizeof(header), 1, trace_file) != 1) {
+		printf("qtrace_start: fwrite() failed: %s\n", strerror(errno));
+		fclose(trace_file);
+		trace_file = NULL;
+		return ERROR;
+	}
+
+	flusher_stop = 0;
+	int err = pthread_create(&flusher_tid, NULL, qtrace_flusher, NULL);
+	if (err != SUCCESS) {
+		printf("qtrace_start: pthread_create() failed: %s\n", strerror(err));
+		fclose(trace_file);
+		trace_file = NULL;
+		return ERROR;
+	}
+	__atomic_store_n(&qtrace_enabled, 1, __ATOMIC_RELEASE);
+	return SUCCESS;
+}
+
+// threads still inside queue calls must be finished before this is called
+void qtrace_stop(void) {
+	if (trace_file == NULL)
+		return;
+
+	__atomic_store_n(&qtrace_enabled, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&flusher_stop, 1, __ATOMIC_RELAXED);
+	int err = pthread_join(flusher_tid, NULL);
+	if (err != SUCCESS)
+		printf("qtrace_stop: pthread_join() failed: %s\n", strerror(err));
+	flush_rings();
+
+	uint64_t dropped = 0;
+	pthread_mutex_lock(&rings_lock);
+	while (rings != NULL) {
+		qtrace_ring_t *ring = rings;
+		rings = ring->next;
+		dropped += ring->dropped;
+		free(ring);
+	}
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&rings_lock);
+
+	if (dropped != 0)
+		printf("qtrace: %lu records dropped, the flusher could not keep up\n", (unsigned long)dropped);
+	if (fclose(trace_file) != 0)
+		printf("qtrace_stop: fclose() failed: %s\n", strerror(errno));
+	trace_file = NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef __FITOS_QTRACE_H__
+#define __FITOS_QTRACE_H__
+
+// Opt-in binary trace of queue operations. Every thread appends fixed-size
+// records to its own single-producer ring; a background thread drains the
+// rings into a file. qtrace-analyze.c reads the file back.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define QTRACE_MAGIC "QTRACE1"
+#define QTRACE_RING_SIZE 65536		// records per thread, a power of two
+
+enum {
+	QTRACE_ADD = 1,
+	QTRACE_ADD_FULL,	// queue_add() found no room
+	QTRACE_GET,
+	QTRACE_GET_EMPTY,	// queue_get() found nothing
+};
+
+typedef struct _QtraceRec {
+	uint64_t ts_ns;
+	uint64_t queue;		// queue address, tells queues of one process apart
+	uint32_t tid;
+	uint16_t op;
+	uint16_t pad;
+	int32_t depth;		// queue size right after the operation
+	uint32_t wait_ns;	// from the call to holding the lock, saturated
+} qtrace_rec_t;
+
+typedef struct _QtraceFileHeader {
+	char magic[8];
+	uint32_t rec_size;
+	uint32_t pad;
+} qtrace_header_t;
+
+typedef struct _QtraceRing {
+	qtrace_rec_t recs[QTRACE_RING_SIZE];
+	uint64_t head;			// written by the owner thread
+	uint64_t tail;			// written by the flusher
+	uint64_t dropped;
+	uint32_t tid;
+	int dead;			// the owner exited, reused once flushed
+	struct _QtraceRing *next;
+} qtrace_ring_t;
+
+extern int qtrace_enabled;
+
+static inline int qtrace_on(void) {
+	return __builtin_expect(__atomic_load_n(&qtrace_enabled, __ATOMIC_RELAXED), 0);
+}
+
+int qtrace_start(const char *path);
+void qtrace_stop(void);
+void qtrace_record(const void *queue, int op, int depth, long start_ns, long acquired_ns);
+
+#endif		// __FITOS_QTRACE_H__
@@ -0,0 +1,58 @@
+#!/bin/bash
+# Flat combining against plain locking: queue-stress on backend e with the
+# mutex and with combining, and on backend a with the spinlock, at 8, 16 and
+# 64 threads split evenly between producers and consumers. Options are
+# passed through to queue-stress, e.g.
+#   THREADS="8 64" ./queue-combining.sh -d 10
+# Combining only pays off with several CPUs: on one CPU there is never more
+# than one call waiting to be combined. A run that takes longer than
+# RUN_TIMEOUT seconds is cut off: the spinlock can livelock with more threads
+# than CPUs. Last, queue-fc-churn checks that combining survives many more
+# short-lived threads than there are slots.
+set -o pipefail
+
+cd "$(dirname "$0")" || exit 1
+BUILD_DIR=${BUILD_DIR:-/tmp/queue-combining}
+VARIANTS=${VARIANTS:-"e:mutex e:fc a:spin"}
+THREADS=${THREADS:-"8 16 64"}
+RUN_TIMEOUT=${RUN_TIMEOUT:-60}
+mkdir -p "$BUILD_DIR" || exit 1
+
+args=("$@")
+[ ${#args[@]} -eq 0 ] && args=(-d 5)
+
+failed=""
+for variant in $VARIANTS; do
+	backend=${variant%%:*}
+	gcc -O2 -Wall -I"$backend" -DQUEUE_BACKEND="\"$backend\"" -o "$BUILD_DIR/queue-stress-$backend" \
+		queue-stress.c "$backend"/queue.c qpool.c qtrace.c perfcnt.c -lpthread || exit 1
+done
+
+for threads in $THREADS; do
+	for variant in $VARIANTS; do
+		backend=${variant%%:*}
+		lock=${variant##*:}
+		echo "== $backend $lock, $threads threads"
+		# qmonitor prints stats too, the final ones come after the verdict
+		QUEUE_PROFILE=1 timeout "$RUN_TIMEOUT" "$BUILD_DIR/queue-stress-$backend" \
+			-p $((threads / 2)) -c $((threads / 2)) -l "$lock" "${args[@]}" \
+			| sed -n '/^stress: backend/,$p' \
+			| grep -e '^stress: backend' -e '^combining stats' -e '^lock stats' -e 'ERROR'
+		status=("${PIPESTATUS[@]}")
+		if [ "${status[0]}" -ne 0 ] || [ "${status[2]}" -ne 0 ]; then
+			[ "${status[0]}" -eq 124 ] && echo "timed out after $RUN_TIMEOUT s"
+			failed="$failed $variant-$threads"
+		fi
+	done
+done
+
+echo "== e fc, thread churn"
+if ! gcc -O2 -Wall -Ie -o "$BUILD_DIR/queue-fc-churn" queue-fc-churn.c e/queue.c qpool.c qtrace.c -lpthread \
+	|| ! timeout "$RUN_TIMEOUT" "$BUILD_DIR/queue-fc-churn"; then
+	failed="$failed fc-churn"
+fi
+
+if [ -n "$failed" ]; then
+	echo "queue-combining: FAILED:$failed"
+	exit 1
+fi
@@ -0,0 +1,71 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "queue.h"
+
+// Flat combining under thread churn: waves of short-lived threads, many
+// more over the run than there are combining slots, each wave at most as
+// many threads as slots. Every call of every wave has to go through a slot,
+// which only holds while the slots of exited threads are handed out again.
+//   gcc -O2 -Ie -o queue-fc-churn queue-fc-churn.c e/queue.c qpool.c qtrace.c -lpthread
+
+#define RED "\033[41m"
+#define NOCOLOR "\033[0m"
+#define WAVES 20
+#define THREADS 32
+#define CALLS 1000
+
+static queue_t *q;
+
+void *worker(void *arg) {
+	(void)arg;
+	int val;
+	for (int i = 0; i < CALLS; i++)
+		queue_add(q, i);
+	for (int i = 0; i < CALLS; i++)
+		queue_get(q, &val);
+	return NULL;
+}
+
+int main(void) {
+	int err;
+	queue_opts_t opts = { .numa_node = QPOOL_NO_NODE, .no_monitor = 1, .lock = QUEUE_LOCK_COMBINING };
+	q = queue_init_opts(THREADS * CALLS, &opts);
+	if (q == NULL) {
+		printf("main: queue_init_opts() failed\n");
+		return EXIT_FAILURE;
+	}
+
+	long failed_waves = 0;
+	pthread_t tids[THREADS];
+	for (int wave = 0; wave < WAVES; wave++) {
+		long ops_before = q->fc_ops;
+		int started;
+		for (started = 0; started < THREADS; started++) {
+			err = pthread_create(&tids[started], NULL, worker, NULL);
+			if (err != SUCCESS) {
+				printf("main: pthread_create() failed: %s\n", strerror(err));
+				break;
+			}
+		}
+		for (int i = 0; i < started; i++) {
+			err = pthread_join(tids[i], NULL);
+			if (err != SUCCESS) printf("main: pthread_join() failed: %s\n", strerror(err));
+		}
+		// every thread of the wave is joined, the counters are settled
+		long combined = q->fc_ops - ops_before;
+		long expected = (long)started * CALLS * 2;
+		if (started != THREADS || combined != expected) {
+			printf(RED "ERROR: wave %d: %ld of %ld calls combined" NOCOLOR "\n", wave, combined, expected);
+			failed_waves++;
+		}
+	}
+	printf("main: %d waves of %d threads (%d threads, %d slots), %ld waves lost combining\n",
+		WAVES, THREADS, WAVES * THREADS, QUEUE_FC_SLOTS, failed_waves);
+	queue_destroy(q);
+	return failed_waves == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Compares the padded queue_t layout with the old packed one (-DQUEUE_PACKED)
+# on every backend: throughput and the counters of cache line traffic
+# (llc-misses, hitm) from queue-stress. One producer and one consumer by
+# default, options are passed through to queue-stress, e.g.
+#   ./queue-layout.sh -p 2 -c 2 -d 10
+# Needs at least two CPUs to show anything, and perf_event_open() access
+# for the counters (see perfcnt.h), otherwise they print as n/a.
+set -o pipefail
+
+cd "$(dirname "$0")" || exit 1
+BUILD_DIR=${BUILD_DIR:-/tmp/queue-layout}
+BACKENDS=${BACKENDS:-"a e f g h"}
+mkdir -p "$BUILD_DIR" || exit 1
+
+args=("$@")
+[ ${#args[@]} -eq 0 ] && args=(-p 1 -c 1 -d 5)
+
+failed=""
+for backend in $BACKENDS; do
+	srcs=$(ls "$backend"/*.c | grep -v queue-threads.c)
+	for layout in packed padded; do
+		bin="$BUILD_DIR/queue-stress-$backend-$layout"
+		flags=""
+		[ "$layout" = packed ] && flags="-DQUEUE_PACKED"
+		if ! gcc -O2 -Wall $flags -I"$backend" -DQUEUE_BACKEND="\"$backend $layout\"" -o "$bin" \
+			queue-stress.c $srcs qpool.c qtrace.c perfcnt.c -lpthread; then
+			failed="$failed $backend-$layout(build)"
+			continue
+		fi
+		if ! "$bin" "${args[@]}" | grep -e '^stress: backend' -e '^perf' -e 'ERROR'; then
+			failed="$failed $backend-$layout"
+		fi
+	done
+done
+
+if [ -n "$failed" ]; then
+	echo "queue-layout: FAILED:$failed"
+	exit 1
+fi
@@ -0,0 +1,35 @@
+#!/bin/bash
+# Runs queue-stress on backend a with every lock it has at growing producer
+# counts and prints throughput and the lock fairness stats (max wait, wait
+# variance). Options are passed through to queue-stress, e.g.
+#   PRODUCERS="8 32 64" ./queue-locks.sh -c 4 -d 5
+set -o pipefail
+
+cd "$(dirname "$0")" || exit 1
+BUILD_DIR=${BUILD_DIR:-/tmp/queue-locks}
+LOCKS=${LOCKS:-"spin ticket mcs"}
+PRODUCERS=${PRODUCERS:-"8 32 64"}
+mkdir -p "$BUILD_DIR" || exit 1
+
+args=("$@")
+[ ${#args[@]} -eq 0 ] && args=(-c 4 -d 5)
+
+bin="$BUILD_DIR/queue-stress-a"
+gcc -O2 -Wall -Ia -DQUEUE_BACKEND='"a"' -o "$bin" \
+	queue-stress.c a/queue.c qpool.c qtrace.c perfcnt.c -lpthread || exit 1
+
+failed=""
+for producers in $PRODUCERS; do
+	for lock in $LOCKS; do
+		echo "== lock $lock, $producers producers"
+		if ! QUEUE_PROFILE=1 "$bin" -p "$producers" -l "$lock" "${args[@]}" \
+			| grep -e '^stress: backend' -e '^lock stats' -e 'ERROR' | tail -n 2; then
+			failed="$failed $lock-$producers"
+		fi
+	done
+done
+
+if [ -n "$failed" ]; then
+	echo "queue-locks: FAILED:$failed"
+	exit 1
+fi
@@ -0,0 +1,294 @@
+// N producers / M consumers stress run for one queue backend.
+// Build against a backend directory, e.g.:
+//   gcc -O2 -Ia -DQUEUE_BACKEND='"a"' queue-stress.c a/queue.c qpool.c qtrace.c perfcnt.c -lpthread
+// queue-stress.sh does that for every backend.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "queue.h"
+#include "perfcnt.h"
+
+#define RED "\033[41m"
+#define GREEN "\033[42m"
+#define NOCOLOR "\033[0m"
+
+#ifndef QUEUE_BACKEND
+#define QUEUE_BACKEND "unknown"
+#endif
+
+// a value is (producer id << SEQ_BITS) | sequence number
+#define SEQ_BITS 24
+#define SEQ_MASK ((1 << SEQ_BITS) - 1)
+#define SEQ_LIMIT (1 << SEQ_BITS)
+#define MAX_PRODUCERS 127
+#define MAX_CONSUMERS 256
+#define POISON -1
+#define MAX_REPORTED 10
+
+typedef struct _Producer {
+	pthread_t tid;
+	int id;
+	long produced;
+	unsigned char *seen;	// one bit per sequence number, set by consumers
+	perfcnt_t pc;
+} producer_t;
+
+typedef struct _Consumer {
+	pthread_t tid;
+	int id;
+	long consumed;
+	int *last_seq;		// last sequence number seen from every producer
+	perfcnt_t pc;
+} consumer_t;
+
+static queue_t *q;
+static producer_t producers[MAX_PRODUCERS];
+static consumer_t consumers[MAX_CONSUMERS];
+static int nproducers = 4;
+static int nconsumers = 4;
+static int stop;
+
+static long errors;
+static long order_errors;
+static long dup_errors;
+static long corrupt_errors;
+
+static void report(long *counter, const char *fmt, ...) {
+	long n = __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+	if (n >= MAX_REPORTED)
+		return;
+
+	va_list args;
+	va_start(args, fmt);
+	printf(RED "ERROR: ");
+	vprintf(fmt, args);
+	printf(NOCOLOR "\n");
+	va_end(args);
+}
+
+static double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *producer(void *arg) {
+	producer_t *p = (producer_t *)arg;
+	int seq = 0;
+
+	perfcnt_open(&p->pc);
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED) && seq < SEQ_LIMIT) {
+		int ok = queue_add(q, (p->id << SEQ_BITS) | seq);
+		if (ok != QUEUE_SUCCESS)
+			continue;
+		seq++;
+	}
+	perfcnt_close(&p->pc);
+	p->produced = seq;
+	return NULL;
+}
+
+void *consumer(void *arg) {
+	consumer_t *c = (consumer_t *)arg;
+
+	perfcnt_open(&c->pc);
+	while (1) {
+		int val = 0;
+		int ok = queue_get(q, &val);
+		if (ok != QUEUE_SUCCESS)
+			continue;
+		if (val == POISON)
+			break;
+
+		int id = val >> SEQ_BITS;
+		int seq = val & SEQ_MASK;
+		if (val < 0 || id >= nproducers) {
+			report(&corrupt_errors, "consumer %d got corrupt value %d", c->id, val);
+			continue;
+		}
+		c->consumed++;
+
+		// items of one producer must come out in the order they went in
+		if (seq <= c->last_seq[id])
+			report(&order_errors, "consumer %d: producer %d seq %d after a later one", c->id, id, seq);
+		c->last_seq[id] = seq;
+
+		unsigned char bit = 1 << (seq & 7);
+		unsigned char old = __atomic_fetch_or(&producers[id].seen[seq >> 3], bit, __ATOMIC_RELAXED);
+		if (old & bit)
+			report(&dup_errors, "consumer %d: producer %d seq %d delivered twice", c->id, id, seq);
+	}
+	perfcnt_close(&c->pc);
+	return NULL;
+}
+
+static long count_lost(producer_t *p) {
+	long lost = 0;
+	for (long seq = 0; seq < p->produced; seq++) {
+		if (!(p->seen[seq >> 3] & (1 << (seq & 7)))) {
+			if (lost < MAX_REPORTED)
+				printf(RED "ERROR: producer %d seq %ld was never delivered" NOCOLOR "\n", p->id, seq);
+			lost++;
+		}
+	}
+	return lost;
+}
+
+static void usage(const char *name) {
+	printf("Use %s [-p producers] [-c consumers] [-d seconds] [-q queue_size]"
+#ifdef QUEUE_HAS_LOCKS
+		" [-l " QUEUE_LOCK_NAMES "]"
+#endif
+		"\n", name);
+	printf("QUEUE_PROFILE=1 prints the lock stats of the run at the end\n");
+}
+
+int main(int argc, char *argv[]) {
+	int seconds = 5;
+	int queue_size = 100000;
+	int lock = 0;
+	int opt, err;
+
+	while ((opt = getopt(argc, argv, "p:c:d:q:l:")) != -1) {
+		switch (opt) {
+		case 'p': nproducers = atoi(optarg); break;
+		case 'c': nconsumers = atoi(optarg); break;
+		case 'd': seconds = atoi(optarg); break;
+		case 'q': queue_size = atoi(optarg); break;
+#ifdef QUEUE_HAS_LOCKS
+		case 'l': lock = queue_lock_type(optarg); break;
+#endif
+		default:
+			usage(argv[0]);
+			return ERROR;
+		}
+	}
+	if (nproducers < 1 || nproducers > MAX_PRODUCERS || nconsumers < 1 || nconsumers > MAX_CONSUMERS
+		|| seconds < 1 || queue_size < 1 || lock == ERROR) {
+		usage(argv[0]);
+		return ERROR;
+	}
+
+#ifdef QUEUE_HAS_LOCKS
+	queue_opts_t opts = { .numa_node = QPOOL_NO_NODE, .lock = lock };
+	q = queue_init_opts(queue_size, &opts);
+#else
+	q = queue_init(queue_size);
+#endif
+	if (q == NULL) {
+		printf(RED "ERROR: Failed to initialize queue" NOCOLOR "\n");
+		return ERROR;
+	}
+	int profiling = getenv("QUEUE_PROFILE") != NULL;
+	queue_set_profiling(q, profiling);
+
+	for (int i = 0; i < nproducers; i++) {
+		producers[i].id = i;
+		producers[i].seen = calloc(SEQ_LIMIT / 8, 1);
+		if (producers[i].seen == NULL) {
+			printf("main: memory allocation failed\n");
+			return ERROR;
+		}
+	}
+	for (int i = 0; i < nconsumers; i++) {
+		consumers[i].id = i;
+		consumers[i].last_seq = malloc(nproducers * sizeof(int));
+		if (consumers[i].last_seq == NULL) {
+			printf("main: memory allocation failed\n");
+			return ERROR;
+		}
+		for (int j = 0; j < nproducers; j++)
+			consumers[i].last_seq[j] = -1;
+	}
+
+	double start = now_sec();
+	for (int i = 0; i < nconsumers; i++) {
+		err = pthread_create(&consumers[i].tid, NULL, consumer, &consumers[i]);
+		if (err != SUCCESS) {
+			printf("main: pthread_create() failed: %s\n", strerror(err));
+			return ERROR;
+		}
+	}
+	for (int i = 0; i < nproducers; i++) {
+		err = pthread_create(&producers[i].tid, NULL, producer, &producers[i]);
+		if (err != SUCCESS) {
+			printf("main: pthread_create() failed: %s\n", strerror(err));
+			return ERROR;
+		}
+	}
+
+	sleep(seconds);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+	long produced = 0;
+	for (int i = 0; i < nproducers; i++) {
+		err = pthread_join(producers[i].tid, NULL);
+		if (err != SUCCESS)
+			printf("main: pthread_join() failed: %s\n", strerror(err));
+		produced += producers[i].produced;
+	}
+
+	// everything produced is ahead of the pills, one pill stops one consumer
+	for (int i = 0; i < nconsumers; i++) {
+		while (queue_add(q, POISON) != QUEUE_SUCCESS)
+			sched_yield();
+	}
+
+	long consumed = 0;
+	for (int i = 0; i < nconsumers; i++) {
+		err = pthread_join(consumers[i].tid, NULL);
+		if (err != SUCCESS)
+			printf("main: pthread_join() failed: %s\n", strerror(err));
+		consumed += consumers[i].consumed;
+	}
+	double elapsed = now_sec() - start;
+
+	long lost = 0;
+	for (int i = 0; i < nproducers; i++)
+		lost += count_lost(&producers[i]);
+	errors += lost;
+	if (consumed != produced - lost + dup_errors) {
+		printf(RED "ERROR: produced %ld but consumed %ld" NOCOLOR "\n", produced, consumed);
+		errors++;
+	}
+
+	printf("stress: backend %s; producers %d consumers %d; %d s; items %ld; throughput %.0f items/s; "
+		"order %ld dup %ld lost %ld corrupt %ld\n",
+		QUEUE_BACKEND, nproducers, nconsumers, seconds, consumed, consumed / elapsed,
+		order_errors, dup_errors, lost, corrupt_errors);
+
+	perfcnt_t producers_pc, consumers_pc;
+	memset(&producers_pc, 0, sizeof(producers_pc));
+	memset(&consumers_pc, 0, sizeof(consumers_pc));
+	for (int i = 0; i < nproducers; i++)
+		perfcnt_add(&producers_pc, &producers[i].pc);
+	for (int i = 0; i < nconsumers; i++)
+		perfcnt_add(&consumers_pc, &consumers[i].pc);
+	perfcnt_print(QUEUE_BACKEND " producers", &producers_pc);
+	perfcnt_print(QUEUE_BACKEND " consumers", &consumers_pc);
+	if (profiling)
+		queue_print_stats(q);
+
+	queue_destroy(q);
+	for (int i = 0; i < nproducers; i++)
+		free(producers[i].seen);
+	for (int i = 0; i < nconsumers; i++)
+		free(consumers[i].last_seq);
+
+	if (errors != 0) {
+		printf(RED "stress: backend %s FAILED with %ld errors" NOCOLOR "\n", QUEUE_BACKEND, errors);
+		return ERROR;
+	}
+	printf(GREEN "stress: backend %s passed" NOCOLOR "\n", QUEUE_BACKEND);
+	return SUCCESS;
+}
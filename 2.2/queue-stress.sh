@@ -0,0 +1,33 @@
+#!/bin/bash
+# Builds queue-stress against every 2.2 backend and runs each one for a fixed duration.
+# Options are passed through to queue-stress, e.g. ./queue-stress.sh -p 8 -c 8 -d 10
+# Hardware counters are reported per thread role where perf_event_open() is allowed.
+# Exits with non-zero status if any backend lost, duplicated or reordered items.
+set -o pipefail
+
+cd "$(dirname "$0")" || exit 1
+BUILD_DIR=${BUILD_DIR:-/tmp/queue-stress}
+BACKENDS=${BACKENDS:-"a e f g h"}
+mkdir -p "$BUILD_DIR" || exit 1
+
+failed=""
+for backend in $BACKENDS; do
+	bin="$BUILD_DIR/queue-stress-$backend"
+	# every backend source except its own driver
+	srcs=$(ls "$backend"/*.c | grep -v queue-threads.c)
+	if ! gcc -O2 -Wall -I"$backend" -DQUEUE_BACKEND="\"$backend\"" -o "$bin" \
+		queue-stress.c $srcs qpool.c qtrace.c perfcnt.c -lpthread; then
+		failed="$failed $backend(build)"
+		continue
+	fi
+	# qmonitor output is dropped, only the verdict and errors are kept
+	if ! "$bin" "$@" | grep -v -e '^queue stats' -e '^adaptive stats' -e '^lock stats' -e '^qmonitor'; then
+		failed="$failed $backend"
+	fi
+done
+
+if [ -n "$failed" ]; then
+	echo "queue-stress: FAILED:$failed"
+	exit 1
+fi
+echo "queue-stress: all backends passed"
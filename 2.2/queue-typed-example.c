@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "queue-typed.h"
+
+typedef struct {
+	int id;
+	double value;
+} sample_t;
+
+QUEUE_DEFINE(spin_ints, int, 8, spin)
+QUEUE_DEFINE(mutex_ints, int, 8, mutex)
+QUEUE_DEFINE(cond_samples, sample_t, 16, cond)
+QUEUE_DEFINE(sem_samples, sample_t, 16, sem)
+
+int main() {
+	spin_ints_t spin_q;
+	mutex_ints_t mutex_q;
+	cond_samples_t cond_q;
+	sem_samples_t sem_q;
+
+	printf("main: [%d %d %d]\n", getpid(), getppid(), gettid());
+
+	if (spin_ints_init(&spin_q) != 0 || mutex_ints_init(&mutex_q) != 0
+		|| cond_samples_init(&cond_q) != 0 || sem_samples_init(&sem_q) != 0) {
+		printf("main: queue init failed\n");
+		return -1;
+	}
+
+	// the non-blocking variants refuse items past their capacity
+	for (int i = 0; i < 10; i++) {
+		int ok = spin_ints_add(&spin_q, i);
+		int ok2 = mutex_ints_add(&mutex_q, i * 10);
+		printf("ok %d %d: add value %d\n", ok, ok2, i);
+	}
+	spin_ints_print_stats(&spin_q);
+	mutex_ints_print_stats(&mutex_q);
+
+	for (int i = 0; i < 10; i++) {
+		int val = -1, val2 = -1;
+		int ok = spin_ints_get(&spin_q, &val);
+		int ok2 = mutex_ints_get(&mutex_q, &val2);
+		printf("ok %d %d: get values %d %d\n", ok, ok2, val, val2);
+	}
+
+	// the blocking variants are only filled up to their capacity here
+	for (int i = 0; i < 16; i++) {
+		sample_t s = { .id = i, .value = i / 2.0 };
+		cond_samples_add(&cond_q, s);
+		sem_samples_add(&sem_q, s);
+	}
+	for (int i = 0; i < 16; i++) {
+		sample_t s = { -1, 0 }, s2 = { -1, 0 };
+		cond_samples_get(&cond_q, &s);
+		sem_samples_get(&sem_q, &s2);
+		printf("get samples {%d %.1f} {%d %.1f}\n", s.id, s.value, s2.id, s2.value);
+	}
+	cond_samples_print_stats(&cond_q);
+	sem_samples_print_stats(&sem_q);
+
+	spin_ints_destroy(&spin_q);
+	mutex_ints_destroy(&mutex_q);
+	cond_samples_destroy(&cond_q);
+	sem_samples_destroy(&sem_q);
+	return 0;
+}
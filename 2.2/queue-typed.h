@@ -0,0 +1,250 @@
+#ifndef __FITOS_QUEUE_TYPED_H__
+#define __FITOS_QUEUE_TYPED_H__
+
+// Type-specialized ring queues generated at compile time.
+//
+//   QUEUE_DEFINE(ints, int, 1024, mutex)
+//
+// emits ints_t with ints_init(), ints_destroy(), ints_add(), ints_get() and
+// ints_print_stats(), all static inline. CAPACITY must be a power of two, so
+// the full/empty checks and the slot index are constant masks. SYNC picks
+// the synchronization of the matching 2.2 backend:
+//   spin  - pthread spinlock, add/get fail on a full/empty queue   (2.2/a)
+//   mutex - pthread mutex, add/get fail on a full/empty queue      (2.2/e)
+//   cond  - mutex and condition variables, add/get block           (2.2/f)
+//   sem   - counting semaphores, add/get block                     (2.2/g)
+// The blocking variants do not disable cancellation around their waits.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
+
+#define QUEUE_ERROR 0
+#define QUEUE_SUCCESS 1
+
+#define QUEUE_DEFINE(name, T, CAPACITY, SYNC) QUEUE_DEFINE_##SYNC(name, T, CAPACITY)
+
+// head and tail run freely, tail - head is the item count
+#define QUEUE_TYPED_COMMON(name, T, CAPACITY)						\
+_Static_assert((CAPACITY) > 0 && ((CAPACITY) & ((CAPACITY) - 1)) == 0,			\
+	#name ": capacity must be a power of two");					\
+											\
+static inline void name##_push(name##_t *q, T val) {					\
+	q->items[q->tail & ((CAPACITY) - 1)] = val;					\
+	q->tail++;									\
+	q->add_count++;									\
+}											\
+											\
+static inline T name##_pop(name##_t *q) {						\
+	T val = q->items[q->head & ((CAPACITY) - 1)];					\
+	q->head++;									\
+	q->get_count++;									\
+	return val;									\
+}											\
+											\
+static inline void name##_print_stats(name##_t *q) {					\
+	printf(#name " stats: current size %u; attempts: (%ld %ld %ld); counts (%ld %ld %ld)\n", \
+		q->tail - q->head,							\
+		q->add_attempts, q->get_attempts, q->add_attempts - q->get_attempts,	\
+		q->add_count, q->get_count, q->add_count - q->get_count);		\
+}
+
+#define QUEUE_TYPED_FIELDS(T, CAPACITY)		\
+	unsigned head;				\
+	unsigned tail;				\
+	long add_attempts;			\
+	long get_attempts;			\
+	long add_count;				\
+	long get_count;				\
+	T items[CAPACITY];
+
+// lock based, non-blocking variants share everything except the lock calls
+#define QUEUE_TYPED_TRYLOCKED(name, T, CAPACITY, LOCK_T, INIT, DESTROY, LOCK, UNLOCK)	\
+typedef struct name##_s {								\
+	LOCK_T lock;									\
+	QUEUE_TYPED_FIELDS(T, CAPACITY)							\
+} name##_t;										\
+											\
+QUEUE_TYPED_COMMON(name, T, CAPACITY)							\
+											\
+static inline int name##_init(name##_t *q) {						\
+	q->head = q->tail = 0;								\
+	q->add_attempts = q->get_attempts = 0;						\
+	q->add_count = q->get_count = 0;						\
+	return INIT(&q->lock);								\
+}											\
+											\
+static inline void name##_destroy(name##_t *q) {					\
+	DESTROY(&q->lock);								\
+}											\
+											\
+static inline int name##_add(name##_t *q, T val) {					\
+	if (LOCK(&q->lock) != 0)							\
+		return QUEUE_ERROR;							\
+	q->add_attempts++;								\
+	if (q->tail - q->head == (CAPACITY)) {						\
+		UNLOCK(&q->lock);							\
+		return QUEUE_ERROR;							\
+	}										\
+	name##_push(q, val);								\
+	UNLOCK(&q->lock);								\
+	return QUEUE_SUCCESS;								\
+}											\
+											\
+static inline int name##_get(name##_t *q, T *val) {					\
+	if (LOCK(&q->lock) != 0)							\
+		return QUEUE_ERROR;							\
+	q->get_attempts++;								\
+	if (q->tail == q->head) {							\
+		UNLOCK(&q->lock);							\
+		return QUEUE_ERROR;							\
+	}										\
+	*val = name##_pop(q);								\
+	UNLOCK(&q->lock);								\
+	return QUEUE_SUCCESS;								\
+}
+
+#define QUEUE_TYPED_SPIN_INIT(lock) pthread_spin_init(lock, PTHREAD_PROCESS_PRIVATE)
+#define QUEUE_TYPED_MUTEX_INIT(lock) pthread_mutex_init(lock, NULL)
+
+#define QUEUE_DEFINE_spin(name, T, CAPACITY)						\
+	QUEUE_TYPED_TRYLOCKED(name, T, CAPACITY, pthread_spinlock_t,			\
+		QUEUE_TYPED_SPIN_INIT, pthread_spin_destroy,				\
+		pthread_spin_lock, pthread_spin_unlock)
+
+#define QUEUE_DEFINE_mutex(name, T, CAPACITY)						\
+	QUEUE_TYPED_TRYLOCKED(name, T, CAPACITY, pthread_mutex_t,			\
+		QUEUE_TYPED_MUTEX_INIT, pthread_mutex_destroy,				\
+		pthread_mutex_lock, pthread_mutex_unlock)
+
+#define QUEUE_DEFINE_cond(name, T, CAPACITY)						\
+typedef struct name##_s {								\
+	pthread_mutex_t mutex;								\
+	pthread_cond_t not_full;							\
+	pthread_cond_t not_empty;							\
+	QUEUE_TYPED_FIELDS(T, CAPACITY)							\
+} name##_t;										\
+											\
+QUEUE_TYPED_COMMON(name, T, CAPACITY)							\
+											\
+static inline int name##_init(name##_t *q) {						\
+	q->head = q->tail = 0;								\
+	q->add_attempts = q->get_attempts = 0;						\
+	q->add_count = q->get_count = 0;						\
+	int err = pthread_mutex_init(&q->mutex, NULL);					\
+	if (err != 0)									\
+		return err;								\
+	err = pthread_cond_init(&q->not_full, NULL);					\
+	if (err != 0) {									\
+		pthread_mutex_destroy(&q->mutex);					\
+		return err;								\
+	}										\
+	err = pthread_cond_init(&q->not_empty, NULL);					\
+	if (err != 0) {									\
+		pthread_cond_destroy(&q->not_full);					\
+		pthread_mutex_destroy(&q->mutex);					\
+	}										\
+	return err;									\
+}											\
+											\
+static inline void name##_destroy(name##_t *q) {					\
+	pthread_cond_destroy(&q->not_empty);						\
+	pthread_cond_destroy(&q->not_full);						\
+	pthread_mutex_destroy(&q->mutex);						\
+}											\
+											\
+static inline int name##_add(name##_t *q, T val) {					\
+	if (pthread_mutex_lock(&q->mutex) != 0)						\
+		return QUEUE_ERROR;							\
+	q->add_attempts++;								\
+	while (q->tail - q->head == (CAPACITY))						\
+		pthread_cond_wait(&q->not_full, &q->mutex);				\
+	name##_push(q, val);								\
+	pthread_cond_signal(&q->not_empty);						\
+	pthread_mutex_unlock(&q->mutex);						\
+	return QUEUE_SUCCESS;								\
+}											\
+											\
+static inline int name##_get(name##_t *q, T *val) {					\
+	if (pthread_mutex_lock(&q->mutex) != 0)						\
+		return QUEUE_ERROR;							\
+	q->get_attempts++;								\
+	while (q->tail == q->head)							\
+		pthread_cond_wait(&q->not_empty, &q->mutex);				\
+	*val = name##_pop(q);								\
+	pthread_cond_signal(&q->not_full);						\
+	pthread_mutex_unlock(&q->mutex);						\
+	return QUEUE_SUCCESS;								\
+}
+
+#define QUEUE_DEFINE_sem(name, T, CAPACITY)						\
+typedef struct name##_s {								\
+	sem_t empty_slots;								\
+	sem_t filled_slots;								\
+	sem_t queue_lock;								\
+	QUEUE_TYPED_FIELDS(T, CAPACITY)							\
+} name##_t;										\
+											\
+QUEUE_TYPED_COMMON(name, T, CAPACITY)							\
+											\
+static inline int name##_init(name##_t *q) {						\
+	q->head = q->tail = 0;								\
+	q->add_attempts = q->get_attempts = 0;						\
+	q->add_count = q->get_count = 0;						\
+	if (sem_init(&q->empty_slots, 0, (CAPACITY)) != 0)				\
+		return -1;								\
+	if (sem_init(&q->filled_slots, 0, 0) != 0) {					\
+		sem_destroy(&q->empty_slots);						\
+		return -1;								\
+	}										\
+	if (sem_init(&q->queue_lock, 0, 1) != 0) {					\
+		sem_destroy(&q->filled_slots);						\
+		sem_destroy(&q->empty_slots);						\
+		return -1;								\
+	}										\
+	return 0;									\
+}											\
+											\
+static inline void name##_destroy(name##_t *q) {					\
+	sem_destroy(&q->queue_lock);							\
+	sem_destroy(&q->filled_slots);							\
+	sem_destroy(&q->empty_slots);							\
+}											\
+											\
+static inline int name##_add(name##_t *q, T val) {					\
+	if (sem_wait(&q->empty_slots) != 0)						\
+		return QUEUE_ERROR;							\
+	/* a slot is taken: a signal must not let us in without the lock */		\
+	while (sem_wait(&q->queue_lock) != 0) {						\
+		if (errno != EINTR) {							\
+			sem_post(&q->empty_slots);					\
+			return QUEUE_ERROR;						\
+		}									\
+	}										\
+	q->add_attempts++;								\
+	name##_push(q, val);								\
+	sem_post(&q->queue_lock);							\
+	sem_post(&q->filled_slots);							\
+	return QUEUE_SUCCESS;								\
+}											\
+											\
+static inline int name##_get(name##_t *q, T *val) {					\
+	if (sem_wait(&q->filled_slots) != 0)						\
+		return QUEUE_ERROR;							\
+	/* a slot is taken: a signal must not let us in without the lock */		\
+	while (sem_wait(&q->queue_lock) != 0) {						\
+		if (errno != EINTR) {							\
+			sem_post(&q->filled_slots);					\
+			return QUEUE_ERROR;						\
+		}									\
+	}										\
+	q->get_attempts++;								\
+	*val = name##_pop(q);								\
+	sem_post(&q->queue_lock);							\
+	sem_post(&q->empty_slots);							\
+	return QUEUE_SUCCESS;								\
+}
+
+#endif		// __FITOS_QUEUE_TYPED_H__
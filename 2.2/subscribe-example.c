@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "subscribe.h"
+
+#define RED "\033[41m"
+#define NOCOLOR "\033[0m"
+#define SUBSCRIBERS 200
+#define ITEMS 20000
+#define BATCH_MAX 64
+#define CHURN 10000
+
+typedef struct {
+	int expected;
+	long errors;
+} consumer_t;
+
+static queue_t *queues[SUBSCRIBERS];
+static consumer_t consumers[SUBSCRIBERS];
+
+void consume(int *items, int n, void *ctx) {
+	consumer_t *c = (consumer_t *)ctx;
+	for (int i = 0; i < n; i++) {
+		if (items[i] != c->expected) {
+			printf(RED"ERROR: get value is %d but expected - %d" NOCOLOR "\n", items[i], c->expected);
+			c->errors++;
+		}
+		c->expected = items[i] + 1;
+	}
+}
+
+// churn: every subscriber takes one item and unsubscribes from its own callback
+typedef struct {
+	qsub_t *sub;
+	int done;
+} oneshot_t;
+
+void consume_once(int *items, int n, void *ctx) {
+	(void)items;
+	(void)n;
+	oneshot_t *o = (oneshot_t *)ctx;
+	queue_unsubscribe(o->sub);
+	__atomic_store_n(&o->done, 1, __ATOMIC_RELEASE);
+}
+
+void *writer(void *arg) {
+	(void)arg;
+	for (int i = 0; i < ITEMS; i++) {
+		for (int s = 0; s < SUBSCRIBERS; s++) {
+			while (queue_add(queues[s], i) != QUEUE_SUCCESS)
+				sched_yield();
+		}
+	}
+	return NULL;
+}
+
+int main() {
+	pthread_t writer_tid;
+	qsub_t *subs[SUBSCRIBERS];
+	int err;
+
+	printf("main [%d %d %d]\n", getpid(), getppid(), gettid());
+	if (queue_dispatch_init(2) != SUCCESS)
+		return ERROR;
+
+	queue_opts_t opts = { .storage = QPOOL_PREALLOC, .numa_node = QPOOL_NO_NODE, .no_monitor = 1 };
+	for (int s = 0; s < SUBSCRIBERS; s++) {
+		queues[s] = queue_init_opts(1000, &opts);
+		if (queues[s] == NULL)
+			return ERROR;
+		subs[s] = queue_subscribe(queues[s], consume, &consumers[s], BATCH_MAX);
+		if (subs[s] == NULL)
+			return ERROR;
+	}
+
+	err = pthread_create(&writer_tid, NULL, writer, NULL);
+	if (err != SUCCESS) {
+		printf("main: pthread_create() failed: %s\n", strerror(err));
+		return ERROR;
+	}
+	err = pthread_join(writer_tid, NULL);
+	if (err != SUCCESS)
+		printf("main: pthread_join() failed: %s\n", strerror(err));
+
+	long errors = 0;
+	for (int s = 0; s < SUBSCRIBERS; s++) {
+		while (__atomic_load_n(&consumers[s].expected, __ATOMIC_RELAXED) != ITEMS)
+			usleep(1000);
+		errors += consumers[s].errors;
+	}
+	queue_subscription_print_stats(subs[0]);
+	queue_dispatch_print_stats();
+
+	for (int s = 0; s < SUBSCRIBERS; s++) {
+		queue_unsubscribe(subs[s]);
+		queue_destroy(queues[s]);
+	}
+	printf("main: %d subscribers got %d items each, %ld errors\n", SUBSCRIBERS, ITEMS, errors);
+
+	queue_t *q = queue_init_opts(1000, &opts);
+	if (q == NULL)
+		return ERROR;
+	for (int i = 0; i < CHURN; i++) {
+		oneshot_t o = { NULL, 0 };
+		// the callback needs its handle: the item goes in only once it is set
+		o.sub = queue_subscribe(q, consume_once, &o, 1);
+		if (o.sub == NULL)
+			return ERROR;
+		queue_add(q, i);
+		while (!__atomic_load_n(&o.done, __ATOMIC_ACQUIRE))
+			sched_yield();
+	}
+	queue_destroy(q);
+	queue_dispatch_shutdown();
+	printf("main: %d subscribers unsubscribed from their own callback\n", CHURN);
+	return errors == 0 ? SUCCESS : ERROR;
+}
@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "subscribe.h"
+
+#define DEFAULT_THREADS 2
+#define IDLE_SLEEP_MIN_NS 1000
+#define IDLE_SLEEP_MAX_NS 1000000
+
+typedef struct _Dispatcher {
+	pthread_mutex_t lock;		// subscribe/unsubscribe and startup
+	int started;
+	int stop;
+	int nthreads;
+	pthread_t *threads;
+	pthread_t monitor_tid;
+
+	qsub_t *subs[QSUB_MAX];
+	int nslots;			// high-water mark of used slots
+	unsigned cursor;		// next slot to visit, shared by all dispatchers
+	qsub_t *retired;		// unsubscribed, freed once no dispatcher can hold them
+
+	// a retired subscriber may still be in use by a dispatcher that loaded it
+	// earlier; each dispatcher announces the epoch it saw at the top of its
+	// loop, where it holds none, and a subscriber retired in epoch e is free
+	// to go once every dispatcher has announced e or later
+	long epoch;
+	long *seen;			// per dispatcher
+} dispatcher_t;
+
+static dispatcher_t dispatch = { .lock = PTHREAD_MUTEX_INITIALIZER };
+// the subscriber whose callback this dispatcher is running
+static __thread qsub_t *draining;
+
+static long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int drain(qsub_t *sub) {
+	int expected = 0;
+	if (!__atomic_compare_exchange_n(&sub->busy, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+
+	// pairs with the fence in queue_unsubscribe(): a store followed by a load
+	// of another variable may be reordered, so without both fences each side
+	// could miss the other's store and the callback run after unsubscribe
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int n = 0;
+	if (__atomic_load_n(&sub->active, __ATOMIC_ACQUIRE)) {
+		int pending = sub->q->count;
+		if (pending > sub->max_pending)
+			sub->max_pending = pending;
+		while (n < sub->batch_max && queue_get(sub->q, &sub->batch[n]) == QUEUE_SUCCESS)
+			n++;
+		if (n > 0) {
+			draining = sub;
+			sub->fn(sub->batch, n, sub->ctx);
+			draining = NULL;
+			sub->delivered += n;
+			sub->batches++;
+			sub->last_delivery_ns = now_ns();
+		}
+	}
+	__atomic_store_n(&sub->busy, 0, __ATOMIC_RELEASE);
+	return n;
+}
+
+void *qdispatcher(void *arg) {
+	long *seen = (long *)arg;
+	long epoch = ERROR;
+	long sleep_ns = IDLE_SLEEP_MIN_NS;
+	int empty_turns = 0;
+
+	while (!__atomic_load_n(&dispatch.stop, __ATOMIC_RELAXED)) {
+		// acquire: a subscriber retired in this epoch is out of subs[] for us now
+		long now = __atomic_load_n(&dispatch.epoch, __ATOMIC_ACQUIRE);
+		if (now != epoch) {
+			epoch = now;
+			// release: whatever we did with older pointers is done before this shows
+			__atomic_store_n(seen, epoch, __ATOMIC_RELEASE);
+		}
+		int nslots = __atomic_load_n(&dispatch.nslots, __ATOMIC_ACQUIRE);
+		if (nslots == 0) {
+			usleep(IDLE_SLEEP_MAX_NS / 1000);
+			continue;
+		}
+
+		// one shared cursor gives every subscriber a turn before anyone gets a second one
+		unsigned slot = __atomic_fetch_add(&dispatch.cursor, 1, __ATOMIC_RELAXED) % nslots;
+		qsub_t *sub = __atomic_load_n(&dispatch.subs[slot], __ATOMIC_ACQUIRE);
+		if (sub != NULL && drain(sub) > 0) {
+			empty_turns = 0;
+			sleep_ns = IDLE_SLEEP_MIN_NS;
+			continue;
+		}
+
+		// queues do not notify, so back off once a whole round found nothing
+		if (++empty_turns < nslots)
+			continue;
+		struct timespec ts = { 0, sleep_ns };
+		nanosleep(&ts, NULL);
+		if (sleep_ns < IDLE_SLEEP_MAX_NS)
+			sleep_ns *= 2;
+		empty_turns = 0;
+	}
+	return NULL;
+}
+
+void *qdispatch_monitor(void *arg) {
+	(void)arg;
+	printf("qdispatch_monitor: [%d %d %d]\n", getpid(), getppid(), gettid());
+
+	while (1) {
+		queue_dispatch_print_stats();
+		sleep(1);
+	}
+	return NULL;
+}
+
+// caller holds dispatch.lock
+static int dispatch_start(int nthreads) {
+	int err;
+	dispatch.threads = calloc(nthreads, sizeof(pthread_t));
+	dispatch.seen = calloc(nthreads, sizeof(long));
+	if (dispatch.threads == NULL || dispatch.seen == NULL) {
+		printf("queue_dispatch_init: memory allocation failed\n");
+		return ERROR;
+	}
+	dispatch.stop = 0;
+	for (int i = 0; i < nthreads; i++) {
+		dispatch.seen[i] = dispatch.epoch;
+		err = pthread_create(&dispatch.threads[i], NULL, qdispatcher, &dispatch.seen[i]);
+		if (err != SUCCESS) {
+			printf("queue_dispatch_init: pthread_create() failed: %s\n", strerror(err));
+			dispatch.nthreads = i;
+			return ERROR;
+		}
+		dispatch.nthreads = i + 1;
+	}
+	err = pthread_create(&dispatch.monitor_tid, NULL, qdispatch_monitor, NULL);
+	if (err != SUCCESS) {
+		printf("queue_dispatch_init: pthread_create() failed: %s\n", strerror(err));
+		return ERROR;
+	}
+	dispatch.started = 1;
+	return SUCCESS;
+}
+
+int queue_dispatch_init(int nthreads) {
+	if (nthreads < 1) return ERROR;
+
+	pthread_mutex_lock(&dispatch.lock);
+	int err = dispatch.started ? SUCCESS : dispatch_start(nthreads);
+	pthread_mutex_unlock(&dispatch.lock);
+	if (err != SUCCESS)
+		queue_dispatch_shutdown();
+	return err;
+}
+
+qsub_t* queue_subscribe(queue_t *q, qsub_fn_t fn, void *ctx, int batch_max) {
+	if (q == NULL || fn == NULL || batch_max < 1) return NULL;
+
+	qsub_t *sub = calloc(1, sizeof(qsub_t));
+	if (sub == NULL) {
+		printf("queue_subscribe: memory allocation failed\n");
+		return NULL;
+	}
+	sub->batch = malloc(batch_max * sizeof(int));
+	if (sub->batch == NULL) {
+		printf("queue_subscribe: memory allocation failed\n");
+		free(sub);
+		return NULL;
+	}
+	sub->q = q;
+	sub->fn = fn;
+	sub->ctx = ctx;
+	sub->batch_max = batch_max;
+	sub->active = 1;
+	sub->last_delivery_ns = now_ns();
+
+	pthread_mutex_lock(&dispatch.lock);
+	if (!dispatch.started && dispatch_start(DEFAULT_THREADS) != SUCCESS) {
+		pthread_mutex_unlock(&dispatch.lock);
+		queue_dispatch_shutdown();
+		free(sub->batch);
+		free(sub);
+		return NULL;
+	}
+	int slot;
+	for (slot = 0; slot < QSUB_MAX; slot++) {
+		if (dispatch.subs[slot] == NULL)
+			break;
+	}
+	if (slot == QSUB_MAX) {
+		pthread_mutex_unlock(&dispatch.lock);
+		printf("queue_subscribe: too many subscribers\n");
+		free(sub->batch);
+		free(sub);
+		return NULL;
+	}
+	sub->id = slot;
+	__atomic_store_n(&dispatch.subs[slot], sub, __ATOMIC_RELEASE);
+	if (slot >= dispatch.nslots)
+		__atomic_store_n(&dispatch.nslots, slot + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dispatch.lock);
+	return sub;
+}
+
+// caller holds dispatch.lock; frees the retired subscribers no dispatcher can hold
+static void dispatch_reclaim(void) {
+	long oldest = __atomic_load_n(&dispatch.epoch, __ATOMIC_RELAXED);
+	for (int i = 0; i < dispatch.nthreads; i++) {
+		long seen = __atomic_load_n(&dispatch.seen[i], __ATOMIC_ACQUIRE);
+		if (seen < oldest)
+			oldest = seen;
+	}
+	qsub_t **link = &dispatch.retired;
+	while (*link != NULL) {
+		qsub_t *sub = *link;
+		if (sub->retire_epoch > oldest) {
+			link = &sub->retired;
+			continue;
+		}
+		*link = sub->retired;
+		free(sub->batch);
+		free(sub);
+	}
+}
+
+// a dispatcher may still hold a stale pointer, so the memory goes only after
+// every dispatcher has moved past the epoch it was retired in
+void queue_unsubscribe(qsub_t *sub) {
+	if (sub == NULL) return;
+
+	pthread_mutex_lock(&dispatch.lock);
+	__atomic_store_n(&dispatch.subs[sub->id], NULL, __ATOMIC_RELEASE);
+	__atomic_store_n(&sub->active, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dispatch.lock);
+
+	// let a running callback finish; see drain() for the fence. Called from
+	// its own callback, the drain that runs us is the one we would wait for.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (draining != sub && __atomic_load_n(&sub->busy, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	// retired only now, so nobody reclaims it while we wait above
+	pthread_mutex_lock(&dispatch.lock);
+	// release: the subs[] store above is seen by whoever sees the new epoch
+	sub->retire_epoch = __atomic_add_fetch(&dispatch.epoch, 1, __ATOMIC_ACQ_REL);
+	sub->retired = dispatch.retired;
+	dispatch.retired = sub;
+	dispatch_reclaim();
+	pthread_mutex_unlock(&dispatch.lock);
+}
+
+void queue_dispatch_shutdown(void) {
+	int err;
+	pthread_mutex_lock(&dispatch.lock);
+	__atomic_store_n(&dispatch.stop, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < dispatch.nthreads; i++) {
+		err = pthread_join(dispatch.threads[i], NULL);
+		if (err != SUCCESS) printf("queue_dispatch_shutdown: pthread_join() failed: %s\n", strerror(err));
+	}
+	if (dispatch.started) {
+		err = pthread_cancel(dispatch.monitor_tid);
+		if (err != SUCCESS) printf("queue_dispatch_shutdown: pthread_cancel() failed: %s\n", strerror(err));
+		err = pthread_join(dispatch.monitor_tid, NULL);
+		if (err != SUCCESS) printf("queue_dispatch_shutdown: pthread_join() failed: %s\n", strerror(err));
+	}
+	free(dispatch.threads);
+	dispatch.threads = NULL;
+	free(dispatch.seen);
+	dispatch.seen = NULL;
+	dispatch.nthreads = 0;
+	dispatch.started = 0;
+
+	for (int i = 0; i < dispatch.nslots; i++) {
+		if (dispatch.subs[i] != NULL) {
+			dispatch.subs[i]->retired = dispatch.retired;
+			dispatch.retired = dispatch.subs[i];
+			dispatch.subs[i] = NULL;
+		}
+	}
+	dispatch.nslots = 0;
+	while (dispatch.retired != NULL) {
+		qsub_t *sub = dispatch.retired;
+		dispatch.retired = sub->retired;
+		free(sub->batch);
+		free(sub);
+	}
+	pthread_mutex_unlock(&dispatch.lock);
+}
+
+void queue_dispatch_print_stats(void) {
+	long now = now_ns();
+	int nslots = __atomic_load_n(&dispatch.nslots, __ATOMIC_ACQUIRE);
+	int subscribers = 0;
+	long delivered = 0;
+	long worst_lag = 0;
+	int worst = ERROR;
+
+	for (int i = 0; i < nslots; i++) {
+		qsub_t *sub = __atomic_load_n(&dispatch.subs[i], __ATOMIC_ACQUIRE);
+		if (sub == NULL)
+			continue;
+		subscribers++;
+		delivered += sub->delivered;
+		// lag is how long a subscriber with pending items has gone without a batch
+		long lag = sub->q->count > 0 ? now - sub->last_delivery_ns : 0;
+		if (lag > worst_lag) {
+			worst_lag = lag;
+			worst = i;
+		}
+	}
+	printf("dispatch stats: threads %d; subscribers %d; delivered %ld; worst lag %ld ms (subscriber %d)\n",
+		dispatch.nthreads, subscribers, delivered, worst_lag / 1000000, worst);
+}
+
+void queue_subscription_print_stats(qsub_t *sub) {
+	if (sub == NULL) return;
+
+	int pending = sub->q->count;
+	long lag = pending > 0 ? now_ns() - sub->last_delivery_ns : 0;
+	printf("subscriber %d stats: delivered %ld in %ld batches; pending %d (max %d); lag %ld ms\n",
+		sub->id, sub->delivered, sub->batches, pending, sub->max_pending, lag / 1000000);
+}
@@ -0,0 +1,47 @@
+#ifndef __FITOS_SUBSCRIBE_H__
+#define __FITOS_SUBSCRIBE_H__
+
+// Callback consumers for queue_t. A few dispatcher threads visit the
+// subscriptions round-robin and hand each callback at most batch_max items
+// per turn, so hundreds of subscribers share a handful of OS threads. Needs
+// a backend whose queue_get() does not block: 2.2/a or 2.2/e.
+//   gcc -Ie subscribe-example.c subscribe.c e/queue.c qpool.c qtrace.c -lpthread
+
+#define _GNU_SOURCE
+#include <pthread.h>
+
+#include "queue.h"
+
+#define QSUB_MAX 1024
+
+typedef void (*qsub_fn_t)(int *items, int n, void *ctx);
+
+typedef struct _QueueSub {
+	queue_t *q;
+	qsub_fn_t fn;
+	void *ctx;
+	int batch_max;
+	int *batch;
+
+	int id;
+	int active;		// cleared by queue_unsubscribe()
+	int busy;		// a dispatcher is draining it, keeps callbacks of one subscriber in order
+
+	long delivered;
+	long batches;
+	int max_pending;	// deepest backlog seen by a dispatcher
+	long last_delivery_ns;
+	struct _QueueSub *retired;
+	long retire_epoch;	// see dispatcher_t in subscribe.c
+} qsub_t;
+
+int queue_dispatch_init(int nthreads);
+void queue_dispatch_shutdown(void);
+void queue_dispatch_print_stats(void);
+qsub_t* queue_subscribe(queue_t *q, qsub_fn_t fn, void *ctx, int batch_max);
+// no callback runs after it returns, except that a callback may unsubscribe
+// its own subscriber: that one returns at once and the callback finishes
+void queue_unsubscribe(qsub_t *sub);
+void queue_subscription_print_stats(qsub_t *sub);
+
+#endif		// __FITOS_SUBSCRIBE_H__
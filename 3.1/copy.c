@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <stdint.h>
+
+#include "copy.h"
+
+// a method cannot copy between these two files, the next one should try
+#define COPY_FALLBACK 1
+
+copy_stats_t copy_stats;
+off_t copy_direct_threshold;
+
+static const char* method_names[] = { "clone", "copy_file_range", "splice", "read/write", "io_uring", "O_DIRECT",
+    "parallel ranges", "small", "delta", "unchanged" };
+
+// reused by every file the worker copies, only ever grows
+static __thread char* buffer;
+static __thread size_t buffer_size;
+
+// one pipe per worker, kept for the life of the process
+static __thread int splice_pipe[2] = { ERROR, ERROR };
+// set once the kernel has said ENOSYS, nobody asks again
+static int range_unsupported;
+
+// the errors that mean "not between these two files", not "the copy failed"
+static bool unsupported(int err) {
+    return err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == ENOSYS
+        || err == ENOTTY || err == EBADF || err == EPERM;
+}
+
+// every failure falls back: a failed clone has not touched the target
+int copy_clone(int src_fd, int dst_fd, off_t* copied) {
+    struct stat src_stat;
+    if (ioctl(dst_fd, FICLONE, src_fd) == ERROR || fstat(src_fd, &src_stat) == ERROR) {
+        return COPY_FALLBACK;
+    }
+    *copied = src_stat.st_size;
+    return SUCCESS;
+}
+
+// SUCCESS, ERROR or COPY_FALLBACK; *copied grows by what was moved even when
+// the method gives up
+static int copy_range(int src_fd, int dst_fd, const task_t* task, off_t* copied) {
+    if (__atomic_load_n(&range_unsupported, __ATOMIC_RELAXED)) {
+        return COPY_FALLBACK;
+    }
+    while (1) {
+        ssize_t n = copy_file_range(src_fd, NULL, dst_fd, NULL, COPY_CHUNK, 0);
+        if (n == ERROR) {
+            if (errno == ENOSYS) {
+                __atomic_store_n(&range_unsupported, 1, __ATOMIC_RELAXED);
+            }
+            if (unsupported(errno)) {
+                return COPY_FALLBACK;
+            }
+            printf("copy_data: copy_file_range() failed for %s: %s\n", task_src_path(task), strerror(errno));
+            return ERROR;
+        }
+        if (n == 0) {
+            return SUCCESS;
+        }
+        *copied += n;
+    }
+}
+
+static int splice_pipe_open(void) {
+    if (splice_pipe[0] != ERROR) {
+        return SUCCESS;
+    }
+    if (pipe2(splice_pipe, O_CLOEXEC) == ERROR) {
+        printf("copy_data: pipe2() failed: %s\n", strerror(errno));
+        return ERROR;
+    }
+    // a bigger pipe means fewer round trips, the default of 64 KiB is kept if not allowed
+    fcntl(splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    return SUCCESS;
+}
+
+static int copy_splice(int src_fd, int dst_fd, const task_t* task, off_t* copied) {
+    if (splice_pipe_open() != SUCCESS) {
+        return COPY_FALLBACK;
+    }
+    while (1) {
+        ssize_t in = splice(src_fd, NULL, splice_pipe[1], NULL, COPY_CHUNK, SPLICE_F_MOVE);
+        if (in == ERROR) {
+            if (unsupported(errno)) {
+                return COPY_FALLBACK;
+            }
+            printf("copy_data: splice() failed for %s: %s\n", task_src_path(task), strerror(errno));
+            return ERROR;
+        }
+        if (in == 0) {
+            return SUCCESS;
+        }
+        while (in > 0) {
+            ssize_t out = splice(splice_pipe[0], NULL, dst_fd, NULL, in, SPLICE_F_MOVE);
+            if (out == ERROR) {
+                // the pipe still holds data that is gone from the source offset
+                printf("copy_data: splice() failed for %s: %s\n", task_dst_path(task), strerror(errno));
+                close(splice_pipe[0]);
+                close(splice_pipe[1]);
+                splice_pipe[0] = splice_pipe[1] = ERROR;
+                return ERROR;
+            }
+            in -= out;
+            *copied += out;
+        }
+    }
+}
+
+// a buffer that holds the whole file, or as much of it as BUFFER_MAX allows
+static char* get_buffer(off_t size, size_t* got) {
+    size_t want = BUFFER_MIN;
+    while ((off_t)want < size && want < BUFFER_MAX) {
+        want *= 2;
+    }
+    if (want > buffer_size) {
+        char* bigger = NULL;
+        if (posix_memalign((void**)&bigger, BUFFER_ALIGN, want) != SUCCESS) {
+            // the one we have still does the job, in more rounds
+            if (buffer == NULL) {
+                printf("copy_data: memory allocation failed\n");
+                return NULL;
+            }
+        } else {
+            free(buffer);
+            buffer = bigger;
+            buffer_size = want;
+        }
+    }
+    *got = buffer_size;
+    return buffer;
+}
+
+void copy_thread_exit(void) {
+    free(buffer);
+    buffer = NULL;
+    buffer_size = 0;
+}
+
+static int write_all(int dst_fd, const char* data, size_t len, const task_t* task) {
+    size_t total_written = 0;
+    while (total_written < len) {
+        ssize_t bytes_written = write(dst_fd, data + total_written, len - total_written);
+        if (bytes_written == ERROR) {
+            printf("copy_data: write error to %s: %s\n", task_dst_path(task), strerror(errno));
+            return ERROR;
+        }
+        total_written += bytes_written;
+    }
+    return SUCCESS;
+}
+
+static int copy_rw(int src_fd, int dst_fd, const task_t* task, off_t size, off_t* copied) {
+    size_t len;
+    char* data = get_buffer(size, &len);
+    if (data == NULL) {
+        return ERROR;
+    }
+    while (1) {
+        ssize_t bytes_read = read(src_fd, data, len);
+        if (bytes_read == ERROR) {
+            printf("copy_data: read() error from %s: %s\n", task_src_path(task), strerror(errno));
+            return ERROR;
+        }        
+        if (bytes_read == 0) {
+            return SUCCESS;
+        }
+        if (write_all(dst_fd, data, bytes_read, task) != SUCCESS) {
+            return ERROR;
+        }
+        *copied += bytes_read;
+    }
+}
+
+int copy_part(int src_fd, int dst_fd, off_t offset, off_t length, const task_t* task) {
+    off_t in = offset, out = offset, end = offset + length;
+    while (in < end && !__atomic_load_n(&range_unsupported, __ATOMIC_RELAXED)) {
+        ssize_t n = copy_file_range(src_fd, &in, dst_fd, &out, end - in, 0);
+        if (n == ERROR) {
+            if (errno == ENOSYS) {
+                __atomic_store_n(&range_unsupported, 1, __ATOMIC_RELAXED);
+            }
+            if (unsupported(errno)) {
+                break;
+            }
+            printf("copy_part: copy_file_range() failed for %s: %s\n", task_src_path(task), strerror(errno));
+            return ERROR;
+        }
+        if (n == 0) {
+            // the source got shorter than it was when it was split
+            return SUCCESS;
+        }
+    }
+
+    size_t len;
+    char* data = get_buffer(length, &len);
+    if (data == NULL) {
+        return ERROR;
+    }
+    while (in < end) {
+        size_t want = end - in < (off_t)len ? (size_t)(end - in) : len;
+        ssize_t bytes_read = pread(src_fd, data, want, in);
+        if (bytes_read == ERROR) {
+            printf("copy_part: pread() failed for %s: %s\n", task_src_path(task), strerror(errno));
+            return ERROR;
+        }
+        if (bytes_read == 0) {
+            return SUCCESS;
+        }
+        for (ssize_t done = 0; done < bytes_read; ) {
+            ssize_t bytes_written = pwrite(dst_fd, data + done, bytes_read - done, in + done);
+            if (bytes_written == ERROR) {
+                printf("copy_part: pwrite() failed for %s: %s\n", task_dst_path(task), strerror(errno));
+                return ERROR;
+            }
+            done += bytes_written;
+        }
+        in += bytes_read;
+    }
+    return SUCCESS;
+}
+
+int copy_small(int src_fd, int dst_fd, const task_t* task, off_t size) {
+    size_t len;
+    // a byte more than expected tells the end of the file from a file that grew
+    char* data = get_buffer(size + 1, &len);
+    if (data == NULL) {
+        return ERROR;
+    }
+    ssize_t bytes_read = read(src_fd, data, len);
+    if (bytes_read == ERROR) {
+        printf("copy_small: read() error from %s: %s\n", task_src_path(task), strerror(errno));
+        return ERROR;
+    }
+    if (write_all(dst_fd, data, bytes_read, task) != SUCCESS) {
+        return ERROR;
+    }
+    off_t copied = bytes_read;
+    // a short read is not the end of the file on every file system (FUSE, NFS,
+    // a file being written), only a read() that returns 0 is
+    if ((bytes_read < size || (size_t)bytes_read == len)
+        && copy_rw(src_fd, dst_fd, task, len, &copied) != SUCCESS) {
+        return ERROR;
+    }
+    copy_count(COPY_SMALL, copied);
+    return COPY_SMALL;
+}
+
+// short only at the end of the file
+static ssize_t pread_full(int fd, char* data, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, data + done, len - done, offset + done);
+        if (n == ERROR) {
+            return ERROR;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// both sides share the worker's buffer, half each; stops at the first difference
+int copy_compare(int src_fd, int dst_fd, off_t size, const task_t* task) {
+    size_t len;
+    char* data = get_buffer(2 * size, &len);
+    if (data == NULL) {
+        return ERROR;
+    }
+    len /= 2;
+    for (off_t offset = 0; offset < size; offset += len) {
+        size_t want = size - offset < (off_t)len ? (size_t)(size - offset) : len;
+        ssize_t src_n = pread_full(src_fd, data, want, offset);
+        if (src_n == ERROR) {
+            printf("copy_compare: pread() failed for %s: %s\n", task_src_path(task), strerror(errno));
+            return ERROR;
+        }
+        ssize_t dst_n = pread_full(dst_fd, data + len, want, offset);
+        if (dst_n == ERROR) {
+            printf("copy_compare: pread() failed for %s: %s\n", task_dst_path(task), strerror(errno));
+            return ERROR;
+        }
+        if (src_n != dst_n || memcmp(data, data + len, src_n) != 0) {
+            return 0;
+        }
+        if ((size_t)src_n < want) {
+            break;
+        }
+    }
+    return 1;
+}
+
+size_t copy_delta_block(off_t size) {
+    size_t block = DELTA_BLOCK_MIN;
+    while ((off_t)block * DELTA_BLOCKS < size && block < DELTA_BLOCK_MAX) {
+        block *= 2;
+    }
+    return block;
+}
+
+static inline uint32_t rotl32(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+// xxHash32 rounds in HASH_LANES independent lanes folded at the end: no lane
+// waits for another, so the compiler turns the loop into SIMD multiplies
+// (SSE2 at plain -O2). Not a cryptographic hash, a changed block that keeps
+// all 64 bits is not worth guarding against here.
+static uint64_t block_hash(const char* data, size_t len) {
+    uint32_t acc[HASH_LANES];
+    for (int i = 0; i < HASH_LANES; i++) {
+        acc[i] = 0x165667b1u + i * 2654435761u;
+    }
+    size_t stripes = len / sizeof(acc);
+    for (size_t s = 0; s < stripes; s++) {
+        uint32_t in[HASH_LANES];
+        memcpy(in, data + s * sizeof(acc), sizeof(acc));
+        for (int i = 0; i < HASH_LANES; i++) {
+            acc[i] = rotl32(acc[i] + in[i] * 2246822519u, 13) * 2654435761u;
+        }
+    }
+    // the last block of a file rarely fills a stripe
+    uint32_t tail[HASH_LANES] = { 0 };
+    memcpy(tail, data + stripes * sizeof(acc), len % sizeof(acc));
+    uint64_t h = len;
+    for (int i = 0; i < HASH_LANES; i++) {
+        h = (h ^ acc[i] ^ ((uint64_t)tail[i] << 32)) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static int pwrite_all(int dst_fd, const char* data, size_t len, off_t offset, const task_t* task) {
+    while (len > 0) {
+        ssize_t n = pwrite(dst_fd, data, len, offset);
+        if (n == ERROR) {
+            printf("copy_delta: pwrite() failed for %s: %s\n", task_dst_path(task), strerror(errno));
+            return ERROR;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return SUCCESS;
+}
+
+// reads as many whole blocks of both sides as half the worker's buffer
+// holds, then compares them block by block
+off_t copy_delta(int src_fd, int dst_fd, off_t offset, off_t length, size_t block, const task_t* task) {
+    size_t len;
+    char* data = get_buffer(2 * length, &len);
+    if (data == NULL) {
+        return ERROR;
+    }
+    len /= 2;
+    if (len < block) {
+        block = len;
+    }
+    len -= len % block;
+    char* src_data = data;
+    char* dst_data = data + len;
+    off_t rewritten = 0;
+    off_t end = offset + length;
+    while (offset < end) {
+        size_t want = end - offset < (off_t)len ? (size_t)(end - offset) : len;
+        ssize_t src_n = pread_full(src_fd, src_data, want, offset);
+        if (src_n == ERROR) {
+            printf("copy_delta: pread() failed for %s: %s\n", task_src_path(task), strerror(errno));
+            return ERROR;
+        }
+        ssize_t dst_n = pread_full(dst_fd, dst_data, src_n, offset);
+        if (dst_n == ERROR) {
+            printf("copy_delta: pread() failed for %s: %s\n", task_dst_path(task), strerror(errno));
+            return ERROR;
+        }
+        for (size_t pos = 0; pos < (size_t)src_n; pos += block) {
+            size_t n = (size_t)src_n - pos < block ? (size_t)src_n - pos : block;
+            // a target that ends early differs wherever it has nothing
+            if (pos + n <= (size_t)dst_n && block_hash(src_data + pos, n) == block_hash(dst_data + pos, n)) {
+                continue;
+            }
+            if (pwrite_all(dst_fd, src_data + pos, n, offset + pos, task) != SUCCESS) {
+                return ERROR;
+            }
+            rewritten += n;
+        }
+        if ((size_t)src_n < want) {
+            break;
+        }
+        offset += src_n;
+    }
+    return rewritten;
+}
+
+static int set_direct(int fd, bool on) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == ERROR) {
+        return ERROR;
+    }
+    return fcntl(fd, F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT);
+}
+
+// O_DIRECT wants the buffer, the offsets and the lengths aligned: the reads
+// are whole buffers, the last write is padded to a block and the file is cut
+// back to size afterwards. Anything the file system refuses before the first
+// byte is copied falls back to the page cache path.
+static int copy_direct(int src_fd, int dst_fd, const task_t* task, off_t size, off_t* copied) {
+    size_t len;
+    char* data = get_buffer(size, &len);
+    if (data == NULL) {
+        return COPY_FALLBACK;
+    }
+    if (lseek(src_fd, 0, SEEK_CUR) != 0 || set_direct(src_fd, true) == ERROR) {
+        return COPY_FALLBACK;
+    }
+    if (set_direct(dst_fd, true) == ERROR) {
+        set_direct(src_fd, false);
+        return COPY_FALLBACK;
+    }
+
+    int err = SUCCESS;
+    while (1) {
+        ssize_t bytes_read = read(src_fd, data, len);
+        if (bytes_read == ERROR) {
+            if (errno == EINVAL && *copied == 0) {
+                err = COPY_FALLBACK;
+            } else {
+                printf("copy_data: read() error from %s: %s\n", task_src_path(task), strerror(errno));
+                err = ERROR;
+            }
+            break;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        size_t padded = (bytes_read + BUFFER_ALIGN - 1) & ~(size_t)(BUFFER_ALIGN - 1);
+        memset(data + bytes_read, 0, padded - bytes_read);
+        ssize_t bytes_written = write(dst_fd, data, padded);
+        if (bytes_written == ERROR && errno == EINVAL && *copied == 0) {
+            // the read went through: rewind so the fallback starts over
+            err = lseek(src_fd, 0, SEEK_SET) == 0 ? COPY_FALLBACK : ERROR;
+            break;
+        }
+        if (bytes_written != (ssize_t)padded) {
+            printf("copy_data: write error to %s: %s\n", task_dst_path(task),
+                bytes_written == ERROR ? strerror(errno) : "short write");
+            err = ERROR;
+            break;
+        }
+        *copied += bytes_read;
+        if ((size_t)bytes_read < len) {
+            // the padding has to go; a short read is not the end of the file
+            // on every file system (FUSE, NFS, a file being written) and the
+            // offsets are unaligned now, so the page cache loop reads on to EOF
+            if (ftruncate(dst_fd, *copied) == ERROR) {
+                printf("copy_data: ftruncate() failed for %s: %s\n", task_dst_path(task), strerror(errno));
+                err = ERROR;
+                break;
+            }
+            set_direct(src_fd, false);
+            set_direct(dst_fd, false);
+            // the padded write left the target offset past the end
+            if (lseek(dst_fd, *copied, SEEK_SET) != *copied) {
+                printf("copy_data: lseek() failed for %s: %s\n", task_dst_path(task), strerror(errno));
+                return ERROR;
+            }
+            return copy_rw(src_fd, dst_fd, task, len, copied);
+        }
+    }
+    set_direct(src_fd, false);
+    set_direct(dst_fd, false);
+    return err;
+}
+
+int copy_data(int src_fd, int dst_fd, const task_t* task, off_t size) {
+    off_t copied = 0;
+    int method, err;
+
+    // a clone takes the whole file, so it goes first; it also leaves the cache alone
+    err = copy_clone(src_fd, dst_fd, &copied);
+    method = COPY_CLONE;
+    if (err == COPY_FALLBACK && copy_direct_threshold != 0 && size >= copy_direct_threshold) {
+        err = copy_direct(src_fd, dst_fd, task, size, &copied);
+        method = COPY_DIRECT;
+    }
+    if (err == COPY_FALLBACK) {
+        err = copy_range(src_fd, dst_fd, task, &copied);
+        method = COPY_RANGE;
+    }
+    if (err == COPY_FALLBACK) {
+        err = copy_splice(src_fd, dst_fd, task, &copied);
+        method = COPY_SPLICE;
+    }
+    if (err == COPY_FALLBACK) {
+        err = copy_rw(src_fd, dst_fd, task, size, &copied);
+        method = COPY_RW;
+    }
+    if (err != SUCCESS) {
+        return ERROR;
+    }
+    copy_count(method, copied);
+    return method;
+}
+
+void copy_count(int method, off_t bytes) {
+    __atomic_fetch_add(&copy_stats.files[method], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&copy_stats.bytes[method], bytes, __ATOMIC_RELAXED);
+}
+
+const char* copy_method_name(int method) {
+    if (method < 0 || method >= COPY_METHODS) {
+        return "unknown";
+    }
+    return method_names[method];
+}
+
+void copy_print_stats(void) {
+    long files = 0, bytes = 0;
+    for (int i = 0; i < COPY_METHODS; i++) {
+        if (i != COPY_UNCHANGED) {
+            files += copy_stats.files[i];
+            bytes += copy_stats.bytes[i];
+        }
+    }
+    printf("copy stats: %ld files, %ld bytes\n", files, bytes);
+    for (int i = 0; i < COPY_METHODS; i++) {
+        if (copy_stats.files[i] != 0) {
+            printf("  %-16s %ld files, %ld bytes\n", method_names[i], copy_stats.files[i], copy_stats.bytes[i]);
+        }
+    }
+}
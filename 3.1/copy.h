@@ -0,0 +1,75 @@
+#ifndef COPY_H
+#define COPY_H
+
+// Moves the bytes of one file with the cheapest method the two file systems
+// allow: a reflink shares the extents and copies nothing, copy_file_range()
+// and splice() keep the data in the kernel, read()/write() is the fallback.
+// A method that fails before moving anything hands over to the next one,
+// one that fails half way is continued by the next from the same offset.
+//   gcc cp_r.c copy.c uring.c -lpthread
+
+#include "cp_r.h"
+
+#define SPLICE_PIPE_SIZE (1 << 20)
+// read()/write() buffers: one per worker, grown to fit the file within these bounds
+#define BUFFER_MIN (128L << 10)
+#define BUFFER_MAX (8L << 20)
+#define BUFFER_ALIGN 4096           // enough for O_DIRECT on any common device
+#define COPY_CHUNK (1L << 30)        // bytes asked of one copy_file_range() or splice()
+// -d blocks: about DELTA_BLOCKS per file, within these bounds
+#define DELTA_BLOCKS 16384
+#define DELTA_BLOCK_MIN (4L << 10)
+#define DELTA_BLOCK_MAX (1L << 20)
+#define HASH_LANES 16               // 32-bit lanes of the block hash
+
+enum {
+    COPY_CLONE,
+    COPY_RANGE,
+    COPY_SPLICE,
+    COPY_RW,
+    COPY_URING,
+    COPY_DIRECT,
+    COPY_RANGES,
+    COPY_SMALL,
+    COPY_DELTA,
+    COPY_UNCHANGED,     // skipped by -i, not part of the totals
+    COPY_METHODS,
+};
+
+// files and bytes by the method that finished them, updated atomically
+typedef struct {
+    long files[COPY_METHODS];
+    long bytes[COPY_METHODS];
+} copy_stats_t;
+
+extern copy_stats_t copy_stats;
+// files of at least this size bypass the page cache, 0 - never
+extern off_t copy_direct_threshold;
+
+// copies src_fd to dst_fd from their current offsets to the end of src_fd,
+// dst_fd is expected to be empty and size is what stat said about src_fd;
+// returns the method that finished or ERROR
+int copy_data(int src_fd, int dst_fd, const task_t* task, off_t size);
+// a reflink of the whole file, the alternative to splitting it;
+// SUCCESS when the target shares the source's extents now
+int copy_clone(int src_fd, int dst_fd, off_t* copied);
+// one read() and one write() for a file that was size bytes when listed;
+// one that has grown since, or a short read, is finished by the read()/write() loop
+int copy_small(int src_fd, int dst_fd, const task_t* task, off_t size);
+// copies length bytes at offset, the fds' own offsets are left alone
+int copy_part(int src_fd, int dst_fd, off_t offset, off_t length, const task_t* task);
+// 1 when the first size bytes of both files are the same, 0 when not,
+// ERROR when one could not be read; the fds' own offsets are left alone
+int copy_compare(int src_fd, int dst_fd, off_t size, const task_t* task);
+// the -d block size for a file of size bytes, a power of two
+size_t copy_delta_block(off_t size);
+// hashes the blocks of [offset, offset + length) on both sides and writes the
+// source blocks whose hashes differ in place; returns the bytes rewritten or ERROR
+off_t copy_delta(int src_fd, int dst_fd, off_t offset, off_t length, size_t block, const task_t* task);
+// frees the buffer of the calling worker
+void copy_thread_exit(void);
+const char* copy_method_name(int method);
+void copy_count(int method, off_t bytes);
+void copy_print_stats(void);
+
+#endif
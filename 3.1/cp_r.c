@@ -1,24 +1,30 @@
 
 #include "cp_r.h"
+#include "copy.h"
+#include "uring.h"
 
-int build_path(char* path, size_t size, const char* dir, const char* name) {
-    int len_path = snprintf(path, size, "%s/%s", dir, name);
-    if (len_path < 0 || (size_t)len_path >= size) {
-        return ERROR;
-    }
-    return SUCCESS;
-}
+static pool_t pool;
+int verbose;
+static int use_uring;
+off_t range_threshold = RANGE_THRESHOLD;
+off_t small_threshold = SMALL_FILE_SIZE;
+int incremental;
+int delta_mode;
+static int compare_contents;
+// the directories given to main, reached from the current directory
+static const char* root_src;
+static const char* root_dst;
 
-int open_with_retry(const char* path, int flags, mode_t mode) {
+int openat_with_retry(int dir_fd, const char* name, int flags, mode_t mode) {
     int fd;
     int retries = 0;
     while (retries < MAX_RETRIES) {
-        fd = open(path, flags, mode);
+        fd = openat(dir_fd, name, flags | O_CLOEXEC, mode);
         if (fd != ERROR) {
             return fd;  
         }      
         if (errno != EMFILE) {
-            printf("open_with_retry: open() failed for %s: %s\n", path, strerror(errno));
+            printf("openat_with_retry: openat() failed for %s: %s\n", name, strerror(errno));
             return ERROR;
         }     
         retries++;
@@ -27,269 +33,828 @@ int open_with_retry(const char* path, int flags, mode_t mode) {
     return ERROR;
 }
 
-DIR* opendir_with_retry(const char* path) {
-    DIR* dir;
-    int retries = 0;    
-    while (retries < MAX_RETRIES) {
-        dir = opendir(path);
-        if (dir != NULL) {
-            return dir; 
-        }         
-        if (errno != EMFILE) {
-            printf("opendir_with_retry: opendir() failed for %s: %s\n", path, strerror(errno));
-            return NULL;
-        }     
-        retries++;
-        sleep(1);
+int create_directory_safe(int dir_fd, const char* name, mode_t mode) {
+    int err = mkdirat(dir_fd, name, mode);
+    if (err != SUCCESS && errno != EEXIST) {
+        printf("create_directory_safe: mkdirat() failed for %s: %s\n", name, strerror(errno));
+        return ERROR;
     }
-    return NULL;
+    return SUCCESS;
 }
 
-int create_directory_safe(const char* src_path, const char* dst_path) {
-    int err; 
-    struct stat src_stat;
-    err = lstat(src_path, &src_stat);
+static char* join_path(const char* dir, const char* name) {
+    size_t len = strlen(dir) + 1 + strlen(name) + NULL_TERM_SIZE;
+    char* path = malloc(len);
+    if (path != NULL) {
+        snprintf(path, len, "%s/%s", dir, name);
+    }
+    return path;
+}
+
+// takes over the fds; the caller holds the first reference
+dir_ref_t* dir_new(const dir_ref_t* parent, const char* src_name, const char* dst_name, int src_fd, int dst_fd) {
+    dir_ref_t* dir = malloc(sizeof(dir_ref_t));
+    if (dir == NULL) {
+        return NULL;
+    }
+    dir->src_fd = src_fd;
+    dir->dst_fd = dst_fd;
+    dir->refs = 1;
+    dir->src_path = parent != NULL ? join_path(parent->src_path, src_name) : strdup(src_name);
+    dir->dst_path = parent != NULL ? join_path(parent->dst_path, dst_name) : strdup(dst_name);
+    if (dir->src_path == NULL || dir->dst_path == NULL) {
+        free(dir->src_path);
+        free(dir->dst_path);
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+void dir_get(dir_ref_t* dir) {
+    __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+}
+
+void dir_put(dir_ref_t* dir) {
+    if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    if (close(dir->src_fd) != SUCCESS) {
+        printf("dir_put: close() failed for %s: %s\n", dir->src_path, strerror(errno));
+    }
+    if (close(dir->dst_fd) != SUCCESS) {
+        printf("dir_put: close() failed for %s: %s\n", dir->dst_path, strerror(errno));
+    }
+    free(dir->src_path);
+    free(dir->dst_path);
+    free(dir);
+}
+
+// full paths are only built for messages, in a buffer per thread and side
+static const char* entry_path(char* buffer, const char* dir, const char* name) {
+    if (name[0] == '\0') {
+        return dir;
+    }
+    snprintf(buffer, PATH_MAX, "%s/%s", dir, name);
+    return buffer;
+}
+
+const char* task_src_path(const task_t* task) {
+    static __thread char buffer[PATH_MAX];
+    return task->dir != NULL ? entry_path(buffer, task->dir->src_path, task->name) : root_src;
+}
+
+const char* task_dst_path(const task_t* task) {
+    static __thread char buffer[PATH_MAX];
+    return task->dir != NULL ? entry_path(buffer, task->dir->dst_path, task->name) : root_dst;
+}
+
+static task_t* task_new(int type, dir_ref_t* dir, const char* name);
+
+// -i: a copied file gets the mtime of its source, so the next run sees it unchanged
+static void keep_mtime(int dst_fd, struct timespec mtime, const task_t* task) {
+    struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, mtime };
+    if (futimens(dst_fd, times) != SUCCESS) {
+        printf("keep_mtime: futimens() failed for %s: %s\n", task_dst_path(task), strerror(errno));
+    }
+}
+
+static bool same_time(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// 1 when the target already is what a copy would make: the same size and
+// mtime, or with -c the same size and bytes; a missing or odd target is a change
+static int unchanged(const task_t* task, int src_fd, const struct stat* src_stat) {
+    struct stat dst_stat;
+    if (fstatat(task->dir->dst_fd, task->name, &dst_stat, AT_SYMLINK_NOFOLLOW) != SUCCESS
+        || !S_ISREG(dst_stat.st_mode) || dst_stat.st_size != src_stat->st_size) {
+        return 0;
+    }
+    if (!compare_contents) {
+        return same_time(dst_stat.st_mtim, src_stat->st_mtim);
+    }
+    int dst_fd = openat_with_retry(task->dir->dst_fd, task->name, O_RDONLY, 0);
+    if (dst_fd == ERROR) {
+        return 0;
+    }
+    int same = copy_compare(src_fd, dst_fd, src_stat->st_size, task);
+    if (same == 1 && !same_time(dst_stat.st_mtim, src_stat->st_mtim)) {
+        keep_mtime(dst_fd, src_stat->st_mtim, task);
+    }
+    close(dst_fd);
+    return same;
+}
+
+// -d: an existing regular target is opened for an update in place and cut
+// or grown to the source size; ERROR sends the file down the plain path
+static int open_delta_target(const task_t* task, off_t size) {
+    int fd = openat(task->dir->dst_fd, task->name, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == ERROR) {
+        return ERROR;
+    }
+    struct stat dst_stat;
+    if (fstat(fd, &dst_stat) != SUCCESS || !S_ISREG(dst_stat.st_mode) || dst_stat.st_size == 0
+        || (dst_stat.st_size != size && ftruncate(fd, size) != SUCCESS)) {
+        close(fd);
+        return ERROR;
+    }
+    return fd;
+}
+
+static void report_delta(const task_t* task, off_t size, off_t rewritten) {
+    printf("%s: delta, %ld of %ld bytes rewritten (%.1f%%)\n", task_dst_path(task), (long)rewritten, (long)size,
+        size != 0 ? 100.0 * rewritten / size : 0.0);
+}
+
+// the last reference closes the file; ERROR only for what goes wrong here
+static int file_job_release(file_job_t* job, int err, const task_t* task) {
     if (err != SUCCESS) {
-        printf("create_directory_safe: lstat() failed for %s: %s\n", src_path, strerror(errno));
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+    if (__atomic_sub_fetch(&job->remaining, 1, __ATOMIC_ACQ_REL) != 0) {
+        return SUCCESS;
+    }
+    int failed = 0;
+    if (incremental && !job->failed) {
+        keep_mtime(job->dst_fd, job->mtime, task);
+    }
+    if (close(job->src_fd) != SUCCESS) {
+        printf("file_job_release: close() failed for source fd: %s\n", strerror(errno));
+    }
+    if (close(job->dst_fd) != SUCCESS) {
+        printf("file_job_release: close() failed for target fd: %s\n", strerror(errno));
+        failed = 1;
+    }
+    if (!failed && !job->failed && job->delta) {
+        copy_count(COPY_DELTA, job->size);
+        report_delta(task, job->size, job->rewritten);
+    } else if (!failed && !job->failed) {
+        copy_count(COPY_RANGES, job->size);
+        if (verbose) {
+            printf("%s: %s\n", task_dst_path(task), copy_method_name(COPY_RANGES));
+        }
+    }
+    free(job);
+    return failed ? ERROR : SUCCESS;
+}
+
+// the target gets its full size first, so ranges can land in any order and
+// the blocks are allocated in one go; then the ranges go to the pool.
+// A -d target already has its size and keeps its blocks.
+static int copy_file_split(const task_t* task, int src_fd, int dst_fd, const struct stat* src_stat, bool delta) {
+    off_t size = src_stat->st_size;
+    off_t cloned;
+    if (!delta && copy_clone(src_fd, dst_fd, &cloned) == SUCCESS) {
+        copy_count(COPY_CLONE, cloned);
+        if (incremental) {
+            keep_mtime(dst_fd, src_stat->st_mtim, task);
+        }
+        close(src_fd);
+        return close(dst_fd) == SUCCESS ? SUCCESS : ERROR;
+    }
+    if (!delta && fallocate(dst_fd, 0, 0, size) == ERROR && ftruncate(dst_fd, size) == ERROR) {
+        printf("copy_file: ftruncate() failed for %s: %s\n", task_dst_path(task), strerror(errno));
+        close(src_fd);
+        close(dst_fd);
         return ERROR;
     }
 
-    err = mkdir(dst_path, src_stat.st_mode);
-    if (err != SUCCESS && errno != EEXIST) {
-        printf("create_directory_safe: mkdir() failed for %s: %s\n", src_path, strerror(errno));
+    file_job_t* job = malloc(sizeof(file_job_t));
+    if (job == NULL) {
+        printf("copy_file: memory allocation failed\n");
+        close(src_fd);
+        close(dst_fd);
         return ERROR;
     }
-    return SUCCESS;
+    job->src_fd = src_fd;
+    job->dst_fd = dst_fd;
+    job->size = size;
+    job->remaining = 1;
+    job->failed = 0;
+    job->mtime = src_stat->st_mtim;
+    job->delta = delta;
+    job->block = copy_delta_block(size);
+    job->rewritten = 0;
+
+    int err = SUCCESS;
+    for (off_t offset = 0; offset < size; offset += RANGE_SIZE) {
+        task_t* range = task_new(TASK_RANGE, task->dir, task->name);
+        if (range == NULL) {
+            printf("copy_file: memory allocation failed\n");
+            err = ERROR;
+            break;
+        }
+        range->job = job;
+        range->offset = offset;
+        range->length = size - offset < RANGE_SIZE ? size - offset : RANGE_SIZE;
+        __atomic_add_fetch(&job->remaining, 1, __ATOMIC_RELAXED);
+        pool_submit(range);
+    }
+    int release_err = file_job_release(job, err, task);
+    return err != SUCCESS ? err : release_err;
 }
 
-void *copy_file_thread(void* arg) {
+int copy_range_task(const task_t* task) {
+    file_job_t* job = task->job;
     int err;
-    task_t* task = (task_t*)arg;
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read, bytes_written;
-    int write_error = 0;
-    struct stat src_stat;
-    err = lstat(task->src_path, &src_stat);
-    if (err != SUCCESS) {
-        printf("copy_file_thread: lstat() failed for %s: %s\n", task->src_path, strerror(errno));
-        free(task);
-        return NULL;
+    if (job->delta) {
+        off_t rewritten = copy_delta(job->src_fd, job->dst_fd, task->offset, task->length, job->block, task);
+        if (rewritten != ERROR) {
+            __atomic_add_fetch(&job->rewritten, rewritten, __ATOMIC_RELAXED);
+        }
+        err = rewritten == ERROR ? ERROR : SUCCESS;
+    } else {
+        err = copy_part(job->src_fd, job->dst_fd, task->offset, task->length, task);
     }
+    int release_err = file_job_release(task->job, err, task);
+    return err != SUCCESS ? err : release_err;
+}
 
-    int src_fd = open_with_retry(task->src_path, O_RDONLY, 0);
+int copy_file(const task_t* task) {
+    int err;
+    int write_error = 0;
+    struct stat src_stat;
+    int src_fd = openat_with_retry(task->dir->src_fd, task->name, O_RDONLY, 0);
     if (src_fd == ERROR) {
-        printf("copy_file_thread: failed to open source %s\n", task->src_path);
-        free(task);
-        return NULL;
+        printf("copy_file: failed to open source %s\n", task_src_path(task));
+        return ERROR;
     }    
-    int dst_fd = open_with_retry(task->dst_path, O_WRONLY | O_CREAT | O_TRUNC, src_stat.st_mode);
+    // d_type told the traversal what it is, the fd gives the rest without a lookup
+    if (task->have_stat) {
+        src_stat.st_size = task->size;
+        src_stat.st_mode = task->mode;
+        src_stat.st_mtim = task->mtime;
+    } else if (fstat(src_fd, &src_stat) != SUCCESS) {
+        printf("copy_file: fstat() failed for %s: %s\n", task_src_path(task), strerror(errno));
+        close(src_fd);
+        return ERROR;
+    }
+    if (incremental) {
+        int same = unchanged(task, src_fd, &src_stat);
+        if (same != 0) {
+            if (same == 1) {
+                copy_count(COPY_UNCHANGED, src_stat.st_size);
+                if (verbose) {
+                    printf("%s: %s\n", task_dst_path(task), copy_method_name(COPY_UNCHANGED));
+                }
+            }
+            close(src_fd);
+            return same == 1 ? SUCCESS : ERROR;
+        }
+    }
+    bool delta = delta_mode && src_stat.st_size >= DELTA_MIN_SIZE;
+    int dst_fd = delta ? open_delta_target(task, src_stat.st_size) : ERROR;
+    if (dst_fd == ERROR) {
+        delta = false;
+        dst_fd = openat_with_retry(task->dir->dst_fd, task->name, O_WRONLY | O_CREAT | O_TRUNC, src_stat.st_mode);
+    }
     if (dst_fd == ERROR) {
-        printf("copy_file_thread: failed to create target %s\n", task->dst_path);
+        printf("copy_file: failed to create target %s\n", task_dst_path(task));
         err = close(src_fd);
         if (err != SUCCESS) {
-            printf("copy_file_thread: close() failed for source fd: %s\n", strerror(errno));
+            printf("copy_file: close() failed for source fd: %s\n", strerror(errno));
         }
-        free(task);
-        return NULL;
+        return ERROR;
+    }
+    if (range_threshold != 0 && src_stat.st_size >= range_threshold && pool.nworkers > 1) {
+        return copy_file_split(task, src_fd, dst_fd, &src_stat, delta);
     }
     
-    while (1) {
-        bytes_read = read(src_fd, buffer, BUFFER_SIZE);
-        if (bytes_read == ERROR) {
-            printf("copy_file_thread: read() error from %s: %s\n", task->src_path, strerror(errno));
-            break;
-        }        
-        if (bytes_read == 0) {
-            break;  
+    int method;
+    if (delta) {
+        off_t rewritten = copy_delta(src_fd, dst_fd, 0, src_stat.st_size, copy_delta_block(src_stat.st_size), task);
+        method = rewritten == ERROR ? ERROR : COPY_DELTA;
+        if (method == COPY_DELTA) {
+            copy_count(COPY_DELTA, src_stat.st_size);
+            report_delta(task, src_stat.st_size, rewritten);
         }
-        
-        ssize_t total_written = 0;
-        char* ptr = buffer;
-        while (total_written < bytes_read) {
-            bytes_written = write(dst_fd, ptr + total_written, bytes_read - total_written);
-            if (bytes_written == ERROR) {
-                printf("copy_file_thread: write error to %s: %s\n", task->dst_path, strerror(errno));
-                write_error = 1;
-                break;
-            }
-            total_written += bytes_written;
+    } else if (small_threshold != 0 && src_stat.st_size <= small_threshold) {
+        method = copy_small(src_fd, dst_fd, task, src_stat.st_size);
+    } else {
+        method = copy_data(src_fd, dst_fd, task, src_stat.st_size);
+    }
+    if (method == ERROR) {
+        write_error = 1;
+    } else {
+        if (incremental) {
+            keep_mtime(dst_fd, src_stat.st_mtim, task);
+        }
+        if (verbose && method != COPY_DELTA) {
+            printf("%s: %s\n", task_dst_path(task), copy_method_name(method));
         }
-        if (write_error) {
-            break;  
-        }        
     }
     err = close(src_fd);
     if (err != SUCCESS) {
-        printf("copy_file_thread: close() failed for source fd: %s\n", strerror(errno));
+        printf("copy_file: close() failed for source fd: %s\n", strerror(errno));
     }    
     err = close(dst_fd);
     if (err != SUCCESS) {
-        printf("copy_file_thread: close() failed for target fd: %s\n", strerror(errno));
+        printf("copy_file: close() failed for target fd: %s\n", strerror(errno));
+        write_error = 1;
     }    
+    return write_error ? ERROR : SUCCESS;
+}
+
+// zeroed, with room for a name of name_size bytes; the task keeps dir open
+// until task_free()
+static task_t* task_alloc(int type, dir_ref_t* dir, const char* name, size_t name_size) {
+    task_t* task = calloc(1, sizeof(task_t) + name_size);
+    if (task == NULL) {
+        return NULL;
+    }
+    task->type = type;
+    task->dir = dir;
+    strcpy(task->name, name);
+    if (dir != NULL) {
+        dir_get(dir);
+    }
+    return task;
+}
+
+static task_t* task_new(int type, dir_ref_t* dir, const char* name) {
+    return task_alloc(type, dir, name, strlen(name) + NULL_TERM_SIZE);
+}
+
+void task_free(task_t* task) {
+    if (task->dir != NULL) {
+        dir_put(task->dir);
+    }
+    free(task->batch);
     free(task);
-    return NULL;
 }
 
-int create_file_task(const char* src_path, const char* dst_path) {
-    int err;
-    pthread_t thread;
-    task_t* task = malloc(sizeof(task_t));
+static task_t* create_task(int type, dir_ref_t* dir, const char* name, const struct stat* stat_buf) {
+    task_t* task = task_new(type, dir, name);
+    if (task != NULL && stat_buf != NULL) {
+        task->have_stat = true;
+        task->size = stat_buf->st_size;
+        task->mode = stat_buf->st_mode;
+        task->mtime = stat_buf->st_mtim;
+    }
+    return task;
+}
+
+int create_file_task(dir_ref_t* dir, const char* name, const struct stat* stat_buf) {
+    task_t* task = create_task(TASK_FILE, dir, name, stat_buf);
     if (task == NULL) {
         printf("create_file_task: memory allocation failed\n");
         return ERROR;
     }
-    strcpy(task->src_path, src_path);
-    strcpy(task->dst_path, dst_path);    
-    
-    err = pthread_create(&thread, NULL, copy_file_thread, task);
-	if (err != SUCCESS) {
-		printf("create_file_task: pthread_create() failed: %s\n", strerror(err));
-        free(task);
-		return ERROR;
-	}
-    err = pthread_detach(thread);
-    if (err != SUCCESS) {
-        printf("create_file_task: pthread_detach() failed: %s\n", strerror(err));
-    }    
+    return pool_submit(task);
+}
+
+static int batch_submit(task_t** batch) {
+    int err = pool_submit(*batch);
+    *batch = NULL;
+    return err;
+}
+
+// the batch of a directory is started on its first small file and handed to
+// the pool whenever it fills up
+static int batch_add(task_t** batch, dir_ref_t* dir, const char* name, const struct stat* stat_buf) {
+    if (*batch == NULL) {
+        task_t* task = task_new(TASK_BATCH, dir, "");
+        if (task == NULL) {
+            printf("batch_add: memory allocation failed\n");
+            return ERROR;
+        }
+        task->batch = malloc(sizeof(batch_t));
+        if (task->batch == NULL) {
+            printf("batch_add: memory allocation failed\n");
+            task_free(task);
+            return ERROR;
+        }
+        task->batch->count = 0;
+        task->batch->bytes = 0;
+        *batch = task;
+    }
+    batch_t* b = (*batch)->batch;
+    b->files[b->count].size = stat_buf->st_size;
+    b->files[b->count].mode = stat_buf->st_mode;
+    b->files[b->count].mtime = stat_buf->st_mtim;
+    strcpy(b->files[b->count].name, name);
+    b->count++;
+    b->bytes += stat_buf->st_size;
+    if (b->count == BATCH_FILES || b->bytes >= BATCH_BYTES) {
+        return batch_submit(batch);
+    }
     return SUCCESS;
 }
 
-int create_directory_task(const char* src_path, const char* dst_path) {
-    int err;
-    pthread_t thread;
-    task_t* task = malloc(sizeof(task_t));
+int copy_batch(const task_t* task) {
+    const batch_t* b = task->batch;
+    int failed = 0;
+    // one file task for the whole batch, renamed for every file
+    task_t* file = task_alloc(TASK_FILE, task->dir, "", NAME_MAX + NULL_TERM_SIZE);
+    if (file == NULL) {
+        printf("copy_batch: memory allocation failed\n");
+        return ERROR;
+    }
+    file->have_stat = true;
+    for (int i = 0; i < b->count; i++) {
+        strcpy(file->name, b->files[i].name);
+        file->size = b->files[i].size;
+        file->mode = b->files[i].mode;
+        file->mtime = b->files[i].mtime;
+        if (copy_file(file) != SUCCESS) {
+            failed = 1;
+        }
+    }
+    task_free(file);
+    return failed ? ERROR : SUCCESS;
+}
+
+int create_directory_task(dir_ref_t* dir, const char* name, const struct stat* stat_buf) {
+    task_t* task = create_task(TASK_DIRECTORY, dir, name, stat_buf);
     if (task == NULL) {
         printf("create_directory_task: memory allocation failed\n");
         return ERROR;
     }  
-    strcpy(task->src_path, src_path);
-    strcpy(task->dst_path, dst_path);        
-    
-    err = pthread_create(&thread, NULL, work_directory_thread, task);
-	if (err != SUCCESS) {
-		printf("create_directory_task: pthread_create() failed: %s\n", strerror(err));
-        free(task);
-		return ERROR;
-	}
-    err = pthread_detach(thread);
-    if (err != SUCCESS) {
-        printf("create_directory_task: pthread_detach() failed: %s\n", strerror(err));
+    return pool_submit(task);
+}
+
+// type is d_type: entries are only stat'ed when the filesystem does not say
+// what they are, or when a regular file may go to a batch by its size
+int process_single_entry(dir_ref_t* dir, const char* entry_name, unsigned char type, task_t** batch) {
+    struct stat stat_buf;
+    const struct stat* known = NULL;
+    bool batching = small_threshold != 0 && !use_uring;
+    if (type == DT_UNKNOWN || (type == DT_REG && batching)) {
+        if (fstatat(dir->src_fd, entry_name, &stat_buf, AT_SYMLINK_NOFOLLOW) != SUCCESS) {
+            printf("process_single_entry: fstatat() failed for %s/%s: %s\n", dir->src_path, entry_name, strerror(errno));
+            return ERROR;
+        }
+        type = IFTODT(stat_buf.st_mode);
+        known = &stat_buf;
+    }
+    if (type == DT_DIR) {
+        return create_directory_task(dir, entry_name, known);
+    }
+    if (type == DT_REG) {
+        // an io_uring worker already keeps many small files in flight
+        if (batching && stat_buf.st_size <= small_threshold) {
+            return batch_add(batch, dir, entry_name, &stat_buf);
+        }
+        return create_file_task(dir, entry_name, known);
     }    
     return SUCCESS;
 }
 
-int process_single_entry(const char* src_dir, const char* dst_dir, const char* entry_name) {
+// creates the target directory and opens both sides, the root from the
+// current directory and everything else from its parent
+static dir_ref_t* open_directory(const task_t* task) {
+    int parent_src = task->dir != NULL ? task->dir->src_fd : AT_FDCWD;
+    int parent_dst = task->dir != NULL ? task->dir->dst_fd : AT_FDCWD;
+    const char* src_name = task->dir != NULL ? task->name : root_src;
+    const char* dst_name = task->dir != NULL ? task->name : root_dst;
+    int src_fd = openat_with_retry(parent_src, src_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW, 0);
+    if (src_fd == ERROR) {
+        printf("open_directory: failed to open directory %s\n", task_src_path(task));
+        return NULL;
+    }
+    struct stat src_stat;
+    if (task->have_stat) {
+        src_stat.st_mode = task->mode;
+    } else if (fstat(src_fd, &src_stat) != SUCCESS) {
+        printf("open_directory: fstat() failed for %s: %s\n", task_src_path(task), strerror(errno));
+        close(src_fd);
+        return NULL;
+    }
+
+    if (create_directory_safe(parent_dst, dst_name, src_stat.st_mode) != SUCCESS) {
+        printf("open_directory: failed to create directory %s\n", task_dst_path(task));
+        close(src_fd);
+        return NULL;
+    }
+    int dst_fd = openat_with_retry(parent_dst, dst_name, O_PATH | O_DIRECTORY, 0);
+    if (dst_fd == ERROR) {
+        printf("open_directory: failed to open directory %s\n", task_dst_path(task));
+        close(src_fd);
+        return NULL;
+    }
+    dir_ref_t* dir = dir_new(task->dir, src_name, dst_name, src_fd, dst_fd);
+    if (dir == NULL) {
+        printf("open_directory: memory allocation failed\n");
+        close(src_fd);
+        close(dst_fd);
+    }
+    return dir;
+}
+
+// the record getdents64() fills the buffer with
+typedef struct {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} dirent64_t;
+
+// lists the directory through its fd in dir_ref, a buffer of entries per
+// syscall instead of readdir()'s stream
+int work_directory(const task_t* task) {
+    dir_ref_t* dir = open_directory(task);
+    if (dir == NULL) {
+        return ERROR;
+    }
+    char* buffer = malloc(DIRENT_BUFFER_SIZE);
+    if (buffer == NULL) {
+        printf("work_directory: memory allocation failed\n");
+        dir_put(dir);
+        return ERROR;
+    }
+
+    task_t* batch = NULL;
+    int failed = 0;
+    while (1) {
+        long len = syscall(SYS_getdents64, dir->src_fd, buffer, DIRENT_BUFFER_SIZE);
+        if (len == ERROR) {
+            printf("work_directory: getdents64() failed for %s: %s\n", dir->src_path, strerror(errno));
+            failed = 1;
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+        for (long pos = 0; pos < len; ) {
+            dirent64_t* entry = (dirent64_t*)(buffer + pos);
+            pos += entry->d_reclen;
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            if (process_single_entry(dir, entry->d_name, entry->d_type, &batch) != SUCCESS) {
+                printf("work_directory: failed to add task for %s\n", entry->d_name);
+                failed = 1;
+            }
+        }
+    } 
+    if (batch != NULL && batch_submit(&batch) != SUCCESS) {
+        failed = 1;
+    }
+    free(buffer);
+    // the tasks of the entries keep it open as long as they need it
+    dir_put(dir);
+    return failed ? ERROR : SUCCESS;
+}
+
+int run_task(task_t* task) {
     int err;
-    char src_path[PATH_MAX];
-    char dst_path[PATH_MAX];
-    struct stat stat_buf;
-    err = build_path(src_path, sizeof(src_path), src_dir, entry_name);
+    if (task->type == TASK_DIRECTORY) {
+        err = work_directory(task);
+    } else if (task->type == TASK_RANGE) {
+        err = copy_range_task(task);
+    } else if (task->type == TASK_BATCH) {
+        err = copy_batch(task);
+    } else {
+        err = copy_file(task);
+    }
+    task_free(task);
+    return err;
+}
+
+// the pool starts with one pending reference held by main, dropped in pool_wait()
+int pool_init(int nworkers) {
+    int err;
+    pool.head = NULL;
+    pool.queued = 0;
+    pool.pending = 1;
+    pool.failed = 0;
+    err = pthread_mutex_init(&pool.lock, NULL);
     if (err != SUCCESS) {
-        printf("process_single_entry: source path too long: %s/%s\n", src_dir, entry_name);
+        printf("pool_init: pthread_mutex_init() failed: %s\n", strerror(err));
         return ERROR;
-    }    
-    err = build_path(dst_path, sizeof(dst_path), dst_dir, entry_name);
+    }
+    err = pthread_cond_init(&pool.cond, NULL);
     if (err != SUCCESS) {
-        printf("process_single_entry: destination path too long: %s/%s\n", dst_dir, entry_name);
+        printf("pool_init: pthread_cond_init() failed: %s\n", strerror(err));
+        return ERROR;
+    }
+    pool.workers = malloc(nworkers * sizeof(pthread_t));
+    if (pool.workers == NULL) {
+        printf("pool_init: memory allocation failed\n");
         return ERROR;
     }
+    for (pool.nworkers = 0; pool.nworkers < nworkers; pool.nworkers++) {
+        err = pthread_create(&pool.workers[pool.nworkers], NULL, worker_thread, NULL);
+        if (err != SUCCESS) {
+            printf("pool_init: pthread_create() failed: %s\n", strerror(err));
+            break;
+        }
+    }
+    return pool.nworkers > 0 ? SUCCESS : ERROR;
+}
 
-    err = lstat(src_path, &stat_buf);
+void pool_done(int err) {
+    pthread_mutex_lock(&pool.lock);
     if (err != SUCCESS) {
-        printf("process_single_entry: lstat() failed for %s: %s\n", src_path, strerror(errno));
-        return ERROR;
+        pool.failed++;
     }
-    if (S_ISDIR(stat_buf.st_mode)) {
-        return create_directory_task(src_path, dst_path);
+    pool.pending--;
+    if (pool.pending == 0) {
+        pthread_cond_broadcast(&pool.cond);
     }
-    if (S_ISREG(stat_buf.st_mode)) {
-        return create_file_task(src_path, dst_path);
-    }    
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// a task is always taken over: queued, or run right here when too many are
+// waiting, so that a huge directory does not pile up tasks without bound
+int pool_submit(task_t* task) {
+    pthread_mutex_lock(&pool.lock);
+    if (task->type != TASK_DIRECTORY && pool.queued >= MAX_QUEUED_TASKS) {
+        pthread_mutex_unlock(&pool.lock);
+        if (run_task(task) != SUCCESS) {
+            pthread_mutex_lock(&pool.lock);
+            pool.failed++;
+            pthread_mutex_unlock(&pool.lock);
+        }
+        return SUCCESS;
+    }
+    // a stack: the walk goes depth first and the queue stays short
+    task->next = pool.head;
+    pool.head = task;
+    pool.queued++;
+    pool.pending++;
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
     return SUCCESS;
 }
 
-void *work_directory_thread(void* arg) {
-    int err;
-    task_t* task = (task_t*)arg;
-    err = create_directory_safe(task->src_path, task->dst_path);
-    if (err != SUCCESS) {
-        printf("work_directory_thread: failed to create directory %s\n", task->dst_path);
-        free(task);
-        return NULL;
-    }    
+// with wait, NULL means the copy is complete; without, that nothing is queued now
+task_t* pool_take(bool wait) {
+    pthread_mutex_lock(&pool.lock);
+    while (wait && pool.head == NULL && pool.pending > 0) {
+        pthread_cond_wait(&pool.cond, &pool.lock);
+    }
+    task_t* task = pool.head;
+    if (task != NULL) {
+        pool.head = task->next;
+        pool.queued--;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return task;
+}
 
-    DIR* dir = opendir_with_retry(task->src_path);
-    if (dir == NULL) {
-        printf("work_directory_thread: failed to open directory %s\n", task->src_path);
-        free(task);
-        return NULL;
+void *worker_thread(void* arg) {
+    (void)arg;
+    // a worker without a ring copies synchronously; after a finished ring run
+    // pool_take() returns NULL right away
+    if (use_uring) {
+        uring_worker();
     }
+    task_t* task;
+    while ((task = pool_take(true)) != NULL) {
+        pool_done(run_task(task));
+    }
+    copy_thread_exit();
+    return NULL;
+}
 
-    struct dirent* entry;
-    while (1) {
-        errno = SUCCESS;
-        entry = readdir(dir); 
-        if (entry == NULL && errno != SUCCESS) {
-            printf("work_directory_thread: readdir error: %s\n", strerror(errno));
-            err = ERROR;
-            break;
-        }   
-        if (entry == NULL) {
-            err = SUCCESS;
-            break; 
-        }                
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-        err = process_single_entry(task->src_path, task->dst_path, entry->d_name);
+// returns once every task, including the ones tasks made, has run
+int pool_wait(void) {
+    int err;
+    pool_done(SUCCESS);
+    for (int i = 0; i < pool.nworkers; i++) {
+        err = pthread_join(pool.workers[i], NULL);
         if (err != SUCCESS) {
-            printf("work_directory_thread: failed to add task for %s\n", entry->d_name);
+            printf("pool_wait: pthread_join() failed: %s\n", strerror(err));
         }
-    } 
-    err = closedir(dir);
-    if (err != SUCCESS) {
-        printf("work_directory_thread: closedir() failed: %s\n", strerror(errno));
-    }    
-    free(task);
-    return NULL;
+    }
+    free(pool.workers);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    return pool.failed == 0 ? SUCCESS : ERROR;
+}
+
+
+
+// every directory with work left keeps two fds open
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == SUCCESS && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != SUCCESS) {
+            printf("raise_fd_limit: setrlimit() failed: %s\n", strerror(errno));
+        }
+    }
+}
+
+// 10, 64K, 2G; ERROR for anything else
+static off_t parse_size(const char* str) {
+    char* end;
+    errno = SUCCESS;
+    long long size = strtoll(str, &end, 10);
+    if (errno != SUCCESS || end == str || size < 0) {
+        return ERROR;
+    }
+    switch (*end) {
+    case 'G': size <<= 10; // fall through
+    case 'M': size <<= 10; // fall through
+    case 'K': size <<= 10; end++; break;
+    }
+    return *end == '\0' ? size : ERROR;
+}
+
+static void usage(const char* name) {
+    printf("Use %s [-v] [-u] [-i | -c] [-d] [-D size] [-R size] [-S size] [-j jobs] source_directory target_directory\n", name);
+    printf("  -v  print how every file was copied\n");
+    printf("  -u  copy files through io_uring, %d at a time per worker\n", URING_FILES);
+    printf("  -i  incremental: skip files whose target has the same size and mtime\n");
+    printf("  -c  like -i, but compare the contents of same-size files instead of the mtime\n");
+    printf("  -d  rewrite only the blocks that differ in existing targets of at least %ldM\n",
+        DELTA_MIN_SIZE >> 20);
+    printf("  -D size  copy files of at least size bytes (K, M, G suffixes) with O_DIRECT\n");
+    printf("  -S size  copy files up to size bytes in one read and write, in batches, 0 - never (default %ldK)\n",
+        SMALL_FILE_SIZE >> 10);
+    printf("  -R size  split files of at least size bytes between workers, 0 - never (default %ldM)\n",
+        RANGE_THRESHOLD >> 20);
 }
 
 int main(int argc, char* argv[]) {   
     int err;
     struct stat stat_buf; 
-    pthread_t main_thread;
-    if (argc != 3) {
-        printf("Use %s source_directory target_directory\n", argv[0]);
+    int opt;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "j:uicdvD:R:S:")) != -1) {
+        switch (opt) {
+        case 'j':
+            jobs = atol(optarg);
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'c':
+            compare_contents = 1;
+            // fall through
+        case 'i':
+            incremental = 1;
+            break;
+        case 'd':
+            delta_mode = 1;
+            break;
+        case 'D':
+            copy_direct_threshold = parse_size(optarg);
+            if (copy_direct_threshold <= 0) {
+                usage(argv[0]);
+                return ERROR;
+            }
+            break;
+        case 'S':
+            small_threshold = parse_size(optarg);
+            if (small_threshold == ERROR) {
+                usage(argv[0]);
+                return ERROR;
+            }
+            break;
+        case 'R':
+            range_threshold = parse_size(optarg);
+            if (range_threshold == ERROR) {
+                usage(argv[0]);
+                return ERROR;
+            }
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return ERROR;
+        }
+    }
+    if (argc - optind != 2 || jobs < 1 || jobs > MAX_JOBS) {
+        usage(argv[0]);
         return ERROR;
-    }        
-    err = lstat(argv[1], &stat_buf);
+    }
+    const char* src = argv[optind];
+    const char* dst = argv[optind + 1];
+
+    err = lstat(src, &stat_buf);
     if (err != SUCCESS) {
         printf("main: lstat() failed: %s\n", strerror(errno));
         return ERROR;
     }
     if (S_ISDIR(stat_buf.st_mode) != true) {
-        printf("main: Source path %s is not a directory\n", argv[1]);
+        printf("main: Source path %s is not a directory\n", src);
         return ERROR;
     }
+    raise_fd_limit();
+    root_src = src;
+    root_dst = dst;
 
-    task_t* task = malloc(sizeof(task_t));
-    if (task == NULL) {
-        printf("main: memory allocation failed\n");
+    err = pool_init(jobs);
+    if (err != SUCCESS) {
+        printf("main: failed to start workers\n");
         return ERROR;
     }
-    strcpy(task->src_path, argv[1]);
-    strcpy(task->dst_path, argv[2]);
-    
-    err = pthread_create(&main_thread, NULL, work_directory_thread, task);
-	if (err != SUCCESS) {
-		printf("main: pthread_create() failed: %s\n", strerror(err));
-        free(task);
-		return ERROR;
-	}
-    err = pthread_detach(main_thread);
-	if (err != SUCCESS) {
-		printf("main: pthread_detach() failed: %s\n", strerror(err));
-		return ERROR;
-	}
-    pthread_exit(NULL);
+    err = create_directory_task(NULL, "", NULL);
+    if (err != SUCCESS) {
+        printf("main: failed to add task for %s\n", src);
+    }
+    int failed = pool_wait() != SUCCESS || err != SUCCESS;
+    copy_print_stats();
+    if (failed) {
+        printf("main: some entries were not copied\n");
+        return ERROR;
+    }
+    return SUCCESS;
 }
@@ -1,6 +1,7 @@
 #ifndef CP_R_H
 #define CP_R_H
 
+#define _GNU_SOURCE
 #include <sys/stat.h>
 #include <pthread.h>
 #include <linux/limits.h>
@@ -14,26 +15,126 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #define SUCCESS 0
 #define ERROR -1
-#define BUFFER_SIZE 8192
 #define MAX_RETRIES 10
 #define NULL_TERM_SIZE 1
+#define MAX_JOBS 1024
+// past this many waiting tasks a directory copies its files itself
+#define MAX_QUEUED_TASKS 65536
+// files from this size on are copied by several workers at once
+#define RANGE_THRESHOLD (1L << 30)
+#define RANGE_SIZE (64L << 20)
+// files up to this size take one read() and one write(), and go to workers
+// in batches of up to BATCH_FILES from the same directory
+#define SMALL_FILE_SIZE (64L << 10)
+#define BATCH_FILES 64
+#define BATCH_BYTES (1L << 20)
+// -d updates existing targets of at least this size block by block
+#define DELTA_MIN_SIZE (1L << 20)
+// directories are listed with getdents64() this much at a time
+#define DIRENT_BUFFER_SIZE (128 << 10)
 
+enum {
+    TASK_FILE,
+    TASK_DIRECTORY,
+    TASK_RANGE,         // a part of a file, see file_job_t
+    TASK_BATCH,         // small files of one directory, see batch_t
+};
+
+typedef struct {
+    int count;
+    long bytes;
+    struct {
+        off_t size;
+        mode_t mode;
+        struct timespec mtime;
+        char name[NAME_MAX + NULL_TERM_SIZE];
+    } files[BATCH_FILES];
+} batch_t;
+
+// a file copied in ranges: they share its fds, the last one to finish
+// closes them and reports the file
+typedef struct {
+    int src_fd;
+    int dst_fd;
+    off_t size;
+    long remaining;     // ranges not done yet, plus one held while splitting
+    int failed;
+    struct timespec mtime;  // of the source, for -i
+    bool delta;         // -d: the ranges update the target in place
+    size_t block;
+    off_t rewritten;
+} file_job_t;
+
+// a directory being copied: the entries in it are reached with *at() calls
+// relative to its fds, so the kernel resolves one name instead of a whole
+// path. Every task of an entry holds a reference, the last one closes it.
 typedef struct {
-    char src_path[PATH_MAX];
-    char dst_path[PATH_MAX];
+    int src_fd;
+    int dst_fd;         // O_PATH, only a base for *at() calls
+    long refs;
+    char* src_path;     // for messages only
+    char* dst_path;
+} dir_ref_t;
+
+typedef struct _Task {
+    struct _Task* next;
+    int type;
+    dir_ref_t* dir;     // the directory of the entry, NULL - the root directory
+    file_job_t* job;    // TASK_RANGE only
+    off_t offset;
+    off_t length;
+    batch_t* batch;     // TASK_BATCH only, with an empty name
+    bool have_stat;     // traversal already knows size, mode and mtime
+    off_t size;
+    mode_t mode;
+    struct timespec mtime;
+    char name[];        // of the entry in dir
 } task_t;
 
-int build_path(char* path, size_t size, const char* dir, const char* name);
-int open_with_retry(const char* path, int flags, mode_t mode);
-DIR* opendir_with_retry(const char* path);
-int create_directory_safe(const char* src_path, const char* dst_path);
-void *copy_file_thread(void* arg);
-int create_file_task(const char* src_path, const char* dst_path);
-int create_directory_task(const char* src_path, const char* dst_path);
-int process_single_entry(const char* src_dir, const char* dst_dir, const char* entry_name);
-void *work_directory_thread(void* arg);
+// fixed set of workers fed from one task stack
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    task_t* head;
+    long queued;        // tasks on the stack
+    long pending;       // queued plus running, 0 - the copy is complete
+    long failed;
+    int nworkers;
+    pthread_t* workers;
+} pool_t;
+
+int openat_with_retry(int dir_fd, const char* name, int flags, mode_t mode);
+int create_directory_safe(int dir_fd, const char* name, mode_t mode);
+dir_ref_t* dir_new(const dir_ref_t* parent, const char* src_name, const char* dst_name, int src_fd, int dst_fd);
+void dir_get(dir_ref_t* dir);
+void dir_put(dir_ref_t* dir);
+const char* task_src_path(const task_t* task);
+const char* task_dst_path(const task_t* task);
+void task_free(task_t* task);
+int copy_file(const task_t* task);
+int copy_range_task(const task_t* task);
+int create_file_task(dir_ref_t* dir, const char* name, const struct stat* stat_buf);
+int create_directory_task(dir_ref_t* dir, const char* name, const struct stat* stat_buf);
+int process_single_entry(dir_ref_t* dir, const char* entry_name, unsigned char type, task_t** batch);
+int copy_batch(const task_t* task);
+int work_directory(const task_t* task);
+int run_task(task_t* task);
+int pool_init(int nworkers);
+int pool_submit(task_t* task);
+task_t* pool_take(bool wait);
+void pool_done(int err);
+int pool_wait(void);
+void *worker_thread(void* arg);
+
+extern int verbose;
+extern off_t range_threshold;
+extern off_t small_threshold;
+extern int incremental;
+extern int delta_mode;
 
 #endif
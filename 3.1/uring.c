@@ -0,0 +1,464 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+#include "copy.h"
+
+static int uring_setup(unsigned entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// the kernel may predate some of the opcodes
+static int uring_probe(uring_t* ring) {
+    static const int needed[] = { IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ,
+        IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_CLOSE };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    if (probe == NULL) {
+        printf("uring_probe: memory allocation failed\n");
+        return ERROR;
+    }
+    int err = uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256);
+    if (err == ERROR) {
+        printf("uring_probe: io_uring_register() failed: %s\n", strerror(errno));
+        free(probe);
+        return ERROR;
+    }
+    for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+            printf("uring_probe: io_uring opcode %d is not supported\n", needed[i]);
+            free(probe);
+            return ERROR;
+        }
+    }
+    free(probe);
+    return SUCCESS;
+}
+
+static void uring_close(uring_t* ring) {
+    if (ring->buffers != NULL) {
+        munmap(ring->buffers, (size_t)URING_FILES * URING_BUFFER_SIZE);
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map != NULL) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    close(ring->fd);
+}
+
+static int uring_open(uring_t* ring) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    // at most two steps of every file are in flight at once
+    ring->fd = uring_setup(2 * URING_FILES, &params);
+    if (ring->fd == ERROR) {
+        printf("uring_open: io_uring_setup() failed: %s\n", strerror(errno));
+        return ERROR;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = ring->sq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        printf("uring_open: mmap() failed for the submission ring: %s\n", strerror(errno));
+        ring->sq_map = NULL;
+        uring_close(ring);
+        return ERROR;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            printf("uring_open: mmap() failed for the completion ring: %s\n", strerror(errno));
+            ring->cq_map = NULL;
+            uring_close(ring);
+            return ERROR;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        printf("uring_open: mmap() failed for the sqes: %s\n", strerror(errno));
+        ring->sqes = NULL;
+        uring_close(ring);
+        return ERROR;
+    }
+
+    char* sq = ring->sq_map;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+    char* cq = ring->cq_map;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    if (uring_probe(ring) != SUCCESS) {
+        uring_close(ring);
+        return ERROR;
+    }
+
+    ring->buffers = mmap(NULL, (size_t)URING_FILES * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, ERROR, 0);
+    if (ring->buffers == MAP_FAILED) {
+        printf("uring_open: mmap() failed for the buffers: %s\n", strerror(errno));
+        ring->buffers = NULL;
+        uring_close(ring);
+        return ERROR;
+    }
+    // pinned buffers save a page walk per read and write, plain ones still work
+    struct iovec iov[URING_FILES];
+    for (int i = 0; i < URING_FILES; i++) {
+        iov[i].iov_base = ring->buffers + (size_t)i * URING_BUFFER_SIZE;
+        iov[i].iov_len = URING_BUFFER_SIZE;
+    }
+    ring->fixed_buffers = uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, URING_FILES) == SUCCESS;
+
+    for (int i = 0; i < URING_FILES; i++) {
+        ring->files[i].task = NULL;
+    }
+    return SUCCESS;
+}
+
+// never runs out: every file has at most two steps in a ring of twice as many entries
+static struct io_uring_sqe* uring_sqe(uring_t* ring, int slot, int step) {
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = ((__u64)slot << URING_STEP_BITS) | step;
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    ring->files[slot].pending++;
+    return sqe;
+}
+
+static void uring_prep_open(uring_t* ring, int slot, int step, int dir_fd, const char* name, int flags, mode_t mode) {
+    struct io_uring_sqe* sqe = uring_sqe(ring, slot, step);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dir_fd;
+    sqe->addr = (__u64)(uintptr_t)name;
+    sqe->len = mode;
+    sqe->open_flags = flags | O_CLOEXEC;
+}
+
+static void uring_prep_rw(uring_t* ring, int slot, int step) {
+    uring_file_t* file = &ring->files[slot];
+    struct io_uring_sqe* sqe = uring_sqe(ring, slot, step);
+    char* buffer = ring->buffers + (size_t)slot * URING_BUFFER_SIZE;
+    if (step == URING_READ) {
+        sqe->opcode = ring->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = file->src_fd;
+        sqe->addr = (__u64)(uintptr_t)buffer;
+        sqe->len = URING_BUFFER_SIZE;
+        sqe->off = file->offset;
+    } else {
+        sqe->opcode = ring->fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = file->dst_fd;
+        sqe->addr = (__u64)(uintptr_t)(buffer + file->written);
+        sqe->len = file->chunk - file->written;
+        sqe->off = file->offset + file->written;
+    }
+    if (ring->fixed_buffers) {
+        sqe->buf_index = slot;
+    }
+}
+
+static void uring_prep_close(uring_t* ring, int slot, int fd) {
+    struct io_uring_sqe* sqe = uring_sqe(ring, slot, URING_CLOSE);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+}
+
+static void uring_start(uring_t* ring, int slot, task_t* task) {
+    uring_file_t* file = &ring->files[slot];
+    file->task = task;
+    file->src_fd = file->dst_fd = ERROR;
+    file->pending = 0;
+    file->failed = 0;
+    file->offset = 0;
+    file->chunk = file->written = 0;
+    ring->in_flight++;
+
+    // the mode for the target and the source fd are independent
+    struct io_uring_sqe* sqe = uring_sqe(ring, slot, URING_STATX);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = task->dir->src_fd;
+    sqe->addr = (__u64)(uintptr_t)task->name;
+    sqe->len = STATX_MODE | STATX_SIZE;
+    sqe->off = (__u64)(uintptr_t)&file->stx;
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    uring_prep_open(ring, slot, URING_OPEN_SRC, task->dir->src_fd, task->name, O_RDONLY, 0);
+}
+
+static void uring_finish(uring_t* ring, int slot) {
+    uring_file_t* file = &ring->files[slot];
+    // a failed file still has what it opened, closed here the plain way
+    if (file->src_fd != ERROR && close(file->src_fd) != SUCCESS) {
+        printf("uring_finish: close() failed for source fd: %s\n", strerror(errno));
+    }
+    if (file->dst_fd != ERROR && close(file->dst_fd) != SUCCESS) {
+        printf("uring_finish: close() failed for target fd: %s\n", strerror(errno));
+    }
+    if (!file->failed) {
+        copy_count(COPY_URING, file->offset);
+        if (verbose) {
+            printf("%s: %s\n", task_dst_path(file->task), copy_method_name(COPY_URING));
+        }
+    }
+    pool_done(file->failed ? ERROR : SUCCESS);
+    task_free(file->task);
+    file->task = NULL;
+    ring->in_flight--;
+}
+
+static const char* step_names[] = { "statx", "openat", "openat", "read", "write", "close" };
+
+// moves a file to its next step once the steps it waits for are done
+static void uring_complete(uring_t* ring, struct io_uring_cqe* cqe) {
+    int slot = cqe->user_data >> URING_STEP_BITS;
+    int step = cqe->user_data & ((1 << URING_STEP_BITS) - 1);
+    uring_file_t* file = &ring->files[slot];
+    file->pending--;
+
+    if (cqe->res < 0) {
+        const char* path = step == URING_OPEN_DST || step == URING_WRITE ? task_dst_path(file->task) : task_src_path(file->task);
+        printf("uring_complete: %s() failed for %s: %s\n", step_names[step], path, strerror(-cqe->res));
+        file->failed = 1;
+    } else if (step == URING_OPEN_SRC) {
+        file->src_fd = cqe->res;
+    } else if (step == URING_OPEN_DST) {
+        file->dst_fd = cqe->res;
+    } else if (step == URING_READ) {
+        file->chunk = cqe->res;
+        file->written = 0;
+    } else if (step == URING_WRITE) {
+        file->written += cqe->res;
+    }
+    if (file->pending > 0) {
+        return;
+    }
+    if (file->failed) {
+        uring_finish(ring, slot);
+        return;
+    }
+
+    switch (step) {
+    case URING_STATX:
+    case URING_OPEN_SRC:
+        uring_prep_open(ring, slot, URING_OPEN_DST, file->task->dir->dst_fd, file->task->name,
+            O_WRONLY | O_CREAT | O_TRUNC, file->stx.stx_mode);
+        break;
+    case URING_OPEN_DST:
+        uring_prep_rw(ring, slot, URING_READ);
+        break;
+    case URING_READ:
+        if (file->chunk > 0) {
+            uring_prep_rw(ring, slot, URING_WRITE);
+            break;
+        }
+        // end of file: the fds are closed in the ring, not by uring_finish()
+        uring_prep_close(ring, slot, file->src_fd);
+        uring_prep_close(ring, slot, file->dst_fd);
+        file->src_fd = file->dst_fd = ERROR;
+        break;
+    case URING_WRITE:
+        if (file->written < file->chunk) {
+            uring_prep_rw(ring, slot, URING_WRITE);
+            break;
+        }
+        file->offset += file->chunk;
+        uring_prep_rw(ring, slot, URING_READ);
+        break;
+    case URING_CLOSE:
+        uring_finish(ring, slot);
+        break;
+    }
+}
+
+static int uring_submit_and_wait(uring_t* ring) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    while (1) {
+        int n = uring_enter(ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (n != ERROR) {
+            ring->to_submit -= n;
+            return SUCCESS;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            printf("uring_submit_and_wait: io_uring_enter() failed: %s\n", strerror(errno));
+            return ERROR;
+        }
+    }
+}
+
+static void uring_reap(uring_t* ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+        head++;
+        // the slot in the ring is given back before handling, which may queue more
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        uring_complete(ring, &cqe);
+    }
+}
+
+static bool uring_busy(uring_t* ring) {
+    for (int i = 0; i < URING_FILES; i++) {
+        if (ring->files[i].task != NULL && ring->files[i].pending > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// after a failed io_uring_enter() the kernel may still run what it took, on
+// the names, fds, buffers and statx results of the slots: its completions
+// are collected, with no next steps, before any of that goes away. SQEs it
+// never took will not run. ERROR when the ring cannot even wait any more.
+static int uring_drain(uring_t* ring) {
+    for (int i = 0; i < URING_FILES; i++) {
+        ring->files[i].failed = 1;
+    }
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    for (; head != ring->sq_local_tail; head++) {
+        struct io_uring_sqe* sqe = &ring->sqes[ring->sq_array[head & *ring->sq_mask]];
+        ring->files[sqe->user_data >> URING_STEP_BITS].pending--;
+        // its fd was already handed over to the ring
+        if (sqe->opcode == IORING_OP_CLOSE) {
+            close(sqe->fd);
+        }
+    }
+    while (uring_busy(ring)) {
+        if (uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) == ERROR
+            && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            printf("uring_drain: io_uring_enter() failed: %s\n", strerror(errno));
+            return ERROR;
+        }
+        unsigned cq_head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; cq_head != tail; cq_head++) {
+            struct io_uring_cqe* cqe = &ring->cqes[cq_head & *ring->cq_mask];
+            int step = cqe->user_data & ((1 << URING_STEP_BITS) - 1);
+            uring_file_t* file = &ring->files[cqe->user_data >> URING_STEP_BITS];
+            file->pending--;
+            // opened after all: uring_finish() closes it
+            if (cqe->res >= 0 && step == URING_OPEN_SRC) {
+                file->src_fd = cqe->res;
+            } else if (cqe->res >= 0 && step == URING_OPEN_DST) {
+                file->dst_fd = cqe->res;
+            }
+        }
+        __atomic_store_n(ring->cq_head, cq_head, __ATOMIC_RELEASE);
+    }
+    return SUCCESS;
+}
+
+static int uring_free_slot(uring_t* ring) {
+    for (int i = 0; i < URING_FILES; i++) {
+        if (ring->files[i].task == NULL) {
+            return i;
+        }
+    }
+    return ERROR;
+}
+
+int uring_worker(void) {
+    static int reported;
+    int ring_failed = 0;
+    uring_t* ring = malloc(sizeof(uring_t));
+    if (ring == NULL) {
+        printf("uring_worker: memory allocation failed\n");
+        return ERROR;
+    }
+    if (uring_open(ring) != SUCCESS) {
+        if (!__atomic_exchange_n(&reported, 1, __ATOMIC_RELAXED)) {
+            printf("uring_worker: io_uring is not available, copying synchronously\n");
+        }
+        free(ring);
+        return ERROR;
+    }
+
+    while (1) {
+        // fill the free slots; block for work only when nothing is in flight
+        while (ring->in_flight < URING_FILES) {
+            task_t* task = pool_take(ring->in_flight == 0);
+            if (task == NULL) {
+                break;
+            }
+            // directories, ranges of a worker that fell back and, with -i or
+            // -d, files that may need little or no copying run right here
+            if (task->type != TASK_FILE || incremental || delta_mode) {
+                pool_done(run_task(task));
+                continue;
+            }
+            uring_start(ring, uring_free_slot(ring), task);
+        }
+        if (ring->in_flight == 0) {
+            break;
+        }
+        if (uring_submit_and_wait(ring) != SUCCESS) {
+            // the ring is unusable: whatever is in flight cannot complete
+            ring_failed = 1;
+            break;
+        }
+        uring_reap(ring);
+    }
+    if (ring_failed && uring_drain(ring) != SUCCESS) {
+        // the kernel may still write into the buffers and the statx results
+        // and read the names: closing the ring cancels what it runs, the
+        // memory and the tasks are left to it rather than freed under it
+        printf("uring_worker: %d files left unfinished, the ring is abandoned\n", ring->in_flight);
+        close(ring->fd);
+        for (int i = 0; i < URING_FILES; i++) {
+            if (ring->files[i].task != NULL) {
+                pool_done(ERROR);
+            }
+        }
+        return ERROR;
+    }
+    if (ring->in_flight != 0) {
+        printf("uring_worker: %d files left unfinished\n", ring->in_flight);
+        for (int i = 0; i < URING_FILES; i++) {
+            if (ring->files[i].task != NULL) {
+                ring->files[i].failed = 1;
+                uring_finish(ring, i);
+            }
+        }
+    }
+    uring_close(ring);
+    free(ring);
+    return ring_failed ? ERROR : SUCCESS;
+}
@@ -0,0 +1,72 @@
+#ifndef URING_H
+#define URING_H
+
+// io_uring copy engine: a worker keeps URING_FILES files in flight in its
+// own ring and moves each one through statx, open, read/write and close,
+// one step per completion. The steps of all its files go to the kernel in
+// one io_uring_enter(), data moves through buffers registered with the ring.
+// Raw syscalls, no liburing.
+
+#include <linux/io_uring.h>
+
+#include "cp_r.h"
+
+#define URING_FILES 32                  // files in flight per worker
+#define URING_BUFFER_SIZE (128 << 10)   // one per file slot
+
+// steps, kept in the low bits of user_data
+enum {
+    URING_STATX,
+    URING_OPEN_SRC,
+    URING_OPEN_DST,
+    URING_READ,
+    URING_WRITE,
+    URING_CLOSE,
+};
+#define URING_STEP_BITS 3
+
+typedef struct {
+    task_t* task;           // NULL - the slot is free
+    int src_fd;
+    int dst_fd;
+    int pending;            // submitted steps not completed yet
+    int failed;
+    struct statx stx;
+    off_t offset;           // of the chunk in the buffer
+    int chunk;              // bytes read into the buffer
+    int written;            // of them
+} uring_file_t;
+
+typedef struct {
+    int fd;
+    unsigned entries;
+    // submission ring
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sq_local_tail;         // sqes filled but not yet published
+    unsigned to_submit;
+    // completion ring
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+
+    char* buffers;                  // URING_FILES * URING_BUFFER_SIZE
+    bool fixed_buffers;             // registered with the ring
+    uring_file_t files[URING_FILES];
+    int in_flight;
+} uring_t;
+
+// serves the pool until the copy is complete; ERROR when io_uring is not
+// available or the ring broke, the caller goes on synchronously then
+int uring_worker(void);
+
+#endif